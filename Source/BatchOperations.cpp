@@ -0,0 +1,750 @@
+/*
+=====================================================================
+Copyright (c) 2018, Alexey Leushin
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or
+without modification, are permitted provided that the following
+conditions are met:
+- Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+- Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+- Neither the name of the copyright holders nor the names of its
+contributors may be used to endorse or promote products derived
+from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+=====================================================================
+*/
+
+//
+// This file contains unattended processing modes (worker pool, folder watch, conversion server)
+//
+
+////////// Includes //////////
+#include "main.h"
+
+////////// Definitions //////////
+#define SERVE_MSG_SZ 1024
+#define FILE_READY 0
+#define FILE_BUSY 1
+#define FILE_MISSING 2
+#define JOB_MEMORY_BASE 1024			// Memory that any job needs (in KB): file buffers, tables, output names
+#define JOB_MEMORY_PER_PIXEL 8			// Peak memory per pixel of largest texture (in bytes): PVR data, 16-bit image, dither copy, 8-bit result
+#define JOB_MEMORY_PER_PIXEL_32BIT 16	// Same for true color extraction: 32-bit image and its compressed copy are added
+
+////////// Structures //////////
+
+// File that has changed in watched folder
+struct sWatchedFile
+{
+	char FileName[MAX_PATH];	// Full file name
+	DWORD LastChange;			// Tick count of last change notification
+};
+
+// File that server or watch worker is processing right now
+struct sServedFile
+{
+	char FileName[MAX_PATH];	// Full file name
+	sServedFile * Next;			// File of another worker
+};
+
+////////// Global variables //////////
+CRITICAL_SECTION ServeLock;						// Protects list of served files
+CONDITION_VARIABLE ServeFileDone;				// Signaled when worker finishes file
+sServedFile * ServedFiles = NULL;				// Files that workers are processing
+
+////////// Functions //////////
+DWORD WINAPI JobThread(LPVOID Param);																		// Worker: take jobs from queue until it is closed
+int CheckFileReady(const char * FileName);																	// Check if nobody else holds file open
+DWORD WINAPI ServeThread(LPVOID Param);																		// Worker: serve clients of one pipe instance
+void ServeRequest(char * Request, char * Reply, uint ReplySize);											// Run job from request and prepare reply
+void ScanModel(const char * FileName, char * Reply, uint ReplySize);										// Describe model without processing it
+void ServeLockFile(const char * FileName, sServedFile * ptrServed);											// Wait until no other worker processes file and mark it as taken
+void ServeUnlockFile(sServedFile * ptrServed);																// Let other workers process file
+ulong EstimateJobMemory(int Job, const char * FileName);													// Estimate peak memory use of job from model headers (in KB)
+int CompareJobMemory(const void * ptrJob1, const void * ptrJob2);											// Order jobs from largest to smallest
+void ReleaseScratchBuffers();																				// Free scratch buffers of current thread
+
+HANDLE * StartWorkers(sJobQueue * ptrQueue)		// Start worker threads that take jobs from queue
+{
+	HANDLE * Workers;
+
+	// Workers share memory budget
+	ptrQueue->MemoryBudget = ProgOptions.MaxMemory * 1024;
+
+	// Workers queue their messages, one thread prints them
+	LogStart();
+
+	Workers = (HANDLE *)malloc(sizeof(HANDLE) * ProgOptions.Threads);
+	if (Workers == NULL)
+	{
+		LogPrint(LOG_ERROR, "Unable to allocate memory ...\n");
+		return NULL;
+	}
+
+	for (uint i = 0; i < ProgOptions.Threads; i++)
+	{
+		Workers[i] = CreateThread(NULL, 0, JobThread, ptrQueue, 0, NULL);
+		if (Workers[i] == NULL)
+		{
+			LogPrint(LOG_ERROR, "Error: can't start worker #%u\n", i + 1);
+			ProgOptions.Threads = i;
+			break;
+		}
+	}
+
+	return Workers;
+}
+
+void StopWorkers(sJobQueue * ptrQueue, HANDLE * Workers)		// Close queue and wait until workers finish
+{
+	ptrQueue->Close();
+
+	if (Workers != NULL)
+	{
+		for (uint i = 0; i < ProgOptions.Threads; i++)
+		{
+			WaitForSingleObject(Workers[i], INFINITE);
+			CloseHandle(Workers[i]);
+		}
+
+		free(Workers);
+	}
+
+	// Messages of workers are printed before batch summary
+	LogStop();
+}
+
+DWORD WINAPI JobThread(LPVOID Param)		// Worker: take jobs from queue until it is closed
+{
+	sJobQueue * ptrQueue = (sJobQueue *)Param;
+	sJob Job;
+	sServedFile Served;
+	long long TraceStart = TraceClock();
+
+	while (ptrQueue->Pop(&Job) == true)
+	{
+		// Time spent waiting for job (empty queue or memory budget)
+		TraceSpan("wait", TraceStart, Job.FileName, 0, 0);
+
+		// Benchmark wants to know how long every model took
+		long long JobStart = (ptrQueue->Latencies != NULL) ? BenchClock() : 0;
+		if (ptrQueue->LockFiles == true)
+			ServeLockFile(Job.FileName, &Served);
+		ptrQueue->CountResult(ProcessFile(Job.Job, Job.FileName));
+		if (ptrQueue->LockFiles == true)
+			ServeUnlockFile(&Served);
+		if (ptrQueue->Latencies != NULL)
+			ptrQueue->AddLatency(BenchClock() - JobStart);
+
+		// Memory of finished job is counted as free, so it should really be free
+		if (ptrQueue->MemoryBudget != 0)
+			ReleaseScratchBuffers();
+
+		ptrQueue->Release(&Job);
+		TraceStart = TraceClock();
+	}
+
+	ReleaseScratchBuffers();
+
+	return 0;
+}
+
+void ReleaseScratchBuffers()		// Free scratch buffers of current thread
+{
+	while (ScratchBuffers != NULL)
+	{
+		sScratchBuffer * ptrBuffer = ScratchBuffers;
+
+		ScratchBuffers = ptrBuffer->Next;
+		free(ptrBuffer->Data);
+		ptrBuffer->Data = NULL;
+		ptrBuffer->Size = 0;
+		ptrBuffer->Listed = false;
+		ptrBuffer->Next = NULL;
+	}
+}
+
+ulong EstimateJobMemory(int Job, const char * FileName)		// Estimate peak memory use of job from model headers (in KB)
+{
+	FILE * ptrModelFile;
+	sModelHeader ModelHeader;
+	sModelTextureEntry TextureEntry;
+	sPVRImageHeader PVRImageHeader;
+	ulong PVRDataOffset;
+	sTexture Texture;
+	ulong MaxPixels = 0;
+	ulong BytesPerPixel;
+	char Extension[5];
+
+	if (fopen_s(&ptrModelFile, FileName, "rb") != 0)
+		return JOB_MEMORY_BASE;
+
+	// Loose texture: size comes from its own header
+	if (Job == JOB_PVR)
+	{
+		if (Texture.LoadPVRHeader(&ptrModelFile, 0, &PVRImageHeader, &PVRDataOffset) == true)
+			MaxPixels = PVRImageHeader.Width * PVRImageHeader.Height;
+		fclose(ptrModelFile);
+
+		BytesPerPixel = (ProgOptions.TrueColor == true) ? JOB_MEMORY_PER_PIXEL_32BIT : JOB_MEMORY_PER_PIXEL;
+
+		return JOB_MEMORY_BASE + (MaxPixels * BytesPerPixel + 1023) / 1024;
+	}
+
+	if (FileSize(&ptrModelFile) < sizeof(sModelHeader))
+	{
+		fclose(ptrModelFile);
+		return JOB_MEMORY_BASE;
+	}
+
+	ModelHeader.UpdateFromFile(&ptrModelFile);
+	if (ModelHeader.CheckModel() != NORMAL_MODEL)
+	{
+		fclose(ptrModelFile);
+		return JOB_MEMORY_BASE;
+	}
+
+	// Textures are processed one at a time, so largest one sets the peak
+	for (ulong i = 0; i < ModelHeader.TextureCount; i++)
+	{
+		TextureEntry.UpdateFromFile(&ptrModelFile, ModelHeader.TextureTableOffset, i);
+		TextureEntry.Name[sizeof(TextureEntry.Name) - 1] = '\0';
+
+		// Dimensions of PVR textures are taken from their own headers
+		FileGetExtension(TextureEntry.Name, Extension, sizeof(Extension));
+		if (!strcmp(Extension, ".pvr") && Texture.LoadPVRHeader(&ptrModelFile, TextureEntry.Offset, &PVRImageHeader, &PVRDataOffset) == true)
+		{
+			TextureEntry.Width = PVRImageHeader.Width;
+			TextureEntry.Height = PVRImageHeader.Height;
+		}
+
+		if (TextureEntry.Width * TextureEntry.Height > MaxPixels)
+			MaxPixels = TextureEntry.Width * TextureEntry.Height;
+	}
+
+	fclose(ptrModelFile);
+
+	BytesPerPixel = (Job == JOB_EXTRACT && ProgOptions.TrueColor == true) ? JOB_MEMORY_PER_PIXEL_32BIT : JOB_MEMORY_PER_PIXEL;
+
+	return JOB_MEMORY_BASE + (ModelHeader.TextureCount * sizeof(sModelTextureEntry) + MaxPixels * BytesPerPixel + 1023) / 1024;
+}
+
+int CompareJobMemory(const void * ptrJob1, const void * ptrJob2)		// Order jobs from largest to smallest
+{
+	ulong Memory1 = ((const sJob *)ptrJob1)->Memory;
+	ulong Memory2 = ((const sJob *)ptrJob2)->Memory;
+
+	return (Memory1 < Memory2) ? 1 : (Memory1 > Memory2) ? -1 : 0;
+}
+
+uint ProcessFiles(int Job, char ** FileNames, int FileCount)		// Run job on every file (in parallel when there are several files), returns number of failed jobs
+{
+	sJobQueue Queue;
+	HANDLE * Workers;
+	uint Failed = 0;
+
+	// Leave files of other machines to them
+	FileCount = SelectShard(FileNames, FileCount);
+	if (FileCount == 0)
+	{
+		puts("Nothing to do ...");
+		return 0;
+	}
+
+	// Single file is processed right away
+	if (FileCount == 1)
+		return (ProcessFile(Job, FileNames[0]) == RESULT_OK) ? 0 : 1;
+
+	// Several workers can't share keyboard
+	ProgOptions.Headless = true;
+
+	Queue.Initialize();
+	if (QueueJobs(&Queue, Job, FileNames, FileCount) == false)
+	{
+		Queue.Destroy();
+		return FileCount;
+	}
+
+	// Workers stop when queue runs empty
+	Workers = StartWorkers(&Queue);
+	StopWorkers(&Queue, Workers);
+	Queue.Destroy();
+
+	// One failed model doesn't stop the batch, failures are summed up at the end
+	for (int i = RESULT_OK + 1; i < RESULT_COUNT; i++)
+		Failed += Queue.Results[i];
+	printf("\nJobs: %i, ok: %u, failed: %u\n", FileCount, Queue.Results[RESULT_OK], Failed);
+	for (int i = RESULT_OK + 1; i < RESULT_COUNT; i++)
+		if (Queue.Results[i] > 0)
+			printf("  %s: %u\n", GetResultName(i), Queue.Results[i]);
+
+	return Failed;
+}
+
+bool QueueJobs(sJobQueue * ptrQueue, int Job, char ** FileNames, int FileCount)		// Add job for every file to queue, largest first
+{
+	sJob * Jobs;
+
+	// Estimate memory use of every job and start from largest ones,
+	// so small jobs fill the gaps left in memory budget at the end
+	Jobs = (sJob *)malloc(sizeof(sJob) * FileCount);
+	if (Jobs == NULL)
+	{
+		puts("Unable to allocate memory ...");
+		return false;
+	}
+
+	for (int i = 0; i < FileCount; i++)
+	{
+		Jobs[i].Job = Job;
+		strncpy(Jobs[i].FileName, FileNames[i], sizeof(Jobs[i].FileName) - 1);
+		Jobs[i].FileName[sizeof(Jobs[i].FileName) - 1] = '\0';
+		Jobs[i].Memory = EstimateJobMemory(Job, FileNames[i]);
+	}
+	qsort(Jobs, FileCount, sizeof(sJob), CompareJobMemory);
+
+	for (int i = 0; i < FileCount; i++)
+		ptrQueue->Push(Jobs[i].Job, Jobs[i].FileName, Jobs[i].Memory);
+	free(Jobs);
+
+	return true;
+}
+
+int CheckFileReady(const char * FileName)		// Check if nobody else holds file open
+{
+	HANDLE hFile;
+
+	// Exclusive open fails while writer still has file open
+	hFile = CreateFileA(FileName, GENERIC_READ, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return (GetLastError() == ERROR_SHARING_VIOLATION) ? FILE_BUSY : FILE_MISSING;
+
+	CloseHandle(hFile);
+
+	return FILE_READY;
+}
+
+void WatchFolder(const char * FolderName)		// Convert models that appear in folder
+{
+	HANDLE hFolder;
+	OVERLAPPED Overlapped;
+	DWORD NotifyBuffer[16384];				// Change notifications (should be DWORD aligned)
+	DWORD BytesReturned;
+	bool ReadPending = false;
+
+	sWatchedFile * Changed = NULL;			// Files that wait until writer is done with them
+	uint ChangedCount = 0;
+	uint ChangedCapacity = 0;
+
+	sJobQueue Queue;
+	HANDLE * Workers;
+
+	// Open folder for change notifications
+	hFolder = CreateFileA(FolderName,
+		FILE_LIST_DIRECTORY,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL,
+		OPEN_EXISTING,
+		FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED,
+		NULL);
+	if (hFolder == INVALID_HANDLE_VALUE)
+	{
+		LogPrint(LOG_ERROR, "Error: can't watch folder: %s\n", FolderName);
+		return;
+	}
+
+	memset(&Overlapped, 0x00, sizeof(Overlapped));
+	Overlapped.hEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+
+	// Nobody would press keys for us
+	ProgOptions.Headless = true;
+
+	// Start workers, model that changes again while it's converted is queued again and waits for running job
+	InitializeCriticalSection(&ServeLock);
+	InitializeConditionVariable(&ServeFileDone);
+	Queue.Initialize();
+	Queue.LockFiles = true;
+	Workers = StartWorkers(&Queue);
+
+	LogPrint(LOG_INFO, "Watching folder %s with %u workers ...\n", FolderName, ProgOptions.Threads);
+
+	while (true)
+	{
+		// Ask for next portion of changes
+		if (ReadPending == false)
+		{
+			if (ReadDirectoryChangesW(hFolder, NotifyBuffer, sizeof(NotifyBuffer), TRUE, FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_LAST_WRITE, NULL, &Overlapped, NULL) == FALSE)
+			{
+				LogPrint(LOG_ERROR, "Error: can't watch folder: %s\n", FolderName);
+				break;
+			}
+			ReadPending = true;
+		}
+
+		// Sleep until something changes, or until changed files settle down
+		if (WaitForSingleObject(Overlapped.hEvent, (ChangedCount > 0) ? WATCH_DEBOUNCE_MS : INFINITE) == WAIT_OBJECT_0)
+		{
+			ReadPending = false;
+			ResetEvent(Overlapped.hEvent);
+
+			if (GetOverlappedResult(hFolder, &Overlapped, &BytesReturned, FALSE) == FALSE)
+			{
+				LogPrint(LOG_ERROR, "Error: can't watch folder: %s\n", FolderName);
+				break;
+			}
+
+			if (BytesReturned == 0)
+				LogPrint(LOG_ERROR, "Warning: too many changes at once, some models may be missed ...\n");
+
+			// Remember changed models
+			FILE_NOTIFY_INFORMATION * ptrInfo = (FILE_NOTIFY_INFORMATION *)NotifyBuffer;
+			while (BytesReturned != 0)
+			{
+				if (ptrInfo->Action == FILE_ACTION_ADDED || ptrInfo->Action == FILE_ACTION_MODIFIED || ptrInfo->Action == FILE_ACTION_RENAMED_NEW_NAME)
+				{
+					char Name[MAX_PATH];
+					char FullName[MAX_PATH];
+					char Extension[5];
+					int NameLength;
+
+					NameLength = WideCharToMultiByte(CP_ACP, 0, ptrInfo->FileName, ptrInfo->FileNameLength / sizeof(WCHAR), Name, sizeof(Name) - 1, NULL, NULL);
+					Name[NameLength] = '\0';
+					snprintf(FullName, sizeof(FullName), "%s\\%s", FolderName, Name);
+
+					// Skip our own backups and everything that isn't a model
+					FileGetExtension(FullName, Extension, sizeof(Extension));
+					if (NameLength > 4 && !strcmp(Extension, ".mdl") && strstr(FullName, "-backup.mdl") == NULL)
+					{
+						// Update time of last change
+						uint i;
+						for (i = 0; i < ChangedCount; i++)
+							if (!strcmp(Changed[i].FileName, FullName))
+								break;
+
+						if (i == ChangedCount)
+						{
+							if (ChangedCount == ChangedCapacity)
+							{
+								uint NewCapacity = (ChangedCapacity == 0) ? 64 : ChangedCapacity * 2;
+								sWatchedFile * NewChanged = (sWatchedFile *)realloc(Changed, NewCapacity * sizeof(sWatchedFile));
+								if (NewChanged != NULL)
+								{
+									Changed = NewChanged;
+									ChangedCapacity = NewCapacity;
+								}
+							}
+
+							// Only this model is missed if list can't grow, watching goes on
+							if (ChangedCount < ChangedCapacity)
+							{
+								strcpy(Changed[i].FileName, FullName);
+								ChangedCount++;
+							}
+							else
+							{
+								LogPrint(LOG_ERROR, "Unable to allocate memory, skipping: %s\n", FullName);
+							}
+						}
+
+						if (i < ChangedCount)
+							Changed[i].LastChange = GetTickCount();
+					}
+				}
+
+				if (ptrInfo->NextEntryOffset == 0)
+					break;
+				ptrInfo = (FILE_NOTIFY_INFORMATION *)((uchar *)ptrInfo + ptrInfo->NextEntryOffset);
+			}
+		}
+
+		// Convert models that didn't change for a while and were closed by writer
+		DWORD Now = GetTickCount();
+		for (uint i = 0; i < ChangedCount; )
+		{
+			if (Now - Changed[i].LastChange < WATCH_DEBOUNCE_MS)
+			{
+				i++;
+				continue;
+			}
+
+			int State = CheckFileReady(Changed[i].FileName);
+			if (State == FILE_BUSY)
+			{
+				Changed[i].LastChange = Now;
+				i++;
+				continue;
+			}
+
+			// Converted models (and models that are still waiting in queue) are skipped
+			if (State == FILE_READY && CheckPVRModel(Changed[i].FileName) == true && Queue.Contains(Changed[i].FileName) == false)
+				Queue.Push(JOB_CONVERT, Changed[i].FileName, EstimateJobMemory(JOB_CONVERT, Changed[i].FileName));
+
+			Changed[i] = Changed[--ChangedCount];
+		}
+	}
+
+	// Let workers finish queued jobs
+	StopWorkers(&Queue, Workers);
+	Queue.Destroy();
+	DeleteCriticalSection(&ServeLock);
+
+	if (ReadPending == true)
+		CancelIo(hFolder);
+	CloseHandle(Overlapped.hEvent);
+	CloseHandle(hFolder);
+	free(Changed);
+}
+
+void ServeModels(const char * PipeName)		// Run conversion server on named pipe
+{
+	HANDLE * Workers;
+
+	// Nobody would press keys for us
+	ProgOptions.Headless = true;
+	LogStart();
+	InitializeCriticalSection(&ServeLock);
+	InitializeConditionVariable(&ServeFileDone);
+
+	LogPrint(LOG_INFO, "Serving requests on %s with %u workers ...\n", PipeName, ProgOptions.Threads);
+
+	// Every worker owns one pipe instance, so up to Threads clients are served at once
+	Workers = (HANDLE *)malloc(sizeof(HANDLE) * ProgOptions.Threads);
+	if (Workers == NULL)
+	{
+		LogPrint(LOG_ERROR, "Unable to allocate memory ...\n");
+		DeleteCriticalSection(&ServeLock);
+		LogStop();
+		return;
+	}
+
+	for (uint i = 0; i < ProgOptions.Threads; i++)
+	{
+		Workers[i] = CreateThread(NULL, 0, ServeThread, (LPVOID)PipeName, 0, NULL);
+		if (Workers[i] == NULL)
+		{
+			LogPrint(LOG_ERROR, "Error: can't start worker #%u\n", i + 1);
+			ProgOptions.Threads = i;
+			break;
+		}
+	}
+
+	// Workers run until pipe can't be created anymore
+	for (uint i = 0; i < ProgOptions.Threads; i++)
+	{
+		WaitForSingleObject(Workers[i], INFINITE);
+		CloseHandle(Workers[i]);
+	}
+
+	free(Workers);
+	DeleteCriticalSection(&ServeLock);
+	LogStop();
+}
+
+DWORD WINAPI ServeThread(LPVOID Param)		// Worker: serve clients of one pipe instance
+{
+	const char * PipeName = (const char *)Param;
+	char Request[SERVE_MSG_SZ];
+	char Reply[SERVE_MSG_SZ];
+	DWORD BytesRead;
+	DWORD BytesWritten;
+	HANDLE hPipe;
+
+	while (true)
+	{
+		// Create new pipe instance
+		hPipe = CreateNamedPipeA(PipeName,
+			PIPE_ACCESS_DUPLEX,
+			PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT,
+			PIPE_UNLIMITED_INSTANCES,
+			SERVE_MSG_SZ,
+			SERVE_MSG_SZ,
+			0,
+			NULL);
+		if (hPipe == INVALID_HANDLE_VALUE)
+		{
+			LogPrint(LOG_ERROR, "Error: can't create pipe: %s\n", PipeName);
+			return 1;
+		}
+
+		// Wait for client
+		if (ConnectNamedPipe(hPipe, NULL) == FALSE && GetLastError() != ERROR_PIPE_CONNECTED)
+		{
+			CloseHandle(hPipe);
+			continue;
+		}
+
+		// Process requests until client disconnects (one message - one job)
+		while (ReadFile(hPipe, Request, sizeof(Request) - 1, &BytesRead, NULL) == TRUE)
+		{
+			Request[BytesRead] = '\0';
+			ServeRequest(Request, Reply, sizeof(Reply));
+
+			if (WriteFile(hPipe, Reply, strlen(Reply), &BytesWritten, NULL) == FALSE)
+				break;
+		}
+
+		FlushFileBuffers(hPipe);
+		DisconnectNamedPipe(hPipe);
+		CloseHandle(hPipe);
+	}
+}
+
+void ServeRequest(char * Request, char * Reply, uint ReplySize)		// Run job from request and prepare reply
+{
+	char * FileName;
+	sServedFile Served;
+	int Job;
+	int Result = RESULT_OK;
+
+	// Drop line break (if client sent one)
+	Request[strcspn(Request, "\r\n")] = '\0';
+
+	// Request format: "<command> <file name>"
+	FileName = strchr(Request, ' ');
+	if (FileName == NULL)
+	{
+		snprintf(Reply, ReplySize, "error: can't recognise request");
+		return;
+	}
+	*FileName++ = '\0';
+
+	if (CheckFile(FileName) == false)
+	{
+		snprintf(Reply, ReplySize, "error: can't open file: %s", FileName);
+		return;
+	}
+
+	if (!strcmp(Request, "convert"))
+		Job = JOB_CONVERT;
+	else if (!strcmp(Request, "extract"))
+		Job = JOB_EXTRACT;
+	else if (!strcmp(Request, "thumbs"))
+		Job = JOB_THUMBS;
+	else if (!strcmp(Request, "pvr"))
+		Job = JOB_PVR;
+	else if (!strcmp(Request, "verify"))
+		Job = JOB_VERIFY;
+	else if (!strcmp(Request, "scan"))
+		Job = JOB_SCAN;
+	else
+	{
+		snprintf(Reply, ReplySize, "error: unknown command: %s", Request);
+		return;
+	}
+
+	// Jobs of one model run one after another, otherwise they would share its temporary file and backup
+	ServeLockFile(FileName, &Served);
+
+	if (Job == JOB_SCAN)
+		ScanModel(FileName, Reply, ReplySize);
+	else
+		Result = ProcessFile(Job, FileName);
+
+	ServeUnlockFile(&Served);
+
+	if (Job == JOB_SCAN)
+		return;
+
+	if (Result == RESULT_OK)
+		snprintf(Reply, ReplySize, "ok");
+	else
+		snprintf(Reply, ReplySize, "error: %s failed: %s", Request, GetResultName(Result));
+}
+
+void ServeLockFile(const char * FileName, sServedFile * ptrServed)		// Wait until no other worker processes file and mark it as taken
+{
+	bool Busy = true;
+
+	// Same file can be named in different ways (relative path, other case)
+	if (GetFullPathNameA(FileName, sizeof(ptrServed->FileName), ptrServed->FileName, NULL) == 0)
+	{
+		strncpy(ptrServed->FileName, FileName, sizeof(ptrServed->FileName) - 1);
+		ptrServed->FileName[sizeof(ptrServed->FileName) - 1] = '\0';
+	}
+
+	EnterCriticalSection(&ServeLock);
+
+	while (Busy == true)
+	{
+		Busy = false;
+		for (sServedFile * ptrOther = ServedFiles; ptrOther != NULL; ptrOther = ptrOther->Next)
+		{
+			if (_stricmp(ptrOther->FileName, ptrServed->FileName) == 0)
+			{
+				Busy = true;
+				SleepConditionVariableCS(&ServeFileDone, &ServeLock, INFINITE);
+				break;
+			}
+		}
+	}
+
+	ptrServed->Next = ServedFiles;
+	ServedFiles = ptrServed;
+
+	LeaveCriticalSection(&ServeLock);
+}
+
+void ServeUnlockFile(sServedFile * ptrServed)		// Let other workers process file
+{
+	EnterCriticalSection(&ServeLock);
+
+	for (sServedFile ** ptrLink = &ServedFiles; *ptrLink != NULL; ptrLink = &(*ptrLink)->Next)
+	{
+		if (*ptrLink == ptrServed)
+		{
+			*ptrLink = ptrServed->Next;
+			break;
+		}
+	}
+
+	LeaveCriticalSection(&ServeLock);
+	WakeAllConditionVariable(&ServeFileDone);
+}
+
+void ScanModel(const char * FileName, char * Reply, uint ReplySize)		// Describe model without processing it
+{
+	FILE * ptrModelFile;
+	sModelHeader ModelHeader;
+
+	switch (CheckModel(FileName))
+	{
+	case NORMAL_MODEL:
+		if (SafeFileOpen(&ptrModelFile, FileName, "rb") == false)
+		{
+			snprintf(Reply, ReplySize, "error: can't open file: %s", FileName);
+			break;
+		}
+		ModelHeader.UpdateFromFile(&ptrModelFile);
+		fclose(ptrModelFile);
+
+		snprintf(Reply, ReplySize, "ok %s %u", CheckPVRModel(FileName) ? "pvr" : "normal", ModelHeader.TextureCount);
+		break;
+	case NOTEXTURES_MODEL:
+		snprintf(Reply, ReplySize, "ok notextures 0");
+		break;
+	case SEQ_MODEL:
+		snprintf(Reply, ReplySize, "ok sequence 0");
+		break;
+	case DUMMY_MODEL:
+		snprintf(Reply, ReplySize, "ok dummy 0");
+		break;
+	default:
+		snprintf(Reply, ReplySize, "ok unknown 0");
+		break;
+	}
+}
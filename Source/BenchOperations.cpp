@@ -0,0 +1,696 @@
+/*
+=====================================================================
+Copyright (c) 2018, Alexey Leushin
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or
+without modification, are permitted provided that the following
+conditions are met:
+- Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+- Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+- Neither the name of the copyright holders nor the names of its
+contributors may be used to endorse or promote products derived
+from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+=====================================================================
+*/
+
+//
+// This file contains corpus benchmark (throughput and latency of batch jobs, comparison with stored baseline)
+//
+
+////////// Includes //////////
+#include "main.h"
+
+////////// Definitions //////////
+#define BENCH_RUNS 3					// Every pass is repeated, fastest run counts (others are disturbed by cold caches and other programs)
+#define BENCH_FOLDER "pvr2mdl-bench"	// Work folder (in temporary folder unless --out is given)
+#define BENCH_GEN_MODELS 32				// Size of generated corpus
+#define BENCH_GEN_TEXTURES 6			// Textures in every generated model
+#define BENCH_GEN_MODEL_DATA 1000		// Size of mesh data in front of texture table of generated model (not looked at by jobs)
+#define BENCH_GEN_MAX_SIDE 256			// Largest side of generated texture
+#define BENCH_METRIC_COUNT 6
+#define BENCH_SAMPLE_MS 2				// How often working set is looked at while pass runs
+
+////////// Structures //////////
+
+// Results of one pass (one job with one number of workers)
+struct sBenchResult
+{
+	int Job;					// JOB_CONVERT or JOB_EXTRACT
+	uint Threads;				// How many workers were running
+	double Metrics[BENCH_METRIC_COUNT];	// Models per second, MB per second, median and 99th percentile time of model (in ms), peak growth of working set (in MB), file system calls
+	uint Failed;				// How many jobs failed
+};
+
+// Working set of process that is watched while pass runs
+struct sBenchMemory
+{
+	HANDLE StopEvent;			// Set when pass is over
+	SIZE_T StartSize;			// Working set before pass
+	SIZE_T PeakSize;			// Largest working set that was seen
+};
+
+// Description of benchmark metric
+struct sBenchMetric
+{
+	const char * Name;			// Name in tables and baseline file
+	bool HigherIsBetter;		// Throughput gets better when it grows, time and memory when they shrink
+	bool Growth;				// Checked against --max-growth instead of --max-regression
+};
+
+////////// Global variables //////////
+static const sBenchMetric BenchMetrics[BENCH_METRIC_COUNT] = {
+	{ "models/s", true, false },
+	{ "MB/s", true, false },
+	{ "p50_ms", false, false },
+	{ "p99_ms", false, false },
+	{ "peak_MB", false, true },
+	{ "io_calls", false, true }
+};
+
+////////// Functions //////////
+bool BenchGenerateCorpus(const char * Folder, char *** ptrFileNames, int * ptrFileCount, int * ptrCapacity);	// Write generated Dreamcast models into folder and add them to list
+bool BenchGenerateModel(const char * FileName, uint Seed);													// Write Dreamcast model with PVR textures of different formats, sizes and color counts
+ulong BenchMakePVR(uchar * Buffer, ulong Width, ulong Height, uchar ImageFormat, uint Kind, uint * ptrSeed);	// Make PVR texture in buffer, returns its size
+ushort BenchPixel(ulong X, ulong Y, ulong Width, ulong Height, uint Kind, uint * ptrSeed);					// Color of generated pixel
+ulong BenchTwiddle(ulong X, ulong Y);																		// Place of pixel in twiddled image
+uint BenchRandom(uint * ptrSeed);																			// Next number of generator that gives the same corpus everywhere
+bool BenchRunPass(int Job, uint Threads, char ** FileNames, int FileCount, double TotalMB, sBenchResult * ptrResult);	// Run job over corpus with given number of workers
+int CompareLatency(const void * ptrTime1, const void * ptrTime2);											// Order job times from shortest to longest
+double BenchGetIOCalls();																					// Get file system calls of process
+SIZE_T BenchGetWorkingSet();																				// Get current working set of process (in bytes)
+DWORD WINAPI BenchMemoryThread(LPVOID Param);																// Sampler: remember largest working set until pass is over
+void BenchPrintResult(const sBenchResult * ptrResult);														// Print one row of result table
+bool BenchSaveBaseline(const char * FileName, const sBenchResult * Results, uint ResultCount, int FileCount, unsigned long long TotalSize);	// Save results as baseline
+uint BenchCompareBaseline(const char * FileName, const sBenchResult * Results, uint ResultCount, int FileCount, unsigned long long TotalSize);	// Compare results with baseline, returns number of regressions
+
+long long BenchClock()		// Get time for benchmark (in microseconds)
+{
+	static LARGE_INTEGER Frequency = { 0 };
+	LARGE_INTEGER Counter;
+
+	if (Frequency.QuadPart == 0)
+		QueryPerformanceFrequency(&Frequency);
+	QueryPerformanceCounter(&Counter);
+
+	return (long long)((double)Counter.QuadPart * 1000000.0 / (double)Frequency.QuadPart);
+}
+
+uint RunBenchmark(char ** FileNames, int FileCount)		// Measure convert and extract over corpus (generated one if there are no files), returns number of failures and regressions
+{
+	static const int BenchJobs[2] = { JOB_CONVERT, JOB_EXTRACT };
+	char cWorkFolder[MAX_PATH];
+	char cPath[MAX_PATH];
+	char ** Corpus = NULL;
+	int CorpusCount = 0;
+	int Capacity = 0;
+	sBenchResult Results[2 * BENCH_MAX_PASSES];
+	uint ResultCount = 0;
+	unsigned long long TotalSize = 0;
+	uint DefaultThreads = ProgOptions.Threads;
+	uint Failed = 0;
+	FILE * ptrFile;
+
+	// Results go to work folder, so corpus is never changed and every run starts from the same models
+	if (ProgOptions.OutFolder[0] != '\0')
+		snprintf(cWorkFolder, sizeof(cWorkFolder), "%s", ProgOptions.OutFolder);
+	else
+	{
+		GetTempPathA(sizeof(cPath), cPath);
+		snprintf(cWorkFolder, sizeof(cWorkFolder), "%s%s", cPath, BENCH_FOLDER);
+	}
+	snprintf(cPath, sizeof(cPath), "%s\\out", cWorkFolder);
+	ProgOptions.SetOutFolder(cPath);
+
+	// Console output would be measured too
+	ProgOptions.Headless = true;
+	if (ProgOptions.LogLevelSet == false)
+		ProgOptions.SetLogLevel(LOG_ERROR);
+
+	// One worker shows cost of single model, default count shows what batch gets
+	if (ProgOptions.BenchThreadCount == 0)
+	{
+		ProgOptions.BenchThreads[ProgOptions.BenchThreadCount++] = 1;
+		if (DefaultThreads > 1)
+			ProgOptions.BenchThreads[ProgOptions.BenchThreadCount++] = DefaultThreads;
+	}
+
+	// Folders are searched for models, backups are skipped
+	for (int i = 0; i < FileCount; i++)
+	{
+		if (CheckDir(FileNames[i]) == true)
+			FileListFolder(FileNames[i], ".mdl", &Corpus, &CorpusCount, &Capacity);
+		else
+			FileListAdd(&Corpus, &CorpusCount, &Capacity, FileNames[i]);
+	}
+	int Kept = 0;
+	for (int i = 0; i < CorpusCount; i++)
+	{
+		ulong Length = strlen(Corpus[i]);
+		if (Length >= 11 && _stricmp(&Corpus[i][Length - 11], "-backup.mdl") == 0)
+			free(Corpus[i]);
+		else
+			Corpus[Kept++] = Corpus[i];
+	}
+	CorpusCount = Kept;
+
+	if (FileCount == 0)
+	{
+		snprintf(cPath, sizeof(cPath), "%s\\corpus", cWorkFolder);
+		if (BenchGenerateCorpus(cPath, &Corpus, &CorpusCount, &Capacity) == false)
+		{
+			FileListFree(Corpus, CorpusCount);
+			return 1;
+		}
+	}
+
+	if (CorpusCount == 0)
+	{
+		puts("Can't find models.");
+		return 1;
+	}
+
+	for (int i = 0; i < CorpusCount; i++)
+	{
+		if (fopen_s(&ptrFile, Corpus[i], "rb") == 0)
+		{
+			TotalSize += FileSize(&ptrFile);
+			fclose(ptrFile);
+		}
+	}
+
+	printf("\nBenchmark: %i models, %.2f MB, fastest of %u runs per pass\n", CorpusCount, TotalSize / 1048576.0, BENCH_RUNS);
+	printf("%-8s %7s", "job", "threads");
+	for (int i = 0; i < BENCH_METRIC_COUNT; i++)
+		printf(" %10s", BenchMetrics[i].Name);
+	printf("\n");
+
+	for (int j = 0; j < 2; j++)
+	{
+		for (uint i = 0; i < ProgOptions.BenchThreadCount; i++)
+		{
+			if (BenchRunPass(BenchJobs[j], ProgOptions.BenchThreads[i], Corpus, CorpusCount, TotalSize / 1048576.0, &Results[ResultCount]) == false)
+			{
+				Failed++;
+				continue;
+			}
+
+			BenchPrintResult(&Results[ResultCount]);
+			Failed += Results[ResultCount].Failed;
+			ResultCount++;
+		}
+	}
+
+	ProgOptions.Threads = DefaultThreads;
+
+	if (Failed > 0)
+		printf("\n%u jobs failed, benchmark doesn't measure what it should.\n", Failed);
+
+	// Missing baseline is made from this run, so next runs have something to compare with
+	if (ProgOptions.BaselineFile[0] != '\0')
+	{
+		if (CheckFile(ProgOptions.BaselineFile) == true)
+			Failed += BenchCompareBaseline(ProgOptions.BaselineFile, Results, ResultCount, CorpusCount, TotalSize);
+		else if (BenchSaveBaseline(ProgOptions.BaselineFile, Results, ResultCount, CorpusCount, TotalSize) == false)
+			Failed++;
+	}
+
+	FileListFree(Corpus, CorpusCount);
+
+	return Failed;
+}
+
+bool BenchRunPass(int Job, uint Threads, char ** FileNames, int FileCount, double TotalMB, sBenchResult * ptrResult)	// Run job over corpus with given number of workers
+{
+	sJobQueue Queue;
+	HANDLE * Workers;
+	long long * Latencies;
+	long long * BestLatencies;
+	long long BestTime = 0;
+	long long Start;
+	double IOCallsBefore, IOCallsAfter;
+	sBenchMemory Memory;
+	HANDLE Sampler;
+
+	Latencies = (long long *)malloc(sizeof(long long) * FileCount);
+	BestLatencies = (long long *)malloc(sizeof(long long) * FileCount);
+	if (Latencies == NULL || BestLatencies == NULL)
+	{
+		puts("Unable to allocate memory ...");
+		free(Latencies);
+		free(BestLatencies);
+		return false;
+	}
+
+	ptrResult->Job = Job;
+	ptrResult->Threads = Threads;
+	ptrResult->Failed = 0;
+
+	for (uint Run = 0; Run < BENCH_RUNS; Run++)
+	{
+		// Jobs are queued like in batch mode, largest first
+		Queue.Initialize();
+		Queue.Latencies = Latencies;
+		Queue.LatencyCapacity = FileCount;
+		if (QueueJobs(&Queue, Job, FileNames, FileCount) == false)
+		{
+			Queue.Destroy();
+			free(Latencies);
+			free(BestLatencies);
+			return false;
+		}
+
+		// Peak working set of process never goes down, so this pass is watched by its own sampler
+		Memory.StopEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+		Memory.StartSize = BenchGetWorkingSet();
+		Memory.PeakSize = Memory.StartSize;
+		Sampler = (Memory.StopEvent != NULL) ? CreateThread(NULL, 0, BenchMemoryThread, &Memory, 0, NULL) : NULL;
+
+		ProgOptions.Threads = Threads;
+		IOCallsBefore = BenchGetIOCalls();
+		Start = BenchClock();
+
+		Workers = StartWorkers(&Queue);
+		StopWorkers(&Queue, Workers);
+
+		long long Time = BenchClock() - Start;
+		IOCallsAfter = BenchGetIOCalls();
+		Queue.Destroy();
+
+		if (Sampler != NULL)
+		{
+			SetEvent(Memory.StopEvent);
+			WaitForSingleObject(Sampler, INFINITE);
+			CloseHandle(Sampler);
+		}
+		if (Memory.StopEvent != NULL)
+			CloseHandle(Memory.StopEvent);
+
+		// Every run does the same work, so failures are taken from the last one
+		ptrResult->Failed = FileCount - Queue.Results[RESULT_OK];
+
+		if (Run == 0 || Time < BestTime)
+		{
+			BestTime = (Time > 0) ? Time : 1;
+			memcpy(BestLatencies, Latencies, sizeof(long long) * Queue.LatencyCount);
+			qsort(BestLatencies, Queue.LatencyCount, sizeof(long long), CompareLatency);
+
+			// Nearest rank percentiles
+			ulong Median = (Queue.LatencyCount * 50 + 99) / 100;
+			ulong Tail = (Queue.LatencyCount * 99 + 99) / 100;
+			ptrResult->Metrics[0] = FileCount * 1000000.0 / BestTime;
+			ptrResult->Metrics[1] = TotalMB * 1000000.0 / BestTime;
+			ptrResult->Metrics[2] = (Median > 0) ? BestLatencies[Median - 1] / 1000.0 : 0.0;
+			ptrResult->Metrics[3] = (Tail > 0) ? BestLatencies[Tail - 1] / 1000.0 : 0.0;
+			ptrResult->Metrics[4] = (Memory.PeakSize - Memory.StartSize) / 1048576.0;
+			ptrResult->Metrics[5] = IOCallsAfter - IOCallsBefore;
+		}
+	}
+
+	free(Latencies);
+	free(BestLatencies);
+
+	return true;
+}
+
+int CompareLatency(const void * ptrTime1, const void * ptrTime2)	// Order job times from shortest to longest
+{
+	long long Time1 = *(const long long *)ptrTime1;
+	long long Time2 = *(const long long *)ptrTime2;
+
+	return (Time1 < Time2) ? -1 : (Time1 > Time2) ? 1 : 0;
+}
+
+double BenchGetIOCalls()		// Get file system calls of process
+{
+	IO_COUNTERS IO;
+
+	// Windows doesn't count system calls, reads, writes and other I/O requests are the nearest thing
+	if (GetProcessIoCounters(GetCurrentProcess(), &IO) == TRUE)
+		return (double)(IO.ReadOperationCount + IO.WriteOperationCount + IO.OtherOperationCount);
+
+	return 0.0;
+}
+
+SIZE_T BenchGetWorkingSet()		// Get current working set of process (in bytes)
+{
+	PROCESS_MEMORY_COUNTERS Memory;
+
+	Memory.cb = sizeof(Memory);
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &Memory, sizeof(Memory)) == TRUE)
+		return Memory.WorkingSetSize;
+
+	return 0;
+}
+
+DWORD WINAPI BenchMemoryThread(LPVOID Param)		// Sampler: remember largest working set until pass is over
+{
+	sBenchMemory * ptrMemory = (sBenchMemory *)Param;
+
+	// Short peaks between samples are missed, but every model lives much longer than sampling period
+	do
+	{
+		SIZE_T Size = BenchGetWorkingSet();
+		if (Size > ptrMemory->PeakSize)
+			ptrMemory->PeakSize = Size;
+	} while (WaitForSingleObject(ptrMemory->StopEvent, BENCH_SAMPLE_MS) == WAIT_TIMEOUT);
+
+	return 0;
+}
+
+void BenchPrintResult(const sBenchResult * ptrResult)		// Print one row of result table
+{
+	printf("%-8s %7u", GetJobName(ptrResult->Job), ptrResult->Threads);
+	for (int i = 0; i < BENCH_METRIC_COUNT; i++)
+		printf(" %10.2f", ptrResult->Metrics[i]);
+	printf("\n");
+}
+
+bool BenchSaveBaseline(const char * FileName, const sBenchResult * Results, uint ResultCount, int FileCount, unsigned long long TotalSize)	// Save results as baseline
+{
+	FILE * ptrFile;
+
+	GenerateFolders(FileName);
+	if (SafeFileOpen(&ptrFile, FileName, "w") == false)
+		return false;
+
+	// Corpus is written too, results of other corpus can't be compared
+	fprintf(ptrFile, "# PVR2MDL %s benchmark baseline\n", PROG_VERSION);
+	fprintf(ptrFile, "corpus\t%i\t%llu\n", FileCount, TotalSize);
+	fprintf(ptrFile, "# job\tthreads");
+	for (int i = 0; i < BENCH_METRIC_COUNT; i++)
+		fprintf(ptrFile, "\t%s", BenchMetrics[i].Name);
+	fprintf(ptrFile, "\n");
+
+	for (uint i = 0; i < ResultCount; i++)
+	{
+		fprintf(ptrFile, "%s\t%u", GetJobName(Results[i].Job), Results[i].Threads);
+		for (int j = 0; j < BENCH_METRIC_COUNT; j++)
+			fprintf(ptrFile, "\t%.3f", Results[i].Metrics[j]);
+		fprintf(ptrFile, "\n");
+	}
+
+	fclose(ptrFile);
+
+	printf("\nBaseline saved: %s\n", FileName);
+
+	return true;
+}
+
+uint BenchCompareBaseline(const char * FileName, const sBenchResult * Results, uint ResultCount, int FileCount, unsigned long long TotalSize)	// Compare results with baseline, returns number of regressions
+{
+	FILE * ptrFile;
+	char Line[512];
+	char JobName[16];
+	uint Threads;
+	double Baseline[BENCH_METRIC_COUNT];
+	int BaselineFiles;
+	unsigned long long BaselineSize;
+	bool CorpusMatches = false;
+	bool * Found;
+	uint Regressions = 0;
+
+	if (SafeFileOpen(&ptrFile, FileName, "r") == false)
+		return 1;
+
+	Found = (bool *)calloc(ResultCount + 1, sizeof(bool));
+	if (Found == NULL)
+	{
+		puts("Unable to allocate memory ...");
+		fclose(ptrFile);
+		return 1;
+	}
+
+	printf("\nBaseline: %s (slower by %.1f%%, more memory or I/O calls by %.1f%% fails)\n", FileName, ProgOptions.MaxRegression, ProgOptions.MaxGrowth);
+
+	while (fgets(Line, sizeof(Line), ptrFile) != NULL)
+	{
+		if (Line[0] == '#' || Line[0] == '\n')
+			continue;
+
+		if (sscanf(Line, "corpus %i %llu", &BaselineFiles, &BaselineSize) == 2)
+		{
+			CorpusMatches = (BaselineFiles == FileCount && BaselineSize == TotalSize);
+			if (CorpusMatches == false)
+			{
+				printf("Error: baseline was made on other corpus (%i models, %llu bytes).\n", BaselineFiles, BaselineSize);
+				break;
+			}
+			continue;
+		}
+
+		if (CorpusMatches == false)
+		{
+			puts("Error: baseline doesn't describe its corpus.");
+			break;
+		}
+
+		if (sscanf(Line, "%15s %u %lf %lf %lf %lf %lf %lf", JobName, &Threads, &Baseline[0], &Baseline[1], &Baseline[2], &Baseline[3], &Baseline[4], &Baseline[5]) != 2 + BENCH_METRIC_COUNT)
+			continue;
+
+		// Passes that weren't run this time are skipped
+		for (uint i = 0; i < ResultCount; i++)
+		{
+			if (strcmp(GetJobName(Results[i].Job), JobName) || Results[i].Threads != Threads)
+				continue;
+
+			Found[i] = true;
+
+			for (int j = 0; j < BENCH_METRIC_COUNT; j++)
+			{
+				double Threshold = (BenchMetrics[j].Growth == true) ? ProgOptions.MaxGrowth : ProgOptions.MaxRegression;
+				double Change = (Baseline[j] != 0.0) ? (Results[i].Metrics[j] - Baseline[j]) * 100.0 / Baseline[j] : 0.0;
+				double Loss = (BenchMetrics[j].HigherIsBetter == true) ? -Change : Change;
+				bool Regressed = Loss > Threshold;
+
+				printf("%-8s %7u %10s %10.2f (baseline %10.2f, %+6.1f%%) %s\n", JobName, Threads, BenchMetrics[j].Name, Results[i].Metrics[j], Baseline[j], Change, (Regressed == true) ? "FAILED" : "ok");
+				if (Regressed == true)
+					Regressions++;
+			}
+		}
+	}
+
+	fclose(ptrFile);
+
+	if (CorpusMatches == false)
+	{
+		free(Found);
+		return 1;
+	}
+
+	for (uint i = 0; i < ResultCount; i++)
+		if (Found[i] == false)
+			printf("Not in baseline: %s with %u threads\n", GetJobName(Results[i].Job), Results[i].Threads);
+	free(Found);
+
+	if (Regressions > 0)
+		printf("Benchmark: FAILED, %u regressions\n", Regressions);
+	else
+		puts("Benchmark: ok");
+
+	return Regressions;
+}
+
+bool BenchGenerateCorpus(const char * Folder, char *** ptrFileNames, int * ptrFileCount, int * ptrCapacity)	// Write generated Dreamcast models into folder and add them to list
+{
+	char cFileName[MAX_PATH];
+
+	// Models are made again every time, so corpus can't be left converted by older run
+	for (uint i = 0; i < BENCH_GEN_MODELS; i++)
+	{
+		snprintf(cFileName, sizeof(cFileName), "%s\\bench-%02u.mdl", Folder, i + 1);
+		GenerateFolders(cFileName);
+
+		if (BenchGenerateModel(cFileName, i + 1) == false || FileListAdd(ptrFileNames, ptrFileCount, ptrCapacity, cFileName) == false)
+			return false;
+	}
+
+	return true;
+}
+
+bool BenchGenerateModel(const char * FileName, uint Seed)		// Write Dreamcast model with PVR textures of different formats, sizes and color counts
+{
+	sModelHeader ModelHeader;
+	sModelTextureEntry TextureTable[BENCH_GEN_TEXTURES];
+	ushort SkinTable[2 * BENCH_GEN_TEXTURES];
+	char cName[64];
+	uchar * Textures;
+	ulong TexturesSize = 0;
+	ulong ModelDataSize = BENCH_GEN_MODEL_DATA + Seed * 37;
+	ulong TextureDataOffset;
+	uint Random = Seed;
+	FILE * ptrFile;
+
+	// Biggest texture with both headers for every slot
+	Textures = (uchar *)malloc(BENCH_GEN_TEXTURES * (BENCH_GEN_MAX_SIDE * BENCH_GEN_MAX_SIDE * 2 + 64));
+	if (Textures == NULL)
+	{
+		puts("Memory allocation failure!");
+		return false;
+	}
+
+	memset(&ModelHeader, 0x00, sizeof(ModelHeader));
+	memcpy(ModelHeader.Signature, "IDST", 4);
+	ModelHeader.Version = 0xA;
+	snprintf(cName, sizeof(cName), "bench-%02u", Seed);
+	ModelHeader.Rename(cName);
+	ModelHeader.SubmodelCount = 1;
+	ModelHeader.SubmodelTableOffset = sizeof(sModelHeader);
+	ModelHeader.TextureCount = BENCH_GEN_TEXTURES;
+	ModelHeader.TextureTableOffset = sizeof(sModelHeader) + ModelDataSize;
+	ModelHeader.SkinCount = 2;
+	ModelHeader.SkinEntrySize = BENCH_GEN_TEXTURES;
+	ModelHeader.SkinTableOffset = ModelHeader.TextureTableOffset + sizeof(TextureTable);
+	TextureDataOffset = ModelHeader.SkinTableOffset + sizeof(SkinTable);
+	ModelHeader.TextureDataOffset = TextureDataOffset;
+
+	// Mix of sizes (small ones go through batch of small textures), layouts and color counts (exact palette, shrinking, noise)
+	for (uint i = 0; i < BENCH_GEN_TEXTURES; i++)
+	{
+		ulong Side = 8 << ((Seed + i * 3) % 6);
+		uint Kind = (Seed + i) % 3;
+		uchar ImageFormat;
+		ulong Width = Side;
+		ulong Height = Side;
+
+		if (i % 3 == 1)
+		{
+			ImageFormat = PVR_RECT;
+			Height = (Side > 8) ? Side / 2 : Side;
+		}
+		else if (i % 3 == 2 && Side >= 16)
+			ImageFormat = PVR_VQ;
+		else
+			ImageFormat = PVR_TWIDDLE;
+
+		snprintf(cName, sizeof(cName), "tex%u_%s.pvr", i, (Kind == 0) ? "few" : (Kind == 1) ? "grad" : "noise");
+		TextureTable[i].Update(cName, Width, Height, TextureDataOffset + TexturesSize);
+		TexturesSize += BenchMakePVR(Textures + TexturesSize, Width, Height, ImageFormat, Kind, &Random);
+	}
+
+	for (uint i = 0; i < 2 * BENCH_GEN_TEXTURES; i++)
+		SkinTable[i] = i % BENCH_GEN_TEXTURES;
+
+	ModelHeader.FileSize = TextureDataOffset + TexturesSize;
+
+	if (SafeFileOpen(&ptrFile, FileName, "wb") == false)
+	{
+		free(Textures);
+		return false;
+	}
+
+	// Mesh data isn't looked at, but it keeps texture table away from header like in real models
+	FileWriteBlock(&ptrFile, &ModelHeader, sizeof(ModelHeader));
+	for (ulong i = 0; i < ModelDataSize; i++)
+		fputc(BenchRandom(&Random) & 0xFF, ptrFile);
+	FileWriteBlock(&ptrFile, TextureTable, sizeof(TextureTable));
+	FileWriteBlock(&ptrFile, SkinTable, sizeof(SkinTable));
+	FileWriteBlock(&ptrFile, Textures, TexturesSize);
+
+	fclose(ptrFile);
+	free(Textures);
+
+	return true;
+}
+
+ulong BenchMakePVR(uchar * Buffer, ulong Width, ulong Height, uchar ImageFormat, uint Kind, uint * ptrSeed)	// Make PVR texture in buffer, returns its size
+{
+	sPVRGlobalHeader GlobalHeader;
+	sPVRImageHeader ImageHeader;
+	ushort * Pixels = (ushort *)(Buffer + sizeof(GlobalHeader) + sizeof(ImageHeader));
+	ulong DataSize;
+
+	if (ImageFormat == PVR_VQ)
+	{
+		// Codebook of 256 2x2 blocks and twiddled block indices
+		uchar * Indices = (uchar *)(Pixels + 256 * 4);
+
+		for (ulong i = 0; i < 256 * 4; i++)
+			Pixels[i] = BenchRandom(ptrSeed) & 0xFFFF;
+		for (ulong y = 0; y < Height / 2; y++)
+			for (ulong x = 0; x < Width / 2; x++)
+				Indices[BenchTwiddle(x, y)] = (x * 7 + y * 3) & 0xFF;
+
+		DataSize = 256 * 4 * 2 + (Width / 2) * (Height / 2);
+	}
+	else
+	{
+		for (ulong y = 0; y < Height; y++)
+			for (ulong x = 0; x < Width; x++)
+				Pixels[(ImageFormat == PVR_TWIDDLE) ? BenchTwiddle(x, y) : y * Width + x] = BenchPixel(x, y, Width, Height, Kind, ptrSeed);
+
+		DataSize = Width * Height * 2;
+	}
+
+	GlobalHeader.Signature = 0x58494247;
+	GlobalHeader.ImageHeaderOffset = sizeof(GlobalHeader.GlobalIndex);
+	GlobalHeader.GlobalIndex = 0;
+	ImageHeader.Signature = 0x54525650;
+	ImageHeader.Size = DataSize + 8;
+	ImageHeader.ColorFormat = 0x01;
+	ImageHeader.ImageFormat = ImageFormat;
+	ImageHeader.Zeroes = 0;
+	ImageHeader.Width = (ushort)Width;
+	ImageHeader.Height = (ushort)Height;
+	memcpy(Buffer, &GlobalHeader, sizeof(GlobalHeader));
+	memcpy(Buffer + sizeof(GlobalHeader), &ImageHeader, sizeof(ImageHeader));
+
+	return sizeof(GlobalHeader) + sizeof(ImageHeader) + DataSize;
+}
+
+ushort BenchPixel(ulong X, ulong Y, ulong Width, ulong Height, uint Kind, uint * ptrSeed)		// Color of generated pixel
+{
+	ulong R, G, B;
+
+	switch (Kind)
+	{
+	case 0:		// Few flat colors
+		R = ((X / 8) * 40) & 0xFF;
+		G = ((Y / 8) * 40) & 0xFF;
+		B = 128;
+		break;
+	case 1:		// Smooth gradient, too many colors for exact palette
+		R = X * 255 / (Width - 1);
+		G = Y * 255 / (Height - 1);
+		B = (X + Y) * 255 / (Width + Height - 2);
+		break;
+	default:	// Noise
+		return BenchRandom(ptrSeed) & 0xFFFF;
+	}
+
+	return (ushort)(((R >> 3) << 11) | ((G >> 2) << 5) | (B >> 3));
+}
+
+ulong BenchTwiddle(ulong X, ulong Y)		// Place of pixel in twiddled image
+{
+	ulong Index = 0;
+
+	// Bits of Y go to even positions, bits of X to odd ones
+	for (ulong Bit = 0; (X | Y) >> Bit != 0; Bit++)
+		Index |= (((Y >> Bit) & 1) << (2 * Bit)) | (((X >> Bit) & 1) << (2 * Bit + 1));
+
+	return Index;
+}
+
+uint BenchRandom(uint * ptrSeed)		// Next number of generator that gives the same corpus everywhere
+{
+	*ptrSeed = *ptrSeed * 1103515245 + 12345;
+
+	return *ptrSeed >> 8;
+}
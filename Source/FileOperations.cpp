@@ -37,6 +37,24 @@ POSSIBILITY OF SUCH DAMAGE.
 ////////// Includes //////////
 #include "main.h"
 
+////////// Definitions //////////
+#ifndef FSCTL_DUPLICATE_EXTENTS_TO_FILE
+#define FSCTL_DUPLICATE_EXTENTS_TO_FILE 0x00098344		// Block cloning request (ReFS, older SDKs don't have it)
+#endif
+
+////////// Structures //////////
+
+// Input of FSCTL_DUPLICATE_EXTENTS_TO_FILE (same as DUPLICATE_EXTENTS_DATA, older SDKs don't have it), driver expects natural alignment
+#pragma pack(push, 8)
+struct sDuplicateExtents
+{
+	HANDLE FileHandle;			// Source file
+	LARGE_INTEGER SourceFileOffset;
+	LARGE_INTEGER TargetFileOffset;
+	LARGE_INTEGER ByteCount;	// Multiple of cluster size
+};
+#pragma pack(pop)
+
 ulong FileSize(FILE **ptrFile)
 {
 	fseek(*ptrFile, 0, SEEK_END);						// Move pointer to the file's end
@@ -62,14 +80,35 @@ void FileWriteBlock(FILE **ptrDstFile, void * SrcBuff, ulong Size)
 	fwrite(SrcBuff, (size_t)1, Size, *ptrDstFile);		// Write block
 }
 
-void SafeFileOpen(FILE **ptrFile, const char * FileName, char * Mode)
+bool SafeFileOpen(FILE **ptrFile, const char * FileName, char * Mode)
 {
+	// Caller fails only its own job, other files of batch are still processed
 	fopen_s(ptrFile, FileName, Mode);
 	if (*ptrFile == NULL)
 	{
-		printf("Error: can't open file: %s", FileName);
-		exit(EXIT_FAILURE);
+		LogPrint(LOG_ERROR, "Error: can't open file: %s\n", FileName);
+		return false;
 	}
+
+	return true;
+}
+
+bool SafeFileClose(FILE **ptrFile, const char * FileName)
+{
+	// Error flag of stream stays set after failed write, so one check covers all writes
+	bool Result = (fflush(*ptrFile) == 0 && ferror(*ptrFile) == 0);
+	if (fclose(*ptrFile) != 0)
+		Result = false;
+	*ptrFile = NULL;
+
+	// Partial file would look like a good result
+	if (Result == false)
+	{
+		LogPrint(LOG_ERROR, "Error: can't write file: %s\n", FileName);
+		remove(FileName);
+	}
+
+	return Result;
 }
 
 void FileGetExtension(const char * Path, char * OutputBuffer, uint OutputBufferSize)
@@ -141,6 +180,42 @@ void FileGetPath(const char * Path, char * OutputBuffer, uint OutputBufferSize)
 	OutputBuffer[End] = '\0';
 }
 
+bool FileMatchPattern(const char * Pattern, const char * Name)
+{
+	const char * Star = NULL;		// Last '*' in pattern
+	const char * StarName = NULL;	// Place in name where last '*' stopped matching
+
+	// Case is ignored like in Windows file names
+	while (*Name != '\0')
+	{
+		if (*Pattern == '*')
+		{
+			Star = Pattern++;
+			StarName = Name;
+		}
+		else if (*Pattern == '?' || (*Pattern != '\0' && tolower(*Pattern) == tolower(*Name)))
+		{
+			Pattern++;
+			Name++;
+		}
+		else if (Star != NULL)
+		{
+			// Let last '*' take one more character
+			Pattern = Star + 1;
+			Name = ++StarName;
+		}
+		else
+		{
+			return false;
+		}
+	}
+
+	while (*Pattern == '*')
+		Pattern++;
+
+	return *Pattern == '\0';
+}
+
 bool CheckFile(char * FileName)
 {
 	FILE * ptrTestFile;
@@ -160,7 +235,8 @@ bool CheckDir(const char * Path)
 {
 	struct stat DirStat;
 
-	stat(Path, &DirStat);
+	if (stat(Path, &DirStat) != 0)
+		return false;
 
 	if (DirStat.st_mode & S_IFDIR)
 		return true;
@@ -173,35 +249,167 @@ void NewDir(const char * DirName)
 	CreateDirectoryA(DirName, NULL);	// ! Very platform-specific function. Maybe I will change that.
 }
 
-void GenerateFolders(char * cPath)
+void GenerateFolders(const char * cPath)
 {
-	char PathBuffer[255];
-	char * cDir;
-	char cCurrent[255] = "";
-	char Counter = 0;
+	static thread_local char cCreated[MAX_PATH] = "";	// Folder made by previous call (files usually go to the same folder in a row)
+	char cCurrent[MAX_PATH];
+	uint Length = 0;
+
+	// Everything after last slash is file name
+	for (uint i = 0; cPath[i] != '\0' && i < sizeof(cCurrent); i++)
+		if (cPath[i] == '\\' || cPath[i] == '/')
+			Length = i;
 
-	strcpy(PathBuffer, cPath);			// Save cPath to buffer, to avoid error, when parsing (const char *)
+	if (Length == 0)
+		return;
 
-	cDir = strtok(PathBuffer, "\\");	// First run: count words
-	while (cDir != NULL)
+	memcpy(cCurrent, cPath, Length);
+	cCurrent[Length] = '\0';
+
+	// Nothing to do if folder (or its subfolder) was made last time
+	if (!strncmp(cCurrent, cCreated, Length) && (cCreated[Length] == '\0' || cCreated[Length] == '\\' || cCreated[Length] == '/'))
+		return;
+
+	// Make folders from top to bottom, existing ones are skipped by NewDir()
+	for (uint i = 1; i <= Length; i++)
 	{
-		Counter++;
-		cDir = strtok(NULL, "\\");
+		if (i == Length || cCurrent[i] == '\\' || cCurrent[i] == '/')
+		{
+			// Skip drive letter
+			if (cCurrent[i - 1] == ':')
+				continue;
+
+			char Separator = cCurrent[i];
+			cCurrent[i] = '\0';
+			NewDir(cCurrent);
+			cCurrent[i] = Separator;
+		}
 	}
 
-	strcpy(PathBuffer, cPath);			// Give strtok() fresh string
-	cDir = strtok(PathBuffer, "\\");	// Second run: create folders
-	while (cDir != NULL)
+	strcpy(cCreated, cCurrent);
+}
+
+void FileMirrorName(const char * Root, const char * Path, char * OutputBuffer, uint OutputBufferSize)
+{
+	uint Length;
+
+	// Drive letter and leading slashes are dropped, so absolute paths are mirrored too
+	if (isalpha(Path[0]) && Path[1] == ':')
+		Path += 2;
+
+	snprintf(OutputBuffer, OutputBufferSize, "%s", Root);
+	Length = strlen(OutputBuffer);
+
+	// Copy path piece by piece, "." and ".." are skipped, so result never leaves Root
+	while (*Path != '\0')
 	{
-		strcat(cCurrent, cDir);
-		if (Counter > 1)
+		uint Size = strcspn(Path, "\\/");
+
+		if (Size > 0 && !(Size == 1 && Path[0] == '.') && !(Size == 2 && Path[0] == '.' && Path[1] == '.'))
 		{
-			NewDir(cCurrent);
-			Counter--;
+			if (Length + Size + 2 > OutputBufferSize)
+				break;
+
+			if (Length > 0 && OutputBuffer[Length - 1] != '\\' && OutputBuffer[Length - 1] != '/')
+				OutputBuffer[Length++] = '\\';
+
+			memcpy(OutputBuffer + Length, Path, Size);
+			Length += Size;
+			OutputBuffer[Length] = '\0';
 		}
-		strcat(cCurrent, "\\");
-		cDir = strtok(NULL, "\\");
+
+		Path += Size;
+		if (*Path != '\0')
+			Path++;
+	}
+}
+
+bool FileCloneBlocks(const char * SrcName, const char * DstName)
+{
+	HANDLE hSrcFile;
+	HANDLE hDstFile;
+	sDuplicateExtents Extents;
+	LARGE_INTEGER Size;
+	char cVolume[MAX_PATH];
+	DWORD SectorsPerCluster, BytesPerSector, FreeClusters, TotalClusters;
+	DWORD Returned;
+	bool Result = false;
+
+	// Cloned ranges are counted in clusters
+	if (GetVolumePathNameA(SrcName, cVolume, sizeof(cVolume)) == FALSE || GetDiskFreeSpaceA(cVolume, &SectorsPerCluster, &BytesPerSector, &FreeClusters, &TotalClusters) == FALSE)
+		return false;
+	LONGLONG ClusterSize = (LONGLONG)SectorsPerCluster * BytesPerSector;
+
+	hSrcFile = CreateFileA(SrcName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hSrcFile == INVALID_HANDLE_VALUE)
+		return false;
+	hDstFile = CreateFileA(DstName, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hDstFile == INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(hSrcFile);
+		return false;
+	}
+
+	// Copy gets the same size first, then shares blocks of original (last cluster can reach past end of file)
+	if (GetFileSizeEx(hSrcFile, &Size) != FALSE && SetFilePointerEx(hDstFile, Size, NULL, FILE_BEGIN) != FALSE && SetEndOfFile(hDstFile) != FALSE)
+	{
+		Extents.FileHandle = hSrcFile;
+		Extents.SourceFileOffset.QuadPart = 0;
+		Extents.TargetFileOffset.QuadPart = 0;
+		Extents.ByteCount.QuadPart = (Size.QuadPart + ClusterSize - 1) / ClusterSize * ClusterSize;
+		Result = Size.QuadPart == 0 || DeviceIoControl(hDstFile, FSCTL_DUPLICATE_EXTENTS_TO_FILE, &Extents, sizeof(Extents), NULL, 0, &Returned, NULL) != FALSE;
+	}
+
+	CloseHandle(hSrcFile);
+	CloseHandle(hDstFile);
+
+	if (Result == false)
+		remove(DstName);
+
+	return Result;
+}
+
+bool FileCloneCopy(const char * SrcName, const char * DstName)
+{
+	// Volumes with block cloning (ReFS, Dev Drive) make copy without writing its data, others get plain copy
+	if (FileCloneBlocks(SrcName, DstName) == true)
+		return true;
+	if (CopyFileA(SrcName, DstName, FALSE) == FALSE)
+		return false;
+
+	// Plain copy takes attributes of original, copy of read-only model couldn't be written
+	if (SetFileAttributesA(DstName, FILE_ATTRIBUTE_NORMAL) == FALSE)
+	{
+		remove(DstName);
+		return false;
+	}
+
+	return true;
+}
+
+bool FileAtomicReplace(const char * TempName, const char * NewName)
+{
+	// Read-only file can't be replaced, new file gets the attribute back after rename
+	DWORD Attributes = GetFileAttributesA(NewName);
+	bool ReadOnly = (Attributes != INVALID_FILE_ATTRIBUTES && (Attributes & FILE_ATTRIBUTE_READONLY) != 0);
+	if (ReadOnly == true && SetFileAttributesA(NewName, Attributes & ~FILE_ATTRIBUTE_READONLY) == FALSE)
+	{
+		LogPrint(LOG_ERROR, "Error: can't clear read-only attribute: %s\n", NewName);
+		return false;
+	}
+
+	// Readers see either old file or complete new one, never a half-written file
+	if (MoveFileExA(TempName, NewName, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) == FALSE)
+	{
+		if (ReadOnly == true)
+			SetFileAttributesA(NewName, Attributes);
+		return false;
 	}
+
+	if (ReadOnly == true)
+		SetFileAttributesA(NewName, GetFileAttributesA(NewName) | FILE_ATTRIBUTE_READONLY);
+
+	return true;
 }
 
 void PatchSlashes(char * cPathBuff, ulong BuffSize, bool SlashToBackslash)
@@ -235,6 +443,76 @@ void ProgGetPath(char * OutputBuffer, uint OutputBufferSize)
 	FileGetPath(cFileName, OutputBuffer, OutputBufferSize);
 }
 
+bool FileListAdd(char *** ptrFileNames, int * ptrFileCount, int * ptrCapacity, const char * FileName)
+{
+	// Grow list twice when it's full
+	if (*ptrFileCount == *ptrCapacity)
+	{
+		int NewCapacity = (*ptrCapacity == 0) ? 64 : *ptrCapacity * 2;
+		char ** NewFileNames = (char **)realloc(*ptrFileNames, NewCapacity * sizeof(char *));
+		if (NewFileNames == NULL)
+		{
+			LogPrint(LOG_ERROR, "Unable to allocate memory ...\n");
+			return false;
+		}
+
+		*ptrFileNames = NewFileNames;
+		*ptrCapacity = NewCapacity;
+	}
+
+	(*ptrFileNames)[*ptrFileCount] = _strdup(FileName);
+	if ((*ptrFileNames)[*ptrFileCount] == NULL)
+		return false;
+	(*ptrFileCount)++;
+
+	return true;
+}
+
+void FileListFolder(const char * FolderName, const char * Extension, char *** ptrFileNames, int * ptrFileCount, int * ptrCapacity)
+{
+	WIN32_FIND_DATAA FindData;
+	HANDLE hFind;
+	char cPattern[MAX_PATH];
+	char cFileName[MAX_PATH];
+	char cExtension[5];
+
+	snprintf(cPattern, sizeof(cPattern), "%s\\*", FolderName);
+	hFind = FindFirstFileA(cPattern, &FindData);
+	if (hFind == INVALID_HANDLE_VALUE)
+		return;
+
+	do
+	{
+		if (!strcmp(FindData.cFileName, ".") || !strcmp(FindData.cFileName, ".."))
+			continue;
+
+		snprintf(cFileName, sizeof(cFileName), "%s\\%s", FolderName, FindData.cFileName);
+
+		if (FindData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+		{
+			FileListFolder(cFileName, Extension, ptrFileNames, ptrFileCount, ptrCapacity);
+			continue;
+		}
+
+		if (strlen(FindData.cFileName) < 4)
+			continue;
+
+		FileGetExtension(FindData.cFileName, cExtension, sizeof(cExtension));
+		if (!strcmp(cExtension, Extension))
+			FileListAdd(ptrFileNames, ptrFileCount, ptrCapacity, cFileName);
+	} while (FindNextFileA(hFind, &FindData) != FALSE);
+
+	FindClose(hFind);
+}
+
+void FileListFree(char ** FileNames, int FileCount)
+{
+	for (int i = 0; i < FileCount; i++)
+		free(FileNames[i]);
+
+	free(FileNames);
+}
+
 void FileSafeRename(char * OldName, char * NewName)
 {
 	char Action;
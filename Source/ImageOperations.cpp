@@ -0,0 +1,980 @@
+/*
+=====================================================================
+Copyright (c) 2018, Alexey Leushin
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or
+without modification, are permitted provided that the following
+conditions are met:
+- Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+- Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+- Neither the name of the copyright holders nor the names of its
+contributors may be used to endorse or promote products derived
+from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+=====================================================================
+*/
+
+//
+// This file contains functions that process images in memory
+//
+
+////////// Includes //////////
+#include "main.h"
+#include <emmintrin.h>	// SSE2 intrinsics
+
+////////// Functions //////////
+
+// Ordered (Bayer 4x4) dithering thresholds
+static const uchar BayerMatrix[4][4] = {
+	{  0,  8,  2, 10 },
+	{ 12,  4, 14,  6 },
+	{  3, 11,  1,  9 },
+	{ 15,  7, 13,  5 }
+};
+
+void DitherRGB565(const ushort * SrcImage, ushort * DstImage, ulong Width, ulong Height, ushort ShrinkMask)
+{
+	// Size of quantization step for every channel (in channel units)
+	ushort StepR = (((ushort)~ShrinkMask & 0xF800) >> 11) + 1;
+	ushort StepG = (((ushort)~ShrinkMask & 0x07E0) >> 5) + 1;
+	ushort StepB = ((ushort)~ShrinkMask & 0x001F) + 1;
+
+	__m128i MaskG = _mm_set1_epi16(0x003F);
+	__m128i MaskB = _mm_set1_epi16(0x001F);
+	__m128i MaxRB = _mm_set1_epi16(0x001F);
+	__m128i MaxG = _mm_set1_epi16(0x003F);
+	__m128i Shrink = _mm_set1_epi16((short)ShrinkMask);
+
+	for (ulong Y = 0; Y < Height; Y++)
+	{
+		const ushort * SrcLine = SrcImage + Y * Width;
+		ushort * DstLine = DstImage + Y * Width;
+		const uchar * Thresholds = BayerMatrix[Y & 3];
+
+		// Thresholds repeat every 4 pixels, so 8 lanes hold two periods
+		ushort BiasR[8], BiasG[8], BiasB[8];
+		for (int i = 0; i < 8; i++)
+		{
+			BiasR[i] = (Thresholds[i & 3] * StepR) >> 4;
+			BiasG[i] = (Thresholds[i & 3] * StepG) >> 4;
+			BiasB[i] = (Thresholds[i & 3] * StepB) >> 4;
+		}
+		__m128i VBiasR = _mm_loadu_si128((const __m128i *)BiasR);
+		__m128i VBiasG = _mm_loadu_si128((const __m128i *)BiasG);
+		__m128i VBiasB = _mm_loadu_si128((const __m128i *)BiasB);
+
+		// Process 8 pixels at once (X stays aligned to threshold period)
+		ulong X = 0;
+		for (; X + 8 <= Width; X += 8)
+		{
+			__m128i Pixels = _mm_loadu_si128((const __m128i *)(SrcLine + X));
+
+			// Split to components, add thresholds and saturate
+			__m128i R = _mm_min_epi16(_mm_add_epi16(_mm_srli_epi16(Pixels, 11), VBiasR), MaxRB);
+			__m128i G = _mm_min_epi16(_mm_add_epi16(_mm_and_si128(_mm_srli_epi16(Pixels, 5), MaskG), VBiasG), MaxG);
+			__m128i B = _mm_min_epi16(_mm_add_epi16(_mm_and_si128(Pixels, MaskB), VBiasB), MaxRB);
+
+			// Combine components and drop bits that don't fit current tier
+			Pixels = _mm_or_si128(_mm_or_si128(_mm_slli_epi16(R, 11), _mm_slli_epi16(G, 5)), B);
+			_mm_storeu_si128((__m128i *)(DstLine + X), _mm_and_si128(Pixels, Shrink));
+		}
+
+		// Process leftover pixels
+		for (; X < Width; X++)
+		{
+			ushort Pixel = SrcLine[X];
+			ushort R = (Pixel >> 11) + BiasR[X & 3];
+			ushort G = ((Pixel >> 5) & 0x003F) + BiasG[X & 3];
+			ushort B = (Pixel & 0x001F) + BiasB[X & 3];
+
+			if (R > 0x1F) R = 0x1F;
+			if (G > 0x3F) G = 0x3F;
+			if (B > 0x1F) B = 0x1F;
+
+			DstLine[X] = ((R << 11) | (G << 5) | B) & ShrinkMask;
+		}
+	}
+}
+
+void ExpandRGB565(const ushort * SrcImage, uchar * DstImage, ulong PixelCount, bool RGBAOrder)
+{
+	__m128i MaskG = _mm_set1_epi16(0x003F);
+	__m128i MaskB = _mm_set1_epi16(0x001F);
+	__m128i Alpha = _mm_set1_epi8((char)0xFF);
+
+	// Process 8 pixels at once
+	ulong i = 0;
+	for (; i + 8 <= PixelCount; i += 8)
+	{
+		__m128i Pixels = _mm_loadu_si128((const __m128i *)(SrcImage + i));
+
+		// Split to components
+		__m128i R = _mm_srli_epi16(Pixels, 11);
+		__m128i G = _mm_and_si128(_mm_srli_epi16(Pixels, 5), MaskG);
+		__m128i B = _mm_and_si128(Pixels, MaskB);
+
+		// Expand to 8 bits, low bits are filled by replicating high bits (so white stays white)
+		R = _mm_or_si128(_mm_slli_epi16(R, 3), _mm_srli_epi16(R, 2));
+		G = _mm_or_si128(_mm_slli_epi16(G, 2), _mm_srli_epi16(G, 4));
+		B = _mm_or_si128(_mm_slli_epi16(B, 3), _mm_srli_epi16(B, 2));
+
+		if (RGBAOrder == true)
+		{
+			__m128i Temp = R;
+			R = B;
+			B = Temp;
+		}
+
+		// Interleave to B, G, R, A byte order
+		__m128i BG = _mm_unpacklo_epi8(_mm_packus_epi16(B, B), _mm_packus_epi16(G, G));
+		__m128i RA = _mm_unpacklo_epi8(_mm_packus_epi16(R, R), Alpha);
+		_mm_storeu_si128((__m128i *)(DstImage + i * 4), _mm_unpacklo_epi16(BG, RA));
+		_mm_storeu_si128((__m128i *)(DstImage + i * 4 + 16), _mm_unpackhi_epi16(BG, RA));
+	}
+
+	// Process leftover pixels
+	for (; i < PixelCount; i++)
+	{
+		ushort Pixel = SrcImage[i];
+		uchar R = Pixel >> 11;
+		uchar G = (Pixel >> 5) & 0x3F;
+		uchar B = Pixel & 0x1F;
+
+		R = (R << 3) | (R >> 2);
+		G = (G << 2) | (G >> 4);
+		B = (B << 3) | (B >> 2);
+
+		DstImage[i * 4 + 0] = (RGBAOrder == true) ? R : B;
+		DstImage[i * 4 + 1] = G;
+		DstImage[i * 4 + 2] = (RGBAOrder == true) ? B : R;
+		DstImage[i * 4 + 3] = 0xFF;
+	}
+}
+
+void DownscaleRGBA(const uchar * SrcImage, ulong SrcWidth, ulong SrcHeight, uchar * DstImage, ulong DstWidth, ulong DstHeight)
+{
+	__m128i Zero = _mm_setzero_si128();
+
+	for (ulong DY = 0; DY < DstHeight; DY++)
+	{
+		// Source lines covered by destination line (at least one)
+		ulong Y0 = DY * SrcHeight / DstHeight;
+		ulong Y1 = (DY + 1) * SrcHeight / DstHeight;
+		if (Y1 <= Y0)
+			Y1 = Y0 + 1;
+
+		for (ulong DX = 0; DX < DstWidth; DX++)
+		{
+			// Source columns covered by destination pixel (at least one)
+			ulong X0 = DX * SrcWidth / DstWidth;
+			ulong X1 = (DX + 1) * SrcWidth / DstWidth;
+			if (X1 <= X0)
+				X1 = X0 + 1;
+
+			// Box filter: sum of every channel in 32-bit lanes
+			__m128i Sum = Zero;
+			for (ulong Y = Y0; Y < Y1; Y++)
+			{
+				const uchar * Src = SrcImage + (Y * SrcWidth + X0) * 4;
+				ulong X = X0;
+
+				while (X + 2 <= X1)
+				{
+					// Two pixels at once in 16-bit lanes, flushed before they can overflow
+					__m128i LineSum = Zero;
+					for (uint i = 0; i < 256 && X + 2 <= X1; i++, X += 2, Src += 8)
+						LineSum = _mm_add_epi16(LineSum, _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)Src), Zero));
+
+					Sum = _mm_add_epi32(Sum, _mm_unpacklo_epi16(LineSum, Zero));
+					Sum = _mm_add_epi32(Sum, _mm_unpackhi_epi16(LineSum, Zero));
+				}
+
+				// Odd pixel
+				if (X < X1)
+				{
+					int Pixel;
+					memcpy(&Pixel, Src, sizeof(Pixel));
+					Sum = _mm_add_epi32(Sum, _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(Pixel), Zero), Zero));
+				}
+			}
+
+			// Average and pack back to 8 bits per channel
+			__m128 Scale = _mm_set1_ps(1.0f / ((X1 - X0) * (Y1 - Y0)));
+			__m128i Average = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(Sum), Scale));
+			Average = _mm_packus_epi16(_mm_packs_epi32(Average, Zero), Zero);
+
+			int Pixel = _mm_cvtsi128_si32(Average);
+			memcpy(&DstImage[(DY * DstWidth + DX) * 4], &Pixel, sizeof(Pixel));
+		}
+	}
+}
+
+// CIE L*a*b* values of every RGB565 color (expanded the same way as palette colors)
+static float LabTable[65536][3];
+static INIT_ONCE LabTableOnce = INIT_ONCE_STATIC_INIT;
+
+static BOOL CALLBACK InitLabTable(PINIT_ONCE ptrOnce, PVOID Param, PVOID * ptrContext)	// Fill LabTable (it's built by the first job that measures quality, other commands don't pay for it)
+{
+	for (ulong Color = 0; Color < 65536; Color++)
+	{
+		uchar Channels[3] = { (uchar)((Color >> 11) << 3), (uchar)(((Color >> 5) & 0x3F) << 2), (uchar)((Color & 0x1F) << 3) };
+		float RGB[3];
+
+		// sRGB to linear light
+		for (int i = 0; i < 3; i++)
+		{
+			float Value = Channels[i] / 255.0f;
+			RGB[i] = (Value <= 0.04045f) ? Value / 12.92f : (float)pow((Value + 0.055f) / 1.055f, 2.4f);
+		}
+
+		// Linear RGB to XYZ (D65 white) relative to white point
+		float XYZ[3] = {
+			(0.4124f * RGB[0] + 0.3576f * RGB[1] + 0.1805f * RGB[2]) / 0.95047f,
+			(0.2126f * RGB[0] + 0.7152f * RGB[1] + 0.0722f * RGB[2]),
+			(0.0193f * RGB[0] + 0.1192f * RGB[1] + 0.9505f * RGB[2]) / 1.08883f
+		};
+
+		// XYZ to L*a*b*
+		for (int i = 0; i < 3; i++)
+			XYZ[i] = (XYZ[i] > 0.008856f) ? (float)pow(XYZ[i], 1.0f / 3.0f) : 7.787f * XYZ[i] + 16.0f / 116.0f;
+
+		LabTable[Color][0] = 116.0f * XYZ[1] - 16.0f;
+		LabTable[Color][1] = 500.0f * (XYZ[0] - XYZ[1]);
+		LabTable[Color][2] = 200.0f * (XYZ[1] - XYZ[2]);
+	}
+
+	return TRUE;
+}
+
+static inline void MeasureChangedPixel(ushort SrcColor, ushort DstColor, sQualityMetrics * ptrMetrics)
+{
+	const float * Src = LabTable[SrcColor];
+	const float * Dst = LabTable[DstColor];
+	float DeltaE2 = (Src[0] - Dst[0]) * (Src[0] - Dst[0]) + (Src[1] - Dst[1]) * (Src[1] - Dst[1]) + (Src[2] - Dst[2]) * (Src[2] - Dst[2]);
+
+	ptrMetrics->ChangedPixels++;
+	if (DeltaE2 > ptrMetrics->MaxDeltaE2)
+		ptrMetrics->MaxDeltaE2 = DeltaE2;
+}
+
+void MeasureQuality(const ushort * SrcPixels, const uchar * Indices, const ushort * Palette16, ulong PixelCount, sQualityMetrics * ptrMetrics)
+{
+	__m128i MaskG = _mm_set1_epi16(0x003F);
+	__m128i MaskB = _mm_set1_epi16(0x001F);
+	__m128i Zero = _mm_setzero_si128();
+	ushort Mapped[8];
+
+	InitOnceExecuteOnce(&LabTableOnce, InitLabTable, NULL, NULL);
+	ptrMetrics->PixelCount += PixelCount;
+
+	// Process 8 pixels at once
+	ulong i = 0;
+	while (i + 8 <= PixelCount)
+	{
+		// Squared errors are summed in 32-bit lanes, flushed before they can overflow
+		__m128i ErrorSum = Zero;
+		for (uint Block = 0; Block < 4096 && i + 8 <= PixelCount; Block++, i += 8)
+		{
+			for (int j = 0; j < 8; j++)
+				Mapped[j] = Palette16[Indices[i + j]];
+
+			__m128i Src = _mm_loadu_si128((const __m128i *)(SrcPixels + i));
+			__m128i Dst = _mm_loadu_si128((const __m128i *)Mapped);
+
+			// Most pixels keep their color, so whole group is skipped
+			int Same = _mm_movemask_epi8(_mm_cmpeq_epi16(Src, Dst));
+			if (Same == 0xFFFF)
+				continue;
+
+			// Channel differences in 8-bit units
+			__m128i DR = _mm_slli_epi16(_mm_sub_epi16(_mm_srli_epi16(Src, 11), _mm_srli_epi16(Dst, 11)), 3);
+			__m128i DG = _mm_slli_epi16(_mm_sub_epi16(_mm_and_si128(_mm_srli_epi16(Src, 5), MaskG), _mm_and_si128(_mm_srli_epi16(Dst, 5), MaskG)), 2);
+			__m128i DB = _mm_slli_epi16(_mm_sub_epi16(_mm_and_si128(Src, MaskB), _mm_and_si128(Dst, MaskB)), 3);
+			ErrorSum = _mm_add_epi32(ErrorSum, _mm_madd_epi16(DR, DR));
+			ErrorSum = _mm_add_epi32(ErrorSum, _mm_madd_epi16(DG, DG));
+			ErrorSum = _mm_add_epi32(ErrorSum, _mm_madd_epi16(DB, DB));
+
+			// Color difference is taken from table for changed pixels only
+			for (int j = 0; j < 8; j++)
+				if ((Same & (3 << (j * 2))) == 0)
+					MeasureChangedPixel(SrcPixels[i + j], Mapped[j], ptrMetrics);
+		}
+
+		uint Sums[4];
+		_mm_storeu_si128((__m128i *)Sums, ErrorSum);
+		ptrMetrics->SquaredError += (unsigned long long)Sums[0] + Sums[1] + Sums[2] + Sums[3];
+	}
+
+	// Process leftover pixels
+	for (; i < PixelCount; i++)
+	{
+		ushort Src = SrcPixels[i];
+		ushort Dst = Palette16[Indices[i]];
+		if (Src == Dst)
+			continue;
+
+		int DR = ((Src >> 11) - (Dst >> 11)) * 8;
+		int DG = (((Src >> 5) & 0x3F) - ((Dst >> 5) & 0x3F)) * 4;
+		int DB = ((Src & 0x1F) - (Dst & 0x1F)) * 8;
+		ptrMetrics->SquaredError += DR * DR + DG * DG + DB * DB;
+		MeasureChangedPixel(Src, Dst, ptrMetrics);
+	}
+}
+
+static inline void SplitRGB565(ushort Color, int * Channels)	// Get channels in 8-bit units (expanded the same way as palette colors)
+{
+	Channels[0] = (Color >> 11) << 3;
+	Channels[1] = ((Color >> 5) & 0x3F) << 2;
+	Channels[2] = (Color & 0x1F) << 3;
+}
+
+// Part of color list that becomes one palette entry
+struct sColorBox
+{
+	ulong First;				// First color in list
+	ulong Count;				// How many colors
+	int Range;					// Widest range of channel values (in 8-bit units)
+	int Channel;				// Channel with widest range
+};
+
+static void MeasureColorBox(const ushort * Colors, sColorBox * ptrBox)	// Find channel with widest range
+{
+	int Min[3] = { 255, 255, 255 };
+	int Max[3] = { 0, 0, 0 };
+
+	for (ulong i = ptrBox->First; i < ptrBox->First + ptrBox->Count; i++)
+	{
+		int Channels[3];
+		SplitRGB565(Colors[i], Channels);
+		for (int c = 0; c < 3; c++)
+		{
+			if (Channels[c] < Min[c]) Min[c] = Channels[c];
+			if (Channels[c] > Max[c]) Max[c] = Channels[c];
+		}
+	}
+
+	ptrBox->Range = 0;
+	ptrBox->Channel = 0;
+	for (int c = 0; c < 3 && ptrBox->Count > 1; c++)
+	{
+		if (Max[c] - Min[c] > ptrBox->Range)
+		{
+			ptrBox->Range = Max[c] - Min[c];
+			ptrBox->Channel = c;
+		}
+	}
+}
+
+static ulong NearestColor(ushort Color, const int (* Centers)[3], ulong PaletteCount)
+{
+	int Channels[3];
+	ulong Best = 0;
+	int BestDistance = 0x7FFFFFFF;
+
+	SplitRGB565(Color, Channels);
+	for (ulong i = 0; i < PaletteCount; i++)
+	{
+		const int * Center = Centers[i];
+		int Distance = (Channels[0] - Center[0]) * (Channels[0] - Center[0]) + (Channels[1] - Center[1]) * (Channels[1] - Center[1]) + (Channels[2] - Center[2]) * (Channels[2] - Center[2]);
+		if (Distance < BestDistance)
+		{
+			BestDistance = Distance;
+			Best = i;
+		}
+	}
+
+	return Best;
+}
+
+ulong ClusterColors(const ushort * Pixels, ulong PixelCount, ushort * Palette16, uchar * ColorMap, ulong TimeBudget)
+{
+	static thread_local sScratchBuffer ClusterScratch = { NULL, 0 };	// Histogram and color lists
+	sColorBox Boxes[256];
+	ulong BoxCount = 1;
+	double Sums[256][4];
+	int Centers[256][3];
+	LARGE_INTEGER Frequency, Start, Now;
+
+	QueryPerformanceFrequency(&Frequency);
+	QueryPerformanceCounter(&Start);
+
+	ulong * Histogram = (ulong *)ClusterScratch.Reserve(65536 * sizeof(ulong) + 65536 * sizeof(ushort) * 2);
+	if (Histogram == NULL)
+		return 0;
+	ushort * Colors = (ushort *)(Histogram + 65536);
+	ushort * Sorted = Colors + 65536;
+
+	// Count pixels of every color and list colors that are present
+	memset(Histogram, 0x00, 65536 * sizeof(ulong));
+	for (ulong i = 0; i < PixelCount; i++)
+		Histogram[Pixels[i]]++;
+
+	ulong ColorCount = 0;
+	for (ulong Color = 0; Color < 65536; Color++)
+		if (Histogram[Color] != 0)
+			Colors[ColorCount++] = (ushort)Color;
+
+	// Median cut: box with the widest channel is split at its weighted median until there are 256 boxes
+	Boxes[0].First = 0;
+	Boxes[0].Count = ColorCount;
+	MeasureColorBox(Colors, &Boxes[0]);
+	while (BoxCount < 256)
+	{
+		int Widest = -1;
+		int WidestRange = 0;
+
+		for (ulong b = 0; b < BoxCount; b++)
+		{
+			if (Boxes[b].Range > WidestRange)
+			{
+				WidestRange = Boxes[b].Range;
+				Widest = b;
+			}
+		}
+
+		// Every box holds one color
+		if (Widest < 0)
+			break;
+
+		// Sort colors of box by widest channel (counting sort, channels have 256 values at most)
+		sColorBox * Box = &Boxes[Widest];
+		int WidestChannel = Box->Channel;
+		ulong Buckets[257];
+		memset(Buckets, 0x00, sizeof(Buckets));
+		for (ulong i = Box->First; i < Box->First + Box->Count; i++)
+		{
+			int Channels[3];
+			SplitRGB565(Colors[i], Channels);
+			Buckets[Channels[WidestChannel] + 1]++;
+		}
+		for (int i = 1; i < 257; i++)
+			Buckets[i] += Buckets[i - 1];
+		for (ulong i = Box->First; i < Box->First + Box->Count; i++)
+		{
+			int Channels[3];
+			SplitRGB565(Colors[i], Channels);
+			Sorted[Buckets[Channels[WidestChannel]]++] = Colors[i];
+		}
+		memcpy(&Colors[Box->First], Sorted, Box->Count * sizeof(ushort));
+
+		// Find weighted median (both halves keep at least one color)
+		unsigned long long Total = 0, Half = 0;
+		for (ulong i = Box->First; i < Box->First + Box->Count; i++)
+			Total += Histogram[Colors[i]];
+		ulong Split = 1;
+		for (ulong i = 0; i < Box->Count - 1; i++)
+		{
+			Half += Histogram[Colors[Box->First + i]];
+			Split = i + 1;
+			if (Half * 2 >= Total)
+				break;
+		}
+
+		Boxes[BoxCount].First = Box->First + Split;
+		Boxes[BoxCount].Count = Box->Count - Split;
+		Box->Count = Split;
+		MeasureColorBox(Colors, Box);
+		MeasureColorBox(Colors, &Boxes[BoxCount]);
+		BoxCount++;
+	}
+
+	// Palette colors are weighted means of boxes
+	for (ulong b = 0; b < BoxCount; b++)
+	{
+		memset(Sums[b], 0x00, sizeof(Sums[b]));
+		for (ulong i = Boxes[b].First; i < Boxes[b].First + Boxes[b].Count; i++)
+		{
+			int Channels[3];
+			SplitRGB565(Colors[i], Channels);
+			for (int c = 0; c < 3; c++)
+				Sums[b][c] += (double)Channels[c] * Histogram[Colors[i]];
+			Sums[b][3] += Histogram[Colors[i]];
+		}
+	}
+
+	// K-means passes move palette colors to means of colors that are nearest to them, while there is time
+	for (int Pass = 0; ; Pass++)
+	{
+		// Round means to RGB565
+		for (ulong b = 0; b < BoxCount; b++)
+		{
+			if (Sums[b][3] == 0.0)
+				continue;
+
+			int R = (int)(Sums[b][0] / Sums[b][3] / 8.0 + 0.5);
+			int G = (int)(Sums[b][1] / Sums[b][3] / 4.0 + 0.5);
+			int B = (int)(Sums[b][2] / Sums[b][3] / 8.0 + 0.5);
+			Palette16[b] = (ushort)(((R > 31 ? 31 : R) << 11) | ((G > 63 ? 63 : G) << 5) | (B > 31 ? 31 : B));
+		}
+		for (ulong b = 0; b < BoxCount; b++)
+			SplitRGB565(Palette16[b], Centers[b]);
+
+		// Map every present color to its nearest palette color
+		bool Moved = false;
+		for (ulong i = 0; i < ColorCount; i++)
+		{
+			uchar Index = (uchar)NearestColor(Colors[i], Centers, BoxCount);
+			if (Pass == 0 || ColorMap[Colors[i]] != Index)
+				Moved = true;
+			ColorMap[Colors[i]] = Index;
+		}
+
+		QueryPerformanceCounter(&Now);
+		if (Moved == false || Pass >= QUANTIZER_MAX_PASSES ||
+			(TimeBudget > 0 && (Now.QuadPart - Start.QuadPart) * 1000 / Frequency.QuadPart >= (long long)TimeBudget))
+			break;
+
+		// Move palette colors
+		memset(Sums, 0x00, sizeof(Sums));
+		for (ulong i = 0; i < ColorCount; i++)
+		{
+			int Channels[3];
+			uchar Index = ColorMap[Colors[i]];
+			SplitRGB565(Colors[i], Channels);
+			for (int c = 0; c < 3; c++)
+				Sums[Index][c] += (double)Channels[c] * Histogram[Colors[i]];
+			Sums[Index][3] += Histogram[Colors[i]];
+		}
+	}
+
+	return BoxCount;
+}
+
+ulong QuantizeSmallTexture(const ushort * Texels, ulong PixelCount, bool AllowShrink, ushort * ColorSlots, uchar * Indices, uchar * Palette, sQualityMetrics * ptrMetrics)
+{
+	ushort Masked[PVR_SMALL_PIXELS];
+	ushort Palette16[256];
+	ulong ColorCount = 0;
+	bool Complete = false;
+
+	for (int Tier = 0; Tier < 9 && Complete == false; Tier++)
+	{
+		// Other quantizers may be asked for textures with more than 256 colors
+		if (Tier != 0 && AllowShrink == false)
+			return 0;
+
+		// Drop bits of current tier, 8 texels at once
+		const ushort * Colors = Texels;
+		if (Tier != 0)
+		{
+			__m128i Shrink = _mm_set1_epi16((short)PVRShrinkMasks[Tier]);
+			ulong i = 0;
+			for (; i + 8 <= PixelCount; i += 8)
+				_mm_storeu_si128((__m128i *)(Masked + i), _mm_and_si128(_mm_loadu_si128((const __m128i *)(Texels + i)), Shrink));
+			for (; i < PixelCount; i++)
+				Masked[i] = Texels[i] & PVRShrinkMasks[Tier];
+			Colors = Masked;
+		}
+
+		// Slot of every color keeps its palette index + 1, so lookup doesn't depend on color count
+		Complete = true;
+		ColorCount = 0;
+		ulong i = 0;
+		while (i < PixelCount)
+		{
+			ushort Color = Colors[i];
+
+			// Flat areas are common, 8 texels that repeat previous one are taken at once
+			if (i != 0 && Color == Colors[i - 1] && i + 8 <= PixelCount &&
+				_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_loadu_si128((const __m128i *)(Colors + i)), _mm_set1_epi16((short)Color))) == 0xFFFF)
+			{
+				memset(&Indices[i], Indices[i - 1], 8);
+				i += 8;
+				continue;
+			}
+
+			if (ColorSlots[Color] == 0)
+			{
+				if (ColorCount == 256)
+				{
+					Complete = false;
+					break;
+				}
+
+				Palette16[ColorCount++] = Color;
+				ColorSlots[Color] = (ushort)ColorCount;
+			}
+			Indices[i++] = (uchar)(ColorSlots[Color] - 1);
+		}
+
+		// Only slots of seen colors are cleared, so table is empty for next texture without touching all of it
+		for (ulong c = 0; c < ColorCount; c++)
+			ColorSlots[Palette16[c]] = 0;
+	}
+	if (Complete == false)
+		return 0;
+
+	// Palette is expanded the same way as by other quantizers
+	memset(Palette, 0x00, _8BIT_PLTE_SZ * MDL_PLTE_ENTRY_SZ);
+	for (ulong c = 0; c < ColorCount; c++)
+	{
+		Palette[c * MDL_PLTE_ENTRY_SZ + 0] = (Palette16[c] >> 11) << 3;
+		Palette[c * MDL_PLTE_ENTRY_SZ + 1] = ((Palette16[c] >> 5) & 0x3F) << 2;
+		Palette[c * MDL_PLTE_ENTRY_SZ + 2] = (Palette16[c] & 0x1F) << 3;
+	}
+
+	// Metrics don't depend on pixel order, so texels are compared in order they were given
+	MeasureQuality(Texels, Indices, Palette16, PixelCount, ptrMetrics);
+
+	return ColorCount;
+}
+
+// Deflate tables (RFC 1951)
+static const ushort LengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uchar LengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const ushort DistanceBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const uchar DistanceExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+#define DEFLATE_WINDOW_SZ 32768
+#define DEFLATE_MAX_MATCH 258
+#define DEFLATE_HASH_BITS 15
+
+// LSB-first bit stream
+struct sBitWriter
+{
+	uchar * Dst;				// Output buffer
+	ulong Position;				// Bytes written
+	ulong BitBuffer;			// Bits that are not written yet
+	int BitCount;				// How many bits are in bit buffer
+
+	void PutBits(ulong Value, int Count)
+	{
+		this->BitBuffer |= Value << this->BitCount;
+		this->BitCount += Count;
+		while (this->BitCount >= 8)
+		{
+			this->Dst[this->Position++] = (uchar)this->BitBuffer;
+			this->BitBuffer >>= 8;
+			this->BitCount -= 8;
+		}
+	}
+
+	void PutCode(ulong Code, int Length)	// Huffman codes are stored starting from most significant bit
+	{
+		ulong Reversed = 0;
+		for (int i = 0; i < Length; i++)
+			Reversed |= ((Code >> i) & 1) << (Length - 1 - i);
+		PutBits(Reversed, Length);
+	}
+
+	void PutSymbol(uint Symbol)				// Put literal/length symbol using fixed Huffman codes
+	{
+		if (Symbol < 144)
+			PutCode(0x30 + Symbol, 8);
+		else if (Symbol < 256)
+			PutCode(0x190 + Symbol - 144, 9);
+		else if (Symbol < 280)
+			PutCode(Symbol - 256, 7);
+		else
+			PutCode(0xC0 + Symbol - 280, 8);
+	}
+
+	void Flush()
+	{
+		if (this->BitCount > 0)
+			this->Dst[this->Position++] = (uchar)this->BitBuffer;
+		this->BitBuffer = 0;
+		this->BitCount = 0;
+	}
+};
+
+ulong DeflateBound(ulong SrcSize)
+{
+	// Worst case for fixed codes is a 3 byte match coded in 31 bits
+	return SrcSize + SrcSize / 2 + 64;
+}
+
+ulong ZlibCompress(const uchar * Src, ulong SrcSize, uchar * Dst)
+{
+	static thread_local sScratchBuffer HashScratch = { NULL, 0 };
+	ulong * HashTable;
+	sBitWriter Writer = { Dst, 0, 0, 0 };
+	ulong Adler1 = 1;
+	ulong Adler2 = 0;
+
+	// Table of last positions for every 3 byte hash
+	HashTable = (ulong *)HashScratch.Reserve(sizeof(ulong) << DEFLATE_HASH_BITS);
+	if (HashTable == NULL)
+		return 0;
+	memset(HashTable, 0xFF, sizeof(ulong) << DEFLATE_HASH_BITS);
+
+	// Zlib header: deflate with 32K window, fastest compression
+	Dst[Writer.Position++] = 0x78;
+	Dst[Writer.Position++] = 0x01;
+
+	// Single block with fixed Huffman codes
+	Writer.PutBits(1, 1);		// Last block
+	Writer.PutBits(1, 2);		// Fixed codes
+
+	// Greedy LZ77 with one candidate per hash
+	ulong Position = 0;
+	while (Position < SrcSize)
+	{
+		ulong MatchLength = 0;
+		ulong MatchDistance = 0;
+
+		if (Position + 3 <= SrcSize)
+		{
+			uint Hash = (((uint)Src[Position] << 16) | ((uint)Src[Position + 1] << 8) | Src[Position + 2]) * 2654435761u >> (32 - DEFLATE_HASH_BITS);
+			ulong Candidate = HashTable[Hash];
+			HashTable[Hash] = Position;
+
+			if (Candidate != 0xFFFFFFFF && Position - Candidate <= DEFLATE_WINDOW_SZ &&
+				Src[Candidate] == Src[Position] && Src[Candidate + 1] == Src[Position + 1] && Src[Candidate + 2] == Src[Position + 2])
+			{
+				ulong MaxLength = SrcSize - Position;
+				if (MaxLength > DEFLATE_MAX_MATCH)
+					MaxLength = DEFLATE_MAX_MATCH;
+
+				MatchLength = 3;
+				while (MatchLength < MaxLength && Src[Candidate + MatchLength] == Src[Position + MatchLength])
+					MatchLength++;
+				MatchDistance = Position - Candidate;
+			}
+		}
+
+		if (MatchLength == 0)
+		{
+			// Literal
+			Writer.PutSymbol(Src[Position]);
+			Position++;
+			continue;
+		}
+
+		// Length
+		int Code = 28;
+		while (LengthBase[Code] > MatchLength)
+			Code--;
+		Writer.PutSymbol(257 + Code);
+		Writer.PutBits(MatchLength - LengthBase[Code], LengthExtra[Code]);
+
+		// Distance
+		Code = 29;
+		while (DistanceBase[Code] > MatchDistance)
+			Code--;
+		Writer.PutCode(Code, 5);
+		Writer.PutBits(MatchDistance - DistanceBase[Code], DistanceExtra[Code]);
+
+		// Remember positions inside match, so following data can refer to them
+		for (ulong End = Position + MatchLength, Next = Position + 1; Next < End && Next + 3 <= SrcSize; Next++)
+			HashTable[(((uint)Src[Next] << 16) | ((uint)Src[Next + 1] << 8) | Src[Next + 2]) * 2654435761u >> (32 - DEFLATE_HASH_BITS)] = Next;
+		Position += MatchLength;
+	}
+
+	// End of block
+	Writer.PutSymbol(256);
+	Writer.Flush();
+
+	// Adler-32 checksum of uncompressed data (big endian)
+	for (ulong i = 0; i < SrcSize; )
+	{
+		ulong ChunkEnd = (SrcSize - i > 5552) ? i + 5552 : SrcSize;
+		for (; i < ChunkEnd; i++)
+		{
+			Adler1 += Src[i];
+			Adler2 += Adler1;
+		}
+		Adler1 %= 65521;
+		Adler2 %= 65521;
+	}
+	Dst[Writer.Position++] = (uchar)(Adler2 >> 8);
+	Dst[Writer.Position++] = (uchar)Adler2;
+	Dst[Writer.Position++] = (uchar)(Adler1 >> 8);
+	Dst[Writer.Position++] = (uchar)Adler1;
+
+	return Writer.Position;
+}
+
+static bool InitCRCTable(ulong * Table)
+{
+	for (ulong n = 0; n < 256; n++)
+	{
+		ulong c = n;
+		for (int k = 0; k < 8; k++)
+			c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+		Table[n] = c;
+	}
+
+	return true;
+}
+
+ulong UpdateCRC32(ulong CRC, const uchar * Data, ulong Size)	// Pass 0 as initial CRC
+{
+	static ulong Table[256];
+	static bool TableReady = InitCRCTable(Table);
+
+	CRC ^= 0xFFFFFFFF;
+	for (ulong i = 0; i < Size; i++)
+		CRC = Table[(CRC ^ Data[i]) & 0xFF] ^ (CRC >> 8);
+
+	return CRC ^ 0xFFFFFFFF;
+}
+
+static void PutBigEndian(uchar * Dst, ulong Value)
+{
+	Dst[0] = (uchar)(Value >> 24);
+	Dst[1] = (uchar)(Value >> 16);
+	Dst[2] = (uchar)(Value >> 8);
+	Dst[3] = (uchar)Value;
+}
+
+static void WritePNGChunk(FILE ** ptrFile, const char * Type, const uchar * Data, ulong Size)
+{
+	uchar Field[4];
+	ulong CRC;
+
+	PutBigEndian(Field, Size);
+	FileWriteBlock(ptrFile, Field, 4);
+	FileWriteBlock(ptrFile, (void *)Type, 4);
+	if (Size > 0)
+		FileWriteBlock(ptrFile, (void *)Data, Size);
+
+	CRC = UpdateCRC32(0, (const uchar *)Type, 4);
+	CRC = UpdateCRC32(CRC, Data, Size);
+	PutBigEndian(Field, CRC);
+	FileWriteBlock(ptrFile, Field, 4);
+}
+
+bool SavePNG(const char * FileName, const uchar * Bitmap, const uchar * Palette, ulong Width, ulong Height)	// Palette == NULL - 32-bit RGBA image
+{
+	static const uchar Signature[8] = { 0x89, 'P', 'N', 'G', 0x0D, 0x0A, 0x1A, 0x0A };
+	static thread_local sScratchBuffer RawScratch = { NULL, 0 };
+	static thread_local sScratchBuffer PackedScratch = { NULL, 0 };
+	uchar Header[13];
+	uchar * Raw;
+	uchar * Packed;
+	ulong LineSize = (Palette != NULL) ? Width : Width * 4;
+	ulong RawSize = (LineSize + 1) * Height;
+	ulong PackedSize;
+	FILE * ptrFile;
+
+	// Scanlines with "None" filter (best choice for palettized images, fastest for others)
+	Raw = (uchar *)RawScratch.Reserve(RawSize);
+	Packed = (uchar *)PackedScratch.Reserve(DeflateBound(RawSize));
+	if (Raw == NULL || Packed == NULL)
+	{
+		LogPrint(LOG_ERROR, "Memory allocation failure!\n");
+		return false;
+	}
+	for (ulong Y = 0; Y < Height; Y++)
+	{
+		Raw[Y * (LineSize + 1)] = 0;
+		memcpy(&Raw[Y * (LineSize + 1) + 1], &Bitmap[Y * LineSize], LineSize);
+	}
+
+	PackedSize = ZlibCompress(Raw, RawSize, Packed);
+	if (PackedSize == 0)
+	{
+		LogPrint(LOG_ERROR, "Memory allocation failure!\n");
+		return false;
+	}
+
+	// 8-bit palettized or 32-bit RGBA image
+	PutBigEndian(&Header[0], Width);
+	PutBigEndian(&Header[4], Height);
+	Header[8] = 8;				// Bit depth
+	Header[9] = (Palette != NULL) ? 3 : 6;	// Color type: palette or RGBA
+	Header[10] = 0;				// Compression: deflate
+	Header[11] = 0;				// Filter method: adaptive
+	Header[12] = 0;				// No interlace
+
+	if (SafeFileOpen(&ptrFile, FileName, "wb") == false)
+		return false;
+	FileWriteBlock(&ptrFile, (void *)Signature, sizeof(Signature));
+	WritePNGChunk(&ptrFile, "IHDR", Header, sizeof(Header));
+	if (Palette != NULL)
+		WritePNGChunk(&ptrFile, "PLTE", Palette, _8BIT_PLTE_SZ * MDL_PLTE_ENTRY_SZ);
+	WritePNGChunk(&ptrFile, "IDAT", Packed, PackedSize);
+	WritePNGChunk(&ptrFile, "IEND", NULL, 0);
+
+	return SafeFileClose(&ptrFile, FileName);
+}
+
+bool SaveTGA(const char * FileName, const uchar * Bitmap, const uchar * Palette, ulong Width, ulong Height)	// Palette == NULL - 32-bit BGRA image
+{
+	static thread_local sScratchBuffer PackedScratch = { NULL, 0 };
+	sTGAHeader TGAHeader;
+	uchar * Packed;
+	ulong PackedSize = 0;
+	ulong PixelSize = (Palette != NULL) ? 1 : 4;
+	FILE * ptrFile;
+
+	// Worst case: every 128 pixels need one extra packet header
+	Packed = (uchar *)PackedScratch.Reserve(Width * Height * PixelSize + Height * (Width / 128 + 1));
+	if (Packed == NULL)
+	{
+		LogPrint(LOG_ERROR, "Memory allocation failure!\n");
+		return false;
+	}
+
+	// Packets don't cross scanlines
+	for (ulong Y = 0; Y < Height; Y++)
+	{
+		const uchar * Line = &Bitmap[Y * Width * PixelSize];
+		ulong X = 0;
+
+		#define SAME_PIXELS(A, B) (!memcmp(&Line[(A) * PixelSize], &Line[(B) * PixelSize], PixelSize))
+
+		while (X < Width)
+		{
+			// Measure run of equal pixels
+			ulong Run = 1;
+			while (X + Run < Width && Run < 128 && SAME_PIXELS(X + Run, X))
+				Run++;
+
+			if (Run >= 3)
+			{
+				// Run-length packet
+				Packed[PackedSize++] = 0x80 | (uchar)(Run - 1);
+				memcpy(&Packed[PackedSize], &Line[X * PixelSize], PixelSize);
+				PackedSize += PixelSize;
+				X += Run;
+			}
+			else
+			{
+				// Raw packet: lasts until next run of 3 or more equal pixels (shorter runs aren't worth a packet)
+				ulong Count = 1;
+				while (X + Count < Width && Count < 128 &&
+					!(X + Count + 2 < Width && SAME_PIXELS(X + Count, X + Count + 1) && SAME_PIXELS(X + Count, X + Count + 2)))
+					Count++;
+
+				Packed[PackedSize++] = (uchar)(Count - 1);
+				memcpy(&Packed[PackedSize], &Line[X * PixelSize], Count * PixelSize);
+				PackedSize += Count * PixelSize;
+				X += Count;
+			}
+		}
+
+		#undef SAME_PIXELS
+	}
+
+	if (Palette != NULL)
+		TGAHeader.Update(Width, Height);
+	else
+		TGAHeader.UpdateTrueColor(Width, Height);
+
+	if (SafeFileOpen(&ptrFile, FileName, "wb") == false)
+		return false;
+	FileWriteBlock(&ptrFile, &TGAHeader, sizeof(sTGAHeader));
+	if (Palette != NULL)
+		FileWriteBlock(&ptrFile, (void *)Palette, _8BIT_PLTE_SZ * MDL_PLTE_ENTRY_SZ);
+	FileWriteBlock(&ptrFile, Packed, PackedSize);
+
+	return SafeFileClose(&ptrFile, FileName);
+}
@@ -0,0 +1,277 @@
+/*
+=====================================================================
+Copyright (c) 2018, Alexey Leushin
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or
+without modification, are permitted provided that the following
+conditions are met:
+- Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+- Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+- Neither the name of the copyright holders nor the names of its
+contributors may be used to endorse or promote products derived
+from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+=====================================================================
+*/
+
+//
+// This file contains message log of batch and server modes (workers queue messages, background thread prints them)
+//
+
+////////// Includes //////////
+#include "main.h"
+
+////////// Definitions //////////
+#define LOG_RING_SZ 65536				// How much text every thread can queue before it has to wait for writer (power of two)
+#define LOG_LINE_SZ 1024				// Longest message (longer ones are cut)
+#define LOG_FLUSH_MS 10					// How often writer looks for messages when nobody wakes it
+
+////////// Structures //////////
+
+// Messages of one thread (only owner adds text and only writer takes it, both positions only grow, so no locking is needed)
+struct sLogBuffer
+{
+	char Data[LOG_RING_SZ];		// Ring buffer with text
+	volatile LONG Published;	// Text before this position can be printed (moved by owner)
+	volatile LONG Consumed;		// Text before this position is printed (moved by writer)
+	ulong Written;				// Text before this position is queued, including held back group (owner only)
+	uint GroupDepth;			// How many groups are open (owner only)
+	sLogBuffer * Next;			// Buffer of another thread
+};
+
+////////// Global variables //////////
+bool LogAsync = false;							// Set while background writer runs
+volatile LONG LogStopping = 0;					// Tells writer to print what's left and exit
+CRITICAL_SECTION LogLock;						// Protects list of buffers
+sLogBuffer * LogBuffers = NULL;					// Buffers of all threads that queued something
+thread_local sLogBuffer * ThreadLog = NULL;		// Buffer of current thread
+HANDLE LogWriter = NULL;						// Background writer thread
+HANDLE LogWake = NULL;							// Set when new text is published
+
+////////// Functions //////////
+DWORD WINAPI LogThread(LPVOID Param);																		// Writer: print published text of all threads
+sLogBuffer * LogThreadBuffer();																				// Get buffer of current thread (made on first message)
+void LogPrintBuffer(sLogBuffer * ptrBuffer, ulong End);														// Print text of buffer up to End
+
+void LogStart()		// Start background writer of batch and server messages
+{
+	// Batch of many models prints only what is worth reading unless asked otherwise
+	if (ProgOptions.LogLevelSet == false)
+		ProgOptions.LogLevel = LOG_INFO;
+
+	if (LogAsync == true)
+		return;
+
+	InitializeCriticalSection(&LogLock);
+	LogWake = CreateEventA(NULL, FALSE, FALSE, NULL);
+	if (LogWake == NULL)
+	{
+		DeleteCriticalSection(&LogLock);
+		return;
+	}
+
+	// Flag must be set before any worker exists, writer only reads it
+	LogStopping = 0;
+	LogAsync = true;
+	LogWriter = CreateThread(NULL, 0, LogThread, NULL, 0, NULL);
+	if (LogWriter == NULL)
+	{
+		LogAsync = false;
+		CloseHandle(LogWake);
+		DeleteCriticalSection(&LogLock);
+	}
+}
+
+void LogStop()		// Write out remaining messages and stop background writer
+{
+	sLogBuffer * ptrBuffer;
+
+	if (LogAsync == false)
+		return;
+
+	InterlockedExchange(&LogStopping, 1);
+	SetEvent(LogWake);
+	WaitForSingleObject(LogWriter, INFINITE);
+	CloseHandle(LogWriter);
+	CloseHandle(LogWake);
+
+	// Workers are gone, so groups that they left open are printed too
+	while (LogBuffers != NULL)
+	{
+		ptrBuffer = LogBuffers;
+		LogBuffers = ptrBuffer->Next;
+		LogPrintBuffer(ptrBuffer, ptrBuffer->Written);
+		free(ptrBuffer);
+	}
+	fflush(stdout);
+
+	DeleteCriticalSection(&LogLock);
+	LogWriter = NULL;
+	LogWake = NULL;
+	ThreadLog = NULL;
+	LogAsync = false;
+}
+
+void LogWrite(const char * Format, ...)		// Print message (queued for background writer while workers run)
+{
+	char Line[LOG_LINE_SZ];
+	sLogBuffer * ptrBuffer;
+	va_list Args;
+	int Length;
+
+	va_start(Args, Format);
+
+	if (LogAsync == false)
+	{
+		vprintf(Format, Args);
+		va_end(Args);
+		return;
+	}
+
+	Length = vsnprintf(Line, sizeof(Line), Format, Args);
+	va_end(Args);
+
+	if (Length <= 0)
+		return;
+	if (Length >= (int)sizeof(Line))
+		Length = sizeof(Line) - 1;
+
+	ptrBuffer = LogThreadBuffer();
+	if (ptrBuffer == NULL)
+	{
+		fwrite(Line, 1, Length, stdout);
+		return;
+	}
+
+	// Wait until writer makes room (group that doesn't fit goes out in parts)
+	while (ptrBuffer->Written + Length - (ulong)ptrBuffer->Consumed > LOG_RING_SZ)
+	{
+		InterlockedExchange(&ptrBuffer->Published, (LONG)ptrBuffer->Written);
+		SetEvent(LogWake);
+		Sleep(1);
+	}
+
+	for (int i = 0; i < Length; i++)
+		ptrBuffer->Data[(ptrBuffer->Written + i) & (LOG_RING_SZ - 1)] = Line[i];
+	ptrBuffer->Written += Length;
+
+	// Messages outside of groups go out at once, writer is woken by timer
+	if (ptrBuffer->GroupDepth == 0)
+		InterlockedExchange(&ptrBuffer->Published, (LONG)ptrBuffer->Written);
+}
+
+void LogBeginGroup()		// Hold back messages of current thread until LogEndGroup(), so output of one model isn't mixed with others
+{
+	sLogBuffer * ptrBuffer;
+
+	if (LogAsync == false)
+		return;
+
+	ptrBuffer = LogThreadBuffer();
+	if (ptrBuffer != NULL)
+		ptrBuffer->GroupDepth++;
+}
+
+void LogEndGroup()		// Let held back messages of current thread go out
+{
+	sLogBuffer * ptrBuffer;
+
+	if (LogAsync == false)
+		return;
+
+	ptrBuffer = LogThreadBuffer();
+	if (ptrBuffer == NULL || ptrBuffer->GroupDepth == 0)
+		return;
+
+	if (--ptrBuffer->GroupDepth == 0)
+	{
+		InterlockedExchange(&ptrBuffer->Published, (LONG)ptrBuffer->Written);
+		SetEvent(LogWake);
+	}
+}
+
+sLogBuffer * LogThreadBuffer()		// Get buffer of current thread (made on first message)
+{
+	if (ThreadLog != NULL)
+		return ThreadLog;
+
+	ThreadLog = (sLogBuffer *)malloc(sizeof(sLogBuffer));
+	if (ThreadLog == NULL)
+		return NULL;
+
+	ThreadLog->Published = 0;
+	ThreadLog->Consumed = 0;
+	ThreadLog->Written = 0;
+	ThreadLog->GroupDepth = 0;
+
+	EnterCriticalSection(&LogLock);
+	ThreadLog->Next = LogBuffers;
+	LogBuffers = ThreadLog;
+	LeaveCriticalSection(&LogLock);
+
+	return ThreadLog;
+}
+
+void LogPrintBuffer(sLogBuffer * ptrBuffer, ulong End)		// Print text of buffer up to End
+{
+	ulong Start = (ulong)ptrBuffer->Consumed;
+	ulong Offset = Start & (LOG_RING_SZ - 1);
+	ulong Length = End - Start;
+	ulong FirstPart;
+
+	if (Length == 0)
+		return;
+
+	// Text can wrap around end of ring
+	FirstPart = (Length < LOG_RING_SZ - Offset) ? Length : LOG_RING_SZ - Offset;
+	fwrite(&ptrBuffer->Data[Offset], 1, FirstPart, stdout);
+	if (Length > FirstPart)
+		fwrite(ptrBuffer->Data, 1, Length - FirstPart, stdout);
+
+	InterlockedExchange(&ptrBuffer->Consumed, (LONG)End);
+}
+
+DWORD WINAPI LogThread(LPVOID Param)		// Writer: print published text of all threads
+{
+	sLogBuffer * ptrFirst;
+	bool Stopping;
+
+	while (true)
+	{
+		// Text that was published before stop request is printed in this pass
+		Stopping = (LogStopping != 0);
+
+		// New buffers are added at head, so list after head never changes
+		EnterCriticalSection(&LogLock);
+		ptrFirst = LogBuffers;
+		LeaveCriticalSection(&LogLock);
+
+		for (sLogBuffer * ptrBuffer = ptrFirst; ptrBuffer != NULL; ptrBuffer = ptrBuffer->Next)
+			LogPrintBuffer(ptrBuffer, (ulong)ptrBuffer->Published);
+
+		fflush(stdout);
+
+		if (Stopping == true)
+			break;
+
+		WaitForSingleObject(LogWake, LOG_FLUSH_MS);
+	}
+
+	return 0;
+}
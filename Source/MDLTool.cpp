@@ -38,11 +38,24 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "main.h"
 
 ////////// Global variables //////////
+sProgOptions ProgOptions;					// Command line options
+thread_local sScratchBuffer * ScratchBuffers = NULL;	// Scratch buffers allocated by current thread
 
 ////////// Functions //////////
-void ExtractMDLTextures(const char * FileName);																		// Extract textures from PC model
-void ConvertPVRToMDL(const char * FileName);																		// Convert model from PS2 to PC format
+int ExtractMDLTextures(const char * FileName);																		// Extract textures from PC model
+int ConvertPVRToMDL(const char * FileName);																			// Convert model from PS2 to PC format
+int ConvertSmallTextures(FILE ** ptrInFile, FILE ** ptrOutFile, const char * FileName, const sModelTextureEntry * ModelTextureTable, sPVRSource * Sources, ulong TextureCount);	// Convert all small textures of model in one pass (textures that need other quantizer are left for usual way)
 int CheckModel(const char * FileName);																				// Check model type
+bool CheckPVRModel(const char * FileName);																			// Check if model has PVR textures
+int ProcessFile(int Job, const char * FileName);																	// Check model and run job on it
+int RunJob(int Job, const char * FileName);																			// Check model type and run job on it
+int ExtractPVRTrueColor(FILE ** ptrInFile, ulong Offset, char * OutFileName);										// Save PVR texture in 32-bit format (returns result of job)
+int MakeModelThumbs(const char * FileName);																			// Save previews of all model textures on one contact sheet
+int ListMDLTextures(const char * FileName);																			// Print texture table of PC model without decoding textures
+bool SaveTexture(sTexture * ptrTexture, char * OutFileName);														// Save 8-bit texture in selected format (extension is added to OutFileName)
+int TranscodePVR(const char * FileName);																			// Convert loose PVR texture to image file
+bool ParseOption(const char * Option);																				// Apply "--option" command line argument
+void PauseProgram();																								// Wait for key press unless running unattended
 
 
 
@@ -55,7 +68,8 @@ int CheckModel(const char * FileName)	// Check model type
 	int ModelType;
 
 	// Open model file
-	SafeFileOpen(&ptrModelFile, FileName, "rb");
+	if (SafeFileOpen(&ptrModelFile, FileName, "rb") == false)
+		return UNKNOWN_MODEL;
 
 	// Check for dummy model (consists of signature, name and file size fields only)
 	if (FileSize(&ptrModelFile) < sizeof(sModelHeader))
@@ -76,156 +90,455 @@ int CheckModel(const char * FileName)	// Check model type
 	return ModelType;
 }
 
-void ConvertPVRToMDL(const char * FileName)		// Convert model from Dreamcast to PC format 
+bool CheckPVRModel(const char * FileName)	// Check if model has PVR textures
+{
+	FILE * ptrModelFile;
+	sModelHeader ModelHeader;
+	sModelTextureEntry TextureEntry;
+	char Extension[5];
+
+	if (CheckModel(FileName) != NORMAL_MODEL)
+		return false;
+
+	// Texture type is determined by extension of first texture
+	if (SafeFileOpen(&ptrModelFile, FileName, "rb") == false)
+		return false;
+	ModelHeader.UpdateFromFile(&ptrModelFile);
+	TextureEntry.UpdateFromFile(&ptrModelFile, ModelHeader.TextureTableOffset, 0);
+	fclose(ptrModelFile);
+
+	TextureEntry.Name[sizeof(TextureEntry.Name) - 1] = '\0';
+	FileGetExtension(TextureEntry.Name, Extension, sizeof(Extension));
+
+	return !strcmp(Extension, ".pvr");
+}
+
+int ConvertPVRToMDL(const char * FileName)		// Convert model from Dreamcast to PC format 
 {
 	sModelHeader ModelHeader;					// Model file header
 	sModelTextureEntry * ModelTextureTable;		// Model texture table
 	ulong ModelTextureTableSize;				// Model texture table size (how many textures)
-	sTexture * Textures;						// Pointer to textures data
+	sPVRSource * Sources;						// PVR textures in original file
+	sTexture Texture;							// Texture that is being converted
 
 	FILE * ptrInFile;
 	char cNewModelName[64];
 	FILE * ptrOutFile;
-	char cInFileName[255];
-
-	ulong ModelSize;
+	char cInFileName[MAX_PATH];
+	char cOutFileName[MAX_PATH];
+	char cTempFileName[MAX_PATH];
+	char cBackupFileName[MAX_PATH];
+	bool InPlace = (ProgOptions.OutFolder[0] == '\0');
+
+	// Original file keeps its name until converted model is complete, so it's read in place
+	strcpy(cInFileName, FileName);
+	if (InPlace == true)
+	{
+		// Backup is made right before result replaces original
+		FileGetFullName(FileName, cBackupFileName, sizeof(cBackupFileName));
+		strcat(cBackupFileName, "-backup.mdl");
+		strcpy(cOutFileName, FileName);
+	}
+	else
+	{
+		// Original file is left untouched, result goes to the same place in output tree
+		FileMirrorName(ProgOptions.OutFolder, FileName, cOutFileName, sizeof(cOutFileName));
+		GenerateFolders(cOutFileName);
+	}
 
-	// Backup original file
-	FileGetFullName(FileName, cInFileName, sizeof(cInFileName));
-	strcat(cInFileName, "-backup.mdl");
-	FileSafeRename((char *) FileName, cInFileName);
+	// Result is written next to its final place and renamed when it's complete
+	snprintf(cTempFileName, sizeof(cTempFileName), "%s.tmp", cOutFileName);
 
 	// Open file
-	SafeFileOpen(&ptrInFile, cInFileName, "rb");
+	if (SafeFileOpen(&ptrInFile, cInFileName, "rb") == false)
+		return RESULT_IO_ERROR;
 
 	// Get header from file
+	long long TraceStart = TraceClock();
 	ModelHeader.UpdateFromFile(&ptrInFile);
 
 	// Check model
 	if (ModelHeader.CheckModel() == NORMAL_MODEL)
 	{
-		printf("Internal name: %s \nTextures: %i, Texture table offset: 0x%X \n", ModelHeader.Name, ModelHeader.TextureCount, ModelHeader.TextureTableOffset);
+		LogPrint(LOG_DETAIL, "Internal name: %s \nTextures: %i, Texture table offset: 0x%X \n", ModelHeader.Name, ModelHeader.TextureCount, ModelHeader.TextureTableOffset);
 	}
 	else
 	{
-		puts("Incorrect model file.");
+		LogPrint(LOG_ERROR, "Incorrect model file.\n");
 
-		// Restore original file
 		fclose(ptrInFile);
-		FileSafeRename(cInFileName, (char *) FileName);
-		
-		return;
+
+		return RESULT_BAD_MODEL;
 	}
 
-	// Allocate memory for textures
+	// Allocate memory for texture table
 	ModelTextureTableSize = ModelHeader.TextureCount * sizeof(sModelTextureEntry);
 	ModelTextureTable = (sModelTextureEntry *)malloc(ModelTextureTableSize);
-	Textures = (sTexture *)malloc(sizeof(sTexture) * ModelHeader.TextureCount);
+	Sources = (sPVRSource *)malloc(sizeof(sPVRSource) * ModelHeader.TextureCount);
+	if (ModelTextureTable == NULL || Sources == NULL)
+	{
+		LogPrint(LOG_ERROR, "Unable to allocate memory ...\n");
+		free(ModelTextureTable);
+		free(Sources);
+		fclose(ptrInFile);
 
-	// Load and convert textures
-	uint BitmapOffset;
-	uint BitmapSize;
-	uint PaletteOffset;
-	uint PaletteSize;
+		return RESULT_NO_MEMORY;
+	}
+
+	// Plan output layout: texture sizes are known from PVR headers, so every texture
+	// can be placed before anything is decoded
+	ModelHeader.TextureDataOffset = ModelHeader.TextureTableOffset + sizeof(sModelTextureEntry) * ModelHeader.TextureCount + ModelHeader.SkinCount * ModelHeader.SkinEntrySize * 2;
+	ulong Offset = ModelHeader.TextureDataOffset;
+	Texture.Initialize();
 	for (int i = 0; i < ModelHeader.TextureCount; i++)
 	{
-		bool Result;
 		char NewName[64];
+		sPVRImageHeader PVRImageHeader;
+		ulong PVRDataOffset;
 
 		ModelTextureTable[i].UpdateFromFile(&ptrInFile, ModelHeader.TextureTableOffset, i);
-		printf("\nTexture #%i \nName: %s \n", i + 1, ModelTextureTable[i].Name);
+		LogPrint(LOG_DETAIL, "\nTexture #%i \nName: %s \n", i + 1, ModelTextureTable[i].Name);
 
 		// Check for PVR textures
 		char Extension[5];
 		FileGetExtension(ModelTextureTable[i].Name, Extension, sizeof(Extension));
 		if (!strcmp(Extension, ".bmp") == true)
 		{
-			puts("Normal model, ignoring ...");
+			LogPrint(LOG_INFO, "Normal model, ignoring ...\n");
 
-			// Restore original file
+			free(ModelTextureTable);
+			free(Sources);
 			fclose(ptrInFile);
-			FileSafeRename(cInFileName, (char *)FileName);
 
-			return;
+			return RESULT_OK;
 		}
 
-		// Load & convert texture
-		FileGetName(ModelTextureTable[i].Name, NewName, sizeof(NewName), false);
-		strcat(NewName, ".bmp");
-		strcpy(ModelTextureTable[i].Name, NewName);
-		Textures[i].Initialize();
-		Result = Textures[i].UpdateFromPVR(&ptrInFile, ModelTextureTable[i].Offset, ModelTextureTable[i].Name);
-		if (Result == false)
+		// Check PVR headers and get texture dimensions
+		if (Texture.LoadPVRHeader(&ptrInFile, ModelTextureTable[i].Offset, &PVRImageHeader, &PVRDataOffset) == false)
 		{
-			printf("Warning: can't recognise texture: %s.\nPress any key to exit ...", ModelTextureTable[i].Name);
-			getchar();
+			LogPrint(LOG_ERROR, "Warning: can't recognise texture: %s.\n", ModelTextureTable[i].Name);
 
-			// Restore original file
+			free(ModelTextureTable);
+			free(Sources);
 			fclose(ptrInFile);
-			FileSafeRename(cInFileName, (char *)FileName);
 
-			return;
+			return RESULT_BAD_TEXTURE;
 		}
+		LogPrint(LOG_DETAIL, "Width: %i, Height: %i \n", PVRImageHeader.Width, PVRImageHeader.Height);
+
+		// Update texture entry
+		Sources[i].FileOffset = ModelTextureTable[i].Offset;
+		Sources[i].DataOffset = PVRDataOffset;
+		Sources[i].Header = PVRImageHeader;
+		Sources[i].Converted = false;
+		FileGetName(ModelTextureTable[i].Name, NewName, sizeof(NewName), false);
+		strcat(NewName, ".bmp");
+		strcpy(ModelTextureTable[i].Name, NewName);
+		ModelTextureTable[i].Width = PVRImageHeader.Width;
+		ModelTextureTable[i].Height = PVRImageHeader.Height;
+		ModelTextureTable[i].Offset = Offset;
+
+		Offset += PVRImageHeader.Width * PVRImageHeader.Height + _8BIT_PLTE_SZ * MDL_PLTE_ENTRY_SZ;
 	}
+	ModelHeader.FileSize = Offset;
+	TraceSpan("header read", TraceStart, FileName, 0, 0);
 
 	// Write results to output file
-	// Open output file
-	SafeFileOpen(&ptrOutFile, FileName, "wb");
-
-	// Write modified header
-	ModelHeader.TextureDataOffset = ModelHeader.TextureTableOffset + sizeof(sModelTextureEntry) * ModelHeader.TextureCount + ModelHeader.SkinCount * ModelHeader.SkinEntrySize * 2;
-	FileWriteBlock(&ptrOutFile, (char *)&ModelHeader, sizeof(sModelHeader));
+	// Start from a system copy of the original model: model data between header and texture table
+	// keeps its place, so it never passes through our buffers (blocks are cloned instead of copied
+	// on volumes that support it)
+	TraceStart = TraceClock();
+	if (FileCloneCopy(cInFileName, cTempFileName) == false)
+	{
+		LogPrint(LOG_ERROR, "Can't create output file ...\n");
 
-	// Write model data
-	uchar * ModelData;
-	ModelData = (uchar *)malloc(ModelHeader.TextureTableOffset - sizeof(sModelHeader));
-	FileReadBlock(&ptrInFile, (char *)ModelData, sizeof(sModelHeader), ModelHeader.TextureTableOffset - sizeof(sModelHeader));
-	FileWriteBlock(&ptrOutFile, (char *)ModelData, ModelHeader.TextureTableOffset - sizeof(sModelHeader));
-	free(ModelData);
+		free(ModelTextureTable);
+		free(Sources);
+		fclose(ptrInFile);
 
-	// Write modified texture table
-	uint Offset = ModelHeader.TextureDataOffset;
-	for (int i = 0; i < ModelHeader.TextureCount; i++)
+		return RESULT_IO_ERROR;
+	}
+	if (SafeFileOpen(&ptrOutFile, cTempFileName, "r+b") == false)
 	{
-		ModelTextureTable[i].Width = Textures[i].Width;
-		ModelTextureTable[i].Height = Textures[i].Height;
-		ModelTextureTable[i].Offset = Offset;
+		free(ModelTextureTable);
+		free(Sources);
+		fclose(ptrInFile);
+		remove(cTempFileName);
 
-		Offset += Textures[i].Width * Textures[i].Height + Textures[i].PaletteSize;
+		return RESULT_IO_ERROR;
 	}
-	FileWriteBlock(&ptrOutFile, (char *)ModelTextureTable, ModelTextureTableSize);
+	TraceSpan("copy", TraceStart, FileName, 0, 0);
+
+	// Write modified header
+	FileWriteBlock(&ptrOutFile, (char *)&ModelHeader, 0, sizeof(sModelHeader));
 
-	// Write skin data
-	uchar * SkinTable;
+	// Write modified texture table
+	FileWriteBlock(&ptrOutFile, (char *)ModelTextureTable, ModelHeader.TextureTableOffset, ModelTextureTableSize);
+
+	// Write skin data right after texture table (usually it's already there)
 	ulong SkinTableSize = ModelHeader.SkinCount * ModelHeader.SkinEntrySize * 2;
-	SkinTable = (uchar *)malloc(SkinTableSize);
-	FileReadBlock(&ptrInFile, SkinTable, ModelHeader.SkinTableOffset, SkinTableSize);
-	FileWriteBlock(&ptrOutFile, SkinTable, SkinTableSize);
-	free(SkinTable);
+	if (ModelHeader.SkinTableOffset != ModelHeader.TextureTableOffset + ModelTextureTableSize)
+	{
+		uchar * SkinTable;
+		SkinTable = (uchar *)malloc(SkinTableSize);
+		FileReadBlock(&ptrInFile, SkinTable, ModelHeader.SkinTableOffset, SkinTableSize);
+		FileWriteBlock(&ptrOutFile, SkinTable, ModelHeader.TextureTableOffset + ModelTextureTableSize, SkinTableSize);
+		free(SkinTable);
+	}
 
-	// Write textures
+	// Small textures go first, all at once
+	int Result = ConvertSmallTextures(&ptrInFile, &ptrOutFile, FileName, ModelTextureTable, Sources, ModelHeader.TextureCount);
+	if (Result != RESULT_OK)
+	{
+		free(ModelTextureTable);
+		free(Sources);
+		fclose(ptrInFile);
+		fclose(ptrOutFile);
+		remove(cTempFileName);
+
+		return Result;
+	}
+
+	// Convert other textures one by one and write each one at its planned offset,
+	// so only one decoded texture is held in memory at a time
 	for (int i = 0; i < ModelHeader.TextureCount; i++)
 	{
-		FileWriteBlock(&ptrOutFile, (char *)Textures[i].Bitmap, Textures[i].Width * Textures[i].Height);		
-		FileWriteBlock(&ptrOutFile, (char *)Textures[i].Palette, Textures[i].PaletteSize);
+		if (Sources[i].Converted == true)
+			continue;
+
+		LogPrint(LOG_DETAIL, "\nConverting texture #%i: %s \n", i + 1, ModelTextureTable[i].Name);
+
+		int TextureResult = Texture.UpdateFromPVR(&ptrInFile, Sources[i].FileOffset, ModelTextureTable[i].Name);
+		if (TextureResult != RESULT_OK)
+		{
+			if (TextureResult == RESULT_BAD_TEXTURE)
+				LogPrint(LOG_ERROR, "Warning: can't convert texture: %s.\n", ModelTextureTable[i].Name);
+
+			// Drop incomplete output, original file was never touched
+			Texture.Free();
+			free(ModelTextureTable);
+			free(Sources);
+			fclose(ptrInFile);
+			fclose(ptrOutFile);
+			remove(cTempFileName);
+
+			return TextureResult;
+		}
+		ReportQuality(FileName, &Texture);
+
+		TraceStart = TraceClock();
+		FileWriteBlock(&ptrOutFile, (char *)Texture.Bitmap, ModelTextureTable[i].Offset, Texture.Width * Texture.Height);
+		FileWriteBlock(&ptrOutFile, (char *)Texture.Palette, ModelTextureTable[i].Offset + Texture.Width * Texture.Height, Texture.PaletteSize);
+		TraceSpan("write", TraceStart, Texture.Name, Texture.Width, Texture.Height);
+		Texture.Free();
 	}
 
-	// Update model size field
-	ModelSize = FileSize(&ptrOutFile);
-	FileWriteBlock(&ptrOutFile, &ModelSize, 0x48, sizeof(ModelSize));	// 0x48 - address of model size field
+	// Cut off what's left of original PVR data (error flag of stream stays set, so failed writes are seen here too)
+	bool WriteFailed = (fflush(ptrOutFile) != 0 || ferror(ptrOutFile) != 0 || _chsize_s(_fileno(ptrOutFile), ModelHeader.FileSize) != 0);
 
 	// Free memory
 	free(ModelTextureTable);
-	free(Textures);
+	free(Sources);
 	
 	// Close files
+	TraceStart = TraceClock();
 	fclose(ptrInFile);
-	fclose(ptrOutFile);
+	if (fclose(ptrOutFile) != 0)
+		WriteFailed = true;
+
+	// Incomplete model never gets near original
+	if (WriteFailed == true)
+	{
+		LogPrint(LOG_ERROR, "Error: can't write file: %s\n", cTempFileName);
+		remove(cTempFileName);
+
+		return RESULT_IO_ERROR;
+	}
+
+	// Put complete result in its place (or in PAK)
+	if (ProgOptions.PakFile[0] != '\0')
+	{
+		if (PakAddFile(cTempFileName, cOutFileName) == false)
+			return RESULT_IO_ERROR;
+	}
+	else
+	{
+		// Model exists under its name all the time: backup is a clone of original and
+		// converted model takes its place in one rename
+		if (InPlace == true && FileCloneCopy(FileName, cBackupFileName) == false)
+		{
+			LogPrint(LOG_ERROR, "Error: can't make backup: %s\n", cBackupFileName);
+			remove(cTempFileName);
+
+			return RESULT_IO_ERROR;
+		}
+
+		if (FileAtomicReplace(cTempFileName, cOutFileName) == false)
+		{
+			LogPrint(LOG_ERROR, "Error: can't replace file: %s\n", cOutFileName);
+			remove(cTempFileName);
+
+			return RESULT_IO_ERROR;
+		}
+	}
+	TraceSpan("commit", TraceStart, FileName, 0, 0);
+
+	LogPrint(LOG_INFO, "\nDone!\n\n\n\n");
+
+	return RESULT_OK;
+}
+
+int ConvertSmallTextures(FILE ** ptrInFile, FILE ** ptrOutFile, const char * FileName, const sModelTextureEntry * ModelTextureTable, sPVRSource * Sources, ulong TextureCount)	// Convert all small textures of model in one pass (textures that need other quantizer are left for usual way)
+{
+	static thread_local sScratchBuffer SpanScratch = { NULL, 0 };		// PVR data of small textures
+	static thread_local sScratchBuffer ResultScratch = { NULL, 0 };		// Converted small textures (bitmap and palette of each, one after another like in model)
+	static thread_local sScratchBuffer SlotScratch = { NULL, 0 };		// Palette slot of every RGB565 color (empty between textures)
+	ushort DirectImage[PVR_SMALL_PIXELS];
+	uchar Indices[PVR_SMALL_PIXELS];
+	sTexture Texture;
+	ulong SpanStart = 0xFFFFFFFF;
+	ulong SpanEnd = 0;
+	ulong ResultSize = 0;
+	ulong SmallCount = 0;
+	ulong ConvertedCount = 0;
+	char PSNR[16];
+
+	// Textures with more than 256 colors are shrinked here only when no other quantizer is asked for
+	bool AllowShrink = (ProgOptions.Dither == false && ProgOptions.QualityTarget == 0.0 && ProgOptions.TimeBudget == 0);
+
+	// Find small textures and part of file that holds them
+	Texture.Initialize();
+	for (ulong i = 0; i < TextureCount; i++)
+	{
+		ulong PixelCount = Sources[i].Header.Width * Sources[i].Header.Height;
+		if (PixelCount > PVR_SMALL_PIXELS)
+			continue;
+
+		Sources[i].BatchOffset = ResultSize;
+		ResultSize += PixelCount + _8BIT_PLTE_SZ * MDL_PLTE_ENTRY_SZ;
+		SmallCount++;
+
+		if (Sources[i].DataOffset < SpanStart)
+			SpanStart = Sources[i].DataOffset;
+		if (Sources[i].DataOffset + Texture.PVRDataSize(&Sources[i].Header) > SpanEnd)
+			SpanEnd = Sources[i].DataOffset + Texture.PVRDataSize(&Sources[i].Header);
+	}
+	if (SmallCount == 0)
+		return RESULT_OK;
+
+	// Slot table is cleared only when it's allocated, every texture leaves it empty
+	bool FreshSlots = (SlotScratch.Size < 65536 * sizeof(ushort));
+	ushort * ColorSlots = (ushort *)SlotScratch.Reserve(65536 * sizeof(ushort));
+	uchar * Results = (uchar *)ResultScratch.Reserve(ResultSize);
+	if (ColorSlots == NULL || Results == NULL)
+	{
+		LogPrint(LOG_ERROR, "Memory allocation failure!\n");
+		return RESULT_NO_MEMORY;
+	}
+	if (FreshSlots == true)
+		memset(ColorSlots, 0x00, 65536 * sizeof(ushort));
+
+	LogPrint(LOG_DETAIL, "\nConverting %lu small textures ...\n", SmallCount);
+	long long TraceStart = TraceClock();
+
+	// Small textures usually lie next to each other, so they are read at once
+	uchar * Span = NULL;
+	if (SpanEnd - SpanStart <= PVR_SMALL_SPAN)
+	{
+		Span = (uchar *)SpanScratch.Reserve(SpanEnd - SpanStart);
+		if (Span == NULL)
+		{
+			LogPrint(LOG_ERROR, "Memory allocation failure!\n");
+			return RESULT_NO_MEMORY;
+		}
+		FileReadBlock(ptrInFile, Span, SpanStart, SpanEnd - SpanStart);
+	}
+
+	for (ulong i = 0; i < TextureCount; i++)
+	{
+		const sPVRImageHeader * ptrHeader = &Sources[i].Header;
+		ulong PixelCount = ptrHeader->Width * ptrHeader->Height;
+		if (PixelCount > PVR_SMALL_PIXELS)
+			continue;
+
+		// Data of scattered textures is read one by one
+		uchar * Data;
+		if (Span != NULL)
+		{
+			Data = Span + (Sources[i].DataOffset - SpanStart);
+		}
+		else
+		{
+			Data = (uchar *)SpanScratch.Reserve(Texture.PVRDataSize(ptrHeader));
+			if (Data == NULL)
+			{
+				LogPrint(LOG_ERROR, "Memory allocation failure!\n");
+				return RESULT_NO_MEMORY;
+			}
+			FileReadBlock(ptrInFile, Data, Sources[i].DataOffset, Texture.PVRDataSize(ptrHeader));
+		}
+
+		// Square twiddled textures are quantized in their own order like by fused decoder, so palettes come out the same
+		strcpy(Texture.Name, ModelTextureTable[i].Name);
+		bool Fused = Texture.IsFusedPVR(ptrHeader);
+		if (Fused == true)
+			memcpy(DirectImage, Data, PixelCount * 2);
+		else
+			Texture.DecodePVRData(Data, ptrHeader, DirectImage);
+
+		uchar * Bitmap = Results + Sources[i].BatchOffset;
+		uchar * Palette = Bitmap + PixelCount;
+		sQualityMetrics Quality;
+		Quality.Reset();
+		if (QuantizeSmallTexture(DirectImage, PixelCount, AllowShrink, ColorSlots, (Fused == true) ? Indices : Bitmap, Palette, &Quality) == 0)
+			continue;
+		Texture.Quality = Quality;
+
+		// Twiddled position keeps Y in even bits and X in odd bits
+		if (Fused == true)
+			for (ulong t = 0; t < PixelCount; t++)
+				Bitmap[Texture.CompactBits(t) * ptrHeader->Width + Texture.CompactBits(t >> 1)] = Indices[t];
+
+		Sources[i].Converted = true;
+		ConvertedCount++;
+
+		Quality.GetPSNR(PSNR, sizeof(PSNR));
+		LogPrint(LOG_DETAIL, "Texture #%i: %s, %ux%u, PSNR %s dB \n", i + 1, Texture.Name, ptrHeader->Width, ptrHeader->Height, PSNR);
+		ReportQuality(FileName, &Texture);
+	}
+	TraceSpan("small textures", TraceStart, FileName, 0, 0);
+
+	// Neighbouring small textures are neighbours in model too, so their results are written in runs
+	TraceStart = TraceClock();
+	for (ulong i = 0; i < TextureCount; )
+	{
+		if (Sources[i].Converted == false)
+		{
+			i++;
+			continue;
+		}
+
+		ulong RunStart = i;
+		ulong RunSize = 0;
+		while (i < TextureCount && Sources[i].Converted == true &&
+			Sources[i].BatchOffset == Sources[RunStart].BatchOffset + RunSize &&
+			ModelTextureTable[i].Offset == ModelTextureTable[RunStart].Offset + RunSize)
+		{
+			RunSize += Sources[i].Header.Width * Sources[i].Header.Height + _8BIT_PLTE_SZ * MDL_PLTE_ENTRY_SZ;
+			i++;
+		}
+
+		FileWriteBlock(ptrOutFile, Results + Sources[RunStart].BatchOffset, ModelTextureTable[RunStart].Offset, RunSize);
+	}
+	TraceSpan("write", TraceStart, FileName, 0, 0);
+
+	if (ConvertedCount < SmallCount)
+		LogPrint(LOG_DETAIL, "%lu small textures need other quantizer.\n", SmallCount - ConvertedCount);
 
-	puts("\nDone!\n\n\n");
+	return RESULT_OK;
 }
 
-void ExtractMDLTextures(const char * FileName)	// Extract textures from PC model
+int ExtractMDLTextures(const char * FileName)	// Extract textures from PC model
 {
 	sModelHeader ModelHeader;					// Model file header
 	sModelTextureEntry * ModelTextureTable;		// Model texture table
@@ -233,13 +546,14 @@ void ExtractMDLTextures(const char * FileName)	// Extract textures from PC model
 	sTexture * Textures;						// Pointer to textures data
 
 	FILE * ptrInFile;
-	sBMPHeader BMPHeader;						// BMP header
-	FILE * ptrBMPOutput;
-	char cOutFileName[255];
-	char cOutFolderName[255];
+	char cOutFileName[MAX_PATH];
+	char cOutFolderName[MAX_PATH];
+	sWadFile ModelWad;							// WAD of this model (--wad)
+	sWadFile * ptrWad = NULL;					// WAD that gets textures (NULL - separate images)
 
 	// Open file
-	SafeFileOpen(&ptrInFile, FileName, "rb");
+	if (SafeFileOpen(&ptrInFile, FileName, "rb") == false)
+		return RESULT_IO_ERROR;
 
 	// Load model header
 	ModelHeader.UpdateFromFile(&ptrInFile);
@@ -247,33 +561,69 @@ void ExtractMDLTextures(const char * FileName)	// Extract textures from PC model
 	// Check model
 	if (ModelHeader.CheckModel() == NORMAL_MODEL)
 	{
-		printf("Internal name: %s \nTextures: %i, Texture table offset: 0x%X \n", ModelHeader.Name, ModelHeader.TextureCount, ModelHeader.TextureTableOffset);
+		LogPrint(LOG_DETAIL, "Internal name: %s \nTextures: %i, Texture table offset: 0x%X \n", ModelHeader.Name, ModelHeader.TextureCount, ModelHeader.TextureTableOffset);
 	}
 	else
 	{
-		puts("Can't extract textures.");
-		return;
+		LogPrint(LOG_ERROR, "Can't extract textures.\n");
+		fclose(ptrInFile);
+		return RESULT_BAD_MODEL;
 	}
 
 	// Allocate memory for textutes
 	ModelTextureTable = (sModelTextureEntry *)malloc(ModelHeader.TextureCount * sizeof(sModelTextureEntry));
 	Textures = (sTexture *)malloc(sizeof(sTexture) * ModelHeader.TextureCount);
+	if (ModelTextureTable == NULL || Textures == NULL)
+	{
+		LogPrint(LOG_ERROR, "Unable to allocate memory ...\n");
+		free(ModelTextureTable);
+		free(Textures);
+		fclose(ptrInFile);
+		return RESULT_NO_MEMORY;
+	}
 
-	// Prepare folder for output files
-	strcpy(cOutFolderName, FileName);
-	strcat(cOutFolderName, "-textures\\");
-	NewDir(cOutFolderName);
+	// Prepare folder for output files (next to model or in output tree)
+	if (ProgOptions.OutFolder[0] == '\0')
+		strcpy(cOutFolderName, FileName);
+	else
+		FileMirrorName(ProgOptions.OutFolder, FileName, cOutFolderName, sizeof(cOutFolderName) - 10);
+	if (BatchWad.ptrFile != NULL)
+	{
+		// Textures of whole batch go to one WAD
+		ptrWad = &BatchWad;
+	}
+	else if (ProgOptions.Wad == true)
+	{
+		// One WAD next to model
+		strcpy(cOutFileName, cOutFolderName);
+		strcat(cOutFileName, "-textures.wad");
+		GenerateFolders(cOutFileName);
+		if (WadOpen(&ModelWad, cOutFileName) == false)
+		{
+			free(ModelTextureTable);
+			free(Textures);
+			fclose(ptrInFile);
+			return RESULT_IO_ERROR;
+		}
+		ptrWad = &ModelWad;
+	}
+	else
+	{
+		strcat(cOutFolderName, "-textures\\");
+		GenerateFolders(cOutFolderName);
+	}
 
 	uint BitmapOffset;
 	uint BitmapSize;
 	uint PaletteOffset;
 	uint PaletteSize;
 	bool PVRExtract = false;
+	int Result = RESULT_OK;
+	int Selected = 0;
 	char TexExtension[5];
 	for (int i = 0; i < ModelHeader.TextureCount; i++)
 	{
 		ModelTextureTable[i].UpdateFromFile(&ptrInFile, ModelHeader.TextureTableOffset, i);
-		printf("\n\nTexture #%i \n Name: %s \n Width: %i \n Height: %i \n Offset: %x \n", i + 1, ModelTextureTable[i].Name, ModelTextureTable[i].Width, ModelTextureTable[i].Height, ModelTextureTable[i].Offset);
 
 		// PVR check
 		if (PVRExtract == false)
@@ -282,10 +632,23 @@ void ExtractMDLTextures(const char * FileName)	// Extract textures from PC model
 			if (!strcmp(TexExtension, ".pvr") == true)
 			{
 				PVRExtract = true;
-				puts("Found PVR textures ...");
+				LogPrint(LOG_DETAIL, "Found PVR textures ...\n");
 			}
 		}
 
+		// Textures that weren't asked for are not decoded
+		if (ProgOptions.TextureSelected(ModelTextureTable[i].Name, i + 1) == false)
+			continue;
+		Selected++;
+
+		LogPrint(LOG_DETAIL, "\n\nTexture #%i \n Name: %s \n Width: %i \n Height: %i \n Offset: %x \n", i + 1, ModelTextureTable[i].Name, ModelTextureTable[i].Width, ModelTextureTable[i].Height, ModelTextureTable[i].Offset);
+
+		// Prepare output file name (without extension)
+		char Name[64];
+		FileGetName(ModelTextureTable[i].Name, Name, sizeof(Name), false);
+		strcpy(cOutFileName, cOutFolderName);
+		strcat(cOutFileName, Name);
+
 		// Extract texture
 		if (PVRExtract == false)
 		{
@@ -298,44 +661,81 @@ void ExtractMDLTextures(const char * FileName)	// Extract textures from PC model
 
 			// Load texture
 			Textures[i].Initialize();
-			Textures[i].UpdateFromFile(&ptrInFile, BitmapOffset, BitmapSize, PaletteOffset, PaletteSize, ModelTextureTable[i].Name, ModelTextureTable[i].Width, ModelTextureTable[i].Height);
+			if (Textures[i].UpdateFromFile(&ptrInFile, BitmapOffset, BitmapSize, PaletteOffset, PaletteSize, ModelTextureTable[i].Name, ModelTextureTable[i].Width, ModelTextureTable[i].Height) == false)
+			{
+				Result = RESULT_NO_MEMORY;
+				continue;
+			}
+		}
+		else if (ProgOptions.TrueColor == true)
+		{
+			// PVR texture, saved without conversion to 8-bit //
+			long long TraceStart = TraceClock();
+			int TextureResult = ExtractPVRTrueColor(&ptrInFile, ModelTextureTable[i].Offset, cOutFileName);
+			if (TextureResult == RESULT_BAD_TEXTURE)
+			{
+				LogPrint(LOG_ERROR, "Warning: can't recognise texture: %s.\n", ModelTextureTable[i].Name);
+				Result = RESULT_BAD_TEXTURE;
+			}
+			else if (TextureResult != RESULT_OK)
+			{
+				Result = TextureResult;
+			}
+			else if (ProgOptions.PakFile[0] != '\0' && PakAddFile(cOutFileName, cOutFileName) == false)
+			{
+				Result = RESULT_IO_ERROR;
+			}
+			TraceSpan("truecolor", TraceStart, ModelTextureTable[i].Name, ModelTextureTable[i].Width, ModelTextureTable[i].Height);
+			continue;
 		}
 		else
 		{
 			// PVR texture //
-			bool Result;
 
 			// Load texture
 			Textures[i].Initialize();
-			Result = Textures[i].UpdateFromPVR(&ptrInFile, ModelTextureTable[i].Offset, ModelTextureTable[i].Name);
-			if (Result == false)
+			int TextureResult = Textures[i].UpdateFromPVR(&ptrInFile, ModelTextureTable[i].Offset, ModelTextureTable[i].Name);
+			if (TextureResult != RESULT_OK)
 			{
-				printf("Warning: can't recognise texture: %s.\nPress any key to confirm ...", ModelTextureTable[i].Name);
-				getchar();
+				if (TextureResult == RESULT_BAD_TEXTURE)
+					LogPrint(LOG_ERROR, "Warning: can't recognise texture: %s.\n", ModelTextureTable[i].Name);
+				Textures[i].Free();
+				Result = TextureResult;
 				continue;
 			}
+			ReportQuality(FileName, &Textures[i]);
 		}
 
-		// Prepare texture to be saved in BMP format
-		Textures[i].FlipBitmap();
-		Textures[i].PaletteSwapRedAndGreen(MDL_PLTE_ENTRY_SZ);
-		Textures[i].PaletteAddSpacers(0x00);
+		if (ptrWad != NULL)
+		{
+			// Lump can't be written
+			if (WadAddTexture(ptrWad, &Textures[i]) == false)
+				Result = RESULT_IO_ERROR;
+		}
+		else if (SaveTexture(&Textures[i], cOutFileName) == false)
+			Result = RESULT_IO_ERROR;
+		else if (ProgOptions.PakFile[0] != '\0' && PakAddFile(cOutFileName, cOutFileName) == false)
+			Result = RESULT_IO_ERROR;
 
-		// Save texture to *.bmp file
-		char Name[64];
-		FileGetName(ModelTextureTable[i].Name, Name, sizeof(Name), false);
-		strcat(Name, ".bmp");
-		strcpy(cOutFileName, cOutFolderName);
-		strcat(cOutFileName, Name);
-		SafeFileOpen(&ptrBMPOutput, cOutFileName, "wb");
+		// Texture is no longer needed
+		Textures[i].Free();
+	}
 
-		BMPHeader.Update(Textures[i].Width, Textures[i].Height);
-		FileWriteBlock(&ptrBMPOutput, (char *)&BMPHeader, sizeof(sBMPHeader));
-		FileWriteBlock(&ptrBMPOutput, (char *)Textures[i].Palette, Textures[i].PaletteSize);
-		FileWriteBlock(&ptrBMPOutput, (char *)Textures[i].Bitmap, Textures[i].Width * Textures[i].Height);
+	// Finish WAD of this model
+	if (ptrWad == &ModelWad)
+	{
+		strcpy(cOutFileName, cOutFolderName);
+		strcat(cOutFileName, "-textures.wad");
+		if (WadClose(&ModelWad) == false)
+			Result = RESULT_IO_ERROR;
+		else if (ProgOptions.PakFile[0] != '\0' && PakAddFile(cOutFileName, cOutFileName) == false)
+			Result = RESULT_IO_ERROR;
+	}
 
-		// Close output file
-		fclose(ptrBMPOutput);
+	if (Selected == 0)
+	{
+		LogPrint(LOG_ERROR, "No textures match: %s\n", ProgOptions.TexturePattern);
+		Result = RESULT_WRONG_INPUT;
 	}
 
 	// Free memory
@@ -345,78 +745,867 @@ void ExtractMDLTextures(const char * FileName)	// Extract textures from PC model
 	// Close files
 	fclose(ptrInFile);
 
-	puts("\nDone!\n\n\n");
+	LogPrint(LOG_INFO, "\nDone!\n\n\n\n");
+
+	return Result;
 }
 
-int main(int argc, char * argv[])
+int ListMDLTextures(const char * FileName)	// Print texture table of PC model without decoding textures
 {
-	FILE * ptrInputFile;
+	sModelHeader ModelHeader;
+	sModelTextureEntry TextureEntry;
+	sPVRImageHeader PVRImageHeader;
+	sTexture Texture;
+	ulong PVRDataOffset;
+	char Extension[5];
+	const char * Kind;
+	int Selected = 0;
 
-	// Output info
-	printf("\nPVR2MDL v%s \n", PROG_VERSION);
+	FILE * ptrInFile;
 
-	// Check arguments
-	if (argc == 1)
+	if (SafeFileOpen(&ptrInFile, FileName, "rb") == false)
+		return RESULT_IO_ERROR;
+	ModelHeader.UpdateFromFile(&ptrInFile);
+	if (ModelHeader.CheckModel() != NORMAL_MODEL)
 	{
-		// No arguments - show help screen
-		puts("\nDeveloped by Alexey Leusin. \nCopyright (c) 2018, Alexey Leushin. All rights reserved.\n");
-		puts("How to use: \n1) Windows explorer - drag and drop model file on pvr2mdl.exe \n2) Command line/Batch - pvr2mdl [model_file_name] \nOptional feature: extract textures - pvr2mdl extract [model_file_name]  \n\nFor more info read ReadMe.txt \n");
-		puts("Press any key to exit ...");
+		LogPrint(LOG_ERROR, "Can't list textures.\n");
+		fclose(ptrInFile);
+		return RESULT_BAD_MODEL;
+	}
+
+	// One line per texture: number, name, size, offset and format (PVR size is taken from its header)
+	Texture.Initialize();
+	for (int i = 0; i < ModelHeader.TextureCount; i++)
+	{
+		TextureEntry.UpdateFromFile(&ptrInFile, ModelHeader.TextureTableOffset, i);
+		if (ProgOptions.TextureSelected(TextureEntry.Name, i + 1) == false)
+			continue;
+		Selected++;
+
+		Kind = "8-bit";
+		FileGetExtension(TextureEntry.Name, Extension, sizeof(Extension));
+		if (!strcmp(Extension, ".pvr"))
+		{
+			if (Texture.LoadPVRHeader(&ptrInFile, TextureEntry.Offset, &PVRImageHeader, &PVRDataOffset) == false)
+			{
+				Kind = "PVR (broken)";
+			}
+			else
+			{
+				TextureEntry.Width = PVRImageHeader.Width;
+				TextureEntry.Height = PVRImageHeader.Height;
+				Kind = (PVRImageHeader.ImageFormat == PVR_TWIDDLE) ? "PVR twiddled" : (PVRImageHeader.ImageFormat == PVR_VQ) ? "PVR VQ" : "PVR rectangle";
+			}
+		}
+
+		LogPrint(LOG_RESULT, "%i\t%s\t%ix%i\t0x%X\t%s\t%s\n", i + 1, TextureEntry.Name, TextureEntry.Width, TextureEntry.Height, TextureEntry.Offset, Kind, FileName);
+	}
+
+	fclose(ptrInFile);
+
+	if (Selected == 0)
+	{
+		LogPrint(LOG_ERROR, "No textures match: %s\n", ProgOptions.TexturePattern);
+		return RESULT_WRONG_INPUT;
+	}
+
+	return RESULT_OK;
+}
+
+bool SaveTexture(sTexture * ptrTexture, char * OutFileName)	// Save 8-bit texture in selected format (extension is added to OutFileName)
+{
+	long long TraceStart = TraceClock();
+	bool Result = true;
+
+	if (ProgOptions.TextureFormat == TEXTURE_PNG)
+	{
+		// Save texture to *.png file (PNG keeps lines and palette in the same order as MDL)
+		strcat(OutFileName, ".png");
+		Result = SavePNG(OutFileName, ptrTexture->Bitmap, ptrTexture->Palette, ptrTexture->Width, ptrTexture->Height);
+	}
+	else if (ProgOptions.TextureFormat == TEXTURE_TGA)
+	{
+		// Save texture to *.tga file (TGA needs BGR palette)
+		ptrTexture->PaletteSwapRedAndGreen(MDL_PLTE_ENTRY_SZ);
+		strcat(OutFileName, ".tga");
+		Result = SaveTGA(OutFileName, ptrTexture->Bitmap, ptrTexture->Palette, ptrTexture->Width, ptrTexture->Height);
+	}
+	else
+	{
+		FILE * ptrBMPOutput;
+		sBMPHeader BMPHeader;
+
+		// Prepare texture to be saved in BMP format
+		if (ptrTexture->FlipBitmap() == false)
+			return false;
+		ptrTexture->PaletteSwapRedAndGreen(MDL_PLTE_ENTRY_SZ);
+		if (ptrTexture->PaletteAddSpacers(0x00) == false)
+			return false;
+		TraceSpan("flip", TraceStart, ptrTexture->Name, ptrTexture->Width, ptrTexture->Height);
+		TraceStart = TraceClock();
+
+		// Save texture to *.bmp file
+		strcat(OutFileName, ".bmp");
+		if (SafeFileOpen(&ptrBMPOutput, OutFileName, "wb") == false)
+			return false;
+
+		BMPHeader.Update(ptrTexture->Width, ptrTexture->Height);
+		FileWriteBlock(&ptrBMPOutput, (char *)&BMPHeader, sizeof(sBMPHeader));
+		FileWriteBlock(&ptrBMPOutput, (char *)ptrTexture->Palette, ptrTexture->PaletteSize);
+		FileWriteBlock(&ptrBMPOutput, (char *)ptrTexture->Bitmap, ptrTexture->Width * ptrTexture->Height);
+
+		// Close output file
+		Result = SafeFileClose(&ptrBMPOutput, OutFileName);
+	}
+	TraceSpan("write", TraceStart, ptrTexture->Name, ptrTexture->Width, ptrTexture->Height);
+
+	return Result;
+}
+
+int TranscodePVR(const char * FileName)	// Convert loose PVR texture to image file
+{
+	FILE * ptrInFile;
+	sTexture Texture;
+	char cOutFileName[MAX_PATH];
+	char cMirrorName[MAX_PATH];
+	char Name[MAX_PATH];
+	int Result = RESULT_OK;
+
+	if (SafeFileOpen(&ptrInFile, FileName, "rb") == false)
+		return RESULT_IO_ERROR;
+
+	// Image goes next to texture (or to output tree) and gets extension of selected format
+	if (ProgOptions.OutFolder[0] == '\0')
+	{
+		FileGetFullName(FileName, cOutFileName, sizeof(cOutFileName));
+	}
+	else
+	{
+		FileMirrorName(ProgOptions.OutFolder, FileName, cMirrorName, sizeof(cMirrorName));
+		FileGetFullName(cMirrorName, cOutFileName, sizeof(cOutFileName));
+	}
+	cOutFileName[sizeof(cOutFileName) - 5] = '\0';
+	GenerateFolders(cOutFileName);
+
+	// Texture name is limited by sTexture
+	FileGetName(FileName, Name, sizeof(Name), true);
+	Name[sizeof(Texture.Name) - 1] = '\0';
+
+	if (ProgOptions.TrueColor == true)
+	{
+		Result = ExtractPVRTrueColor(&ptrInFile, 0, cOutFileName);
+	}
+	else
+	{
+		Texture.Initialize();
+		Result = Texture.UpdateFromPVR(&ptrInFile, 0, Name);
+		if (Result == RESULT_OK)
+		{
+			ReportQuality(FileName, &Texture);
+			if (SaveTexture(&Texture, cOutFileName) == false)
+				Result = RESULT_IO_ERROR;
+		}
+		Texture.Free();
+	}
+
+	fclose(ptrInFile);
+
+	if (Result == RESULT_OK && ProgOptions.PakFile[0] != '\0' && PakAddFile(cOutFileName, cOutFileName) == false)
+		Result = RESULT_IO_ERROR;
+
+	if (Result != RESULT_OK)
+		LogPrint(LOG_ERROR, "Warning: can't convert texture: %s.\n", FileName);
+	else
+		LogPrint(LOG_INFO, "\nDone!\n\n\n\n");
+
+	return Result;
+}
+
+int ExtractPVRTrueColor(FILE ** ptrInFile, ulong Offset, char * OutFileName)	// Save PVR texture in 32-bit format (returns result of job)
+{
+	static thread_local sScratchBuffer ColorScratch = { NULL, 0 };
+	sTexture Texture;
+	sPVRImageHeader PVRImageHeader;
+	ushort * DirectImage;
+	uchar * Image;
+	ulong Width;
+	ulong Height;
+
+	// Decode PVR
+	Texture.Initialize();
+	FileGetName(OutFileName, Texture.Name, sizeof(Texture.Name), true);
+	DirectImage = Texture.LoadPVRImage(ptrInFile, Offset, &PVRImageHeader);
+	if (DirectImage == NULL)
+		return RESULT_BAD_TEXTURE;
+	Width = PVRImageHeader.Width;
+	Height = PVRImageHeader.Height;
+
+	Image = (uchar *)ColorScratch.Reserve(Width * Height * 4);
+	if (Image == NULL)
+	{
+		LogPrint(LOG_ERROR, "Memory allocation failure!\n");
+		return RESULT_NO_MEMORY;
+	}
+
+	LogPrint(LOG_DETAIL, "Converting to 32-bit format ...\n");
+
+	if (ProgOptions.TextureFormat == TEXTURE_PNG)
+	{
+		// Save texture to *.png file (RGBA)
+		ExpandRGB565(DirectImage, Image, Width * Height, true);
+		strcat(OutFileName, ".png");
+		return (SavePNG(OutFileName, Image, NULL, Width, Height) == true) ? RESULT_OK : RESULT_IO_ERROR;
+	}
+
+	ExpandRGB565(DirectImage, Image, Width * Height, false);
+
+	if (ProgOptions.TextureFormat == TEXTURE_TGA)
+	{
+		// Save texture to *.tga file (BGRA)
+		strcat(OutFileName, ".tga");
+		return (SaveTGA(OutFileName, Image, NULL, Width, Height) == true) ? RESULT_OK : RESULT_IO_ERROR;
+	}
+
+	// Save texture to *.bmp file (BGRX, lines are stored from bottom to top)
+	FILE * ptrBMPOutput;
+	sBMPHeader BMPHeader;
+
+	strcat(OutFileName, ".bmp");
+	if (SafeFileOpen(&ptrBMPOutput, OutFileName, "wb") == false)
+		return RESULT_IO_ERROR;
+
+	BMPHeader.UpdateTrueColor(Width, Height);
+	FileWriteBlock(&ptrBMPOutput, (char *)&BMPHeader, sizeof(sBMPHeader));
+	for (ulong Y = Height; Y > 0; Y--)
+		FileWriteBlock(&ptrBMPOutput, &Image[(Y - 1) * Width * 4], Width * 4);
+
+	return (SafeFileClose(&ptrBMPOutput, OutFileName) == true) ? RESULT_OK : RESULT_IO_ERROR;
+}
 
-		_getch();
+int MakeModelThumbs(const char * FileName)	// Save previews of all model textures on one contact sheet
+{
+	static thread_local sScratchBuffer ColorScratch = { NULL, 0 };	// Texture in 32-bit format
+	static thread_local sScratchBuffer ThumbScratch = { NULL, 0 };	// Downscaled texture
+	sModelHeader ModelHeader;
+	sModelTextureEntry TextureEntry;
+	sPVRImageHeader PVRImageHeader;
+	sTexture Texture;
+	FILE * ptrInFile;
+	char cOutFileName[MAX_PATH];
+	char TexExtension[5];
+	ulong CellSize = ProgOptions.ThumbSize;
+	ulong Columns;
+	ulong Rows;
+	ulong SheetWidth;
+	uchar * Sheet;
+	int Result = RESULT_OK;
+
+	if (SafeFileOpen(&ptrInFile, FileName, "rb") == false)
+		return RESULT_IO_ERROR;
+	ModelHeader.UpdateFromFile(&ptrInFile);
+	if (ModelHeader.CheckModel() != NORMAL_MODEL)
+	{
+		LogPrint(LOG_ERROR, "Can't make previews.\n");
+		fclose(ptrInFile);
+		return RESULT_BAD_MODEL;
 	}
-	else if (argc == 2)		// Convert model
+
+	// Square grid of cells, one cell per texture (transparent background)
+	Columns = (ulong)ceil(sqrt((double)ModelHeader.TextureCount));
+	Rows = (ModelHeader.TextureCount + Columns - 1) / Columns;
+	SheetWidth = Columns * CellSize;
+	Sheet = (uchar *)calloc(SheetWidth * Rows * CellSize, 4);
+	if (Sheet == NULL)
 	{
-		char cFileExtension[5];
+		LogPrint(LOG_ERROR, "Unable to allocate memory ...\n");
+		fclose(ptrInFile);
+		return RESULT_NO_MEMORY;
+	}
 
-		FileGetExtension(argv[1], cFileExtension, 5);
+	Texture.Initialize();
+	for (ulong i = 0; i < ModelHeader.TextureCount; i++)
+	{
+		uchar * Image;
+		ulong Width;
+		ulong Height;
+
+		TextureEntry.UpdateFromFile(&ptrInFile, ModelHeader.TextureTableOffset, i);
+		TextureEntry.Name[sizeof(TextureEntry.Name) - 1] = '\0';
+		FileGetExtension(TextureEntry.Name, TexExtension, sizeof(TexExtension));
+
+		// Decode texture to 32-bit RGBA
+		if (!strcmp(TexExtension, ".pvr"))
+		{
+			ushort * DirectImage;
 
-		printf("\nProcessing file: %s\n", argv[1]);
+			FileGetName(TextureEntry.Name, Texture.Name, sizeof(Texture.Name), true);
+			DirectImage = Texture.LoadPVRImage(&ptrInFile, TextureEntry.Offset, &PVRImageHeader);
+			if (DirectImage == NULL)
+			{
+				LogPrint(LOG_ERROR, "Warning: can't recognise texture: %s.\n", TextureEntry.Name);
+				Result = RESULT_BAD_TEXTURE;
+				continue;
+			}
+			Width = PVRImageHeader.Width;
+			Height = PVRImageHeader.Height;
 
-		if (!strcmp(".mdl", cFileExtension))
+			Image = (uchar *)ColorScratch.Reserve(Width * Height * 4);
+			if (Image == NULL)
+			{
+				LogPrint(LOG_ERROR, "Memory allocation failure!\n");
+				Result = RESULT_NO_MEMORY;
+				break;
+			}
+			ExpandRGB565(DirectImage, Image, Width * Height, true);
+		}
+		else
 		{
-			if (CheckModel(argv[1]) == NORMAL_MODEL)
+			Width = TextureEntry.Width;
+			Height = TextureEntry.Height;
+			Image = (uchar *)ColorScratch.Reserve(Width * Height * 4);
+			if (Image == NULL || Texture.UpdateFromFile(&ptrInFile, TextureEntry.Offset, Width * Height, TextureEntry.Offset + Width * Height, _8BIT_PLTE_SZ * MDL_PLTE_ENTRY_SZ, TextureEntry.Name, Width, Height) == false)
 			{
-				ConvertPVRToMDL(argv[1]);
+				LogPrint(LOG_ERROR, "Memory allocation failure!\n");
+				Texture.Free();
+				Result = RESULT_NO_MEMORY;
+				break;
 			}
-			else if (CheckModel(argv[1]) == SEQ_MODEL || CheckModel(argv[1]) == NOTEXTURES_MODEL || CheckModel(argv[1]) == DUMMY_MODEL)
+			for (ulong j = 0; j < Width * Height; j++)
 			{
-				puts("Can't find texture data ...");
+				memcpy(&Image[j * 4], &Texture.Palette[Texture.Bitmap[j] * MDL_PLTE_ENTRY_SZ], 3);
+				Image[j * 4 + 3] = 0xFF;
+			}
+			Texture.Free();
+		}
+
+		// Fit texture into cell keeping its proportions (small textures aren't enlarged)
+		ulong ThumbWidth = Width;
+		ulong ThumbHeight = Height;
+		if (ThumbWidth > CellSize || ThumbHeight > CellSize)
+		{
+			if (Width >= Height)
+			{
+				ThumbWidth = CellSize;
+				ThumbHeight = (Height * CellSize + Width / 2) / Width;
 			}
 			else
 			{
-				puts("Can't recognise model file ...");
+				ThumbHeight = CellSize;
+				ThumbWidth = (Width * CellSize + Height / 2) / Height;
+			}
+			if (ThumbWidth == 0) ThumbWidth = 1;
+			if (ThumbHeight == 0) ThumbHeight = 1;
+		}
+		LogPrint(LOG_DETAIL, "Texture #%lu: %s, %lux%lu -> %lux%lu\n", i + 1, TextureEntry.Name, Width, Height, ThumbWidth, ThumbHeight);
+
+		uchar * Thumb = (uchar *)ThumbScratch.Reserve(ThumbWidth * ThumbHeight * 4);
+		if (Thumb == NULL)
+		{
+			LogPrint(LOG_ERROR, "Memory allocation failure!\n");
+			Result = RESULT_NO_MEMORY;
+			break;
+		}
+
+		long long TraceStart = TraceClock();
+		DownscaleRGBA(Image, Width, Height, Thumb, ThumbWidth, ThumbHeight);
+		TraceSpan("downscale", TraceStart, TextureEntry.Name, Width, Height);
+
+		// Put preview to the center of its cell
+		ulong CellX = (i % Columns) * CellSize + (CellSize - ThumbWidth) / 2;
+		ulong CellY = (i / Columns) * CellSize + (CellSize - ThumbHeight) / 2;
+		for (ulong Y = 0; Y < ThumbHeight; Y++)
+			memcpy(&Sheet[((CellY + Y) * SheetWidth + CellX) * 4], &Thumb[Y * ThumbWidth * 4], ThumbWidth * 4);
+	}
+	fclose(ptrInFile);
+
+	// Save contact sheet next to model (or in output tree)
+	if (ProgOptions.OutFolder[0] == '\0')
+		strcpy(cOutFileName, FileName);
+	else
+		FileMirrorName(ProgOptions.OutFolder, FileName, cOutFileName, sizeof(cOutFileName) - 12);
+	strcat(cOutFileName, "-thumbs.png");
+	GenerateFolders(cOutFileName);
+
+	if (SavePNG(cOutFileName, Sheet, NULL, SheetWidth, Rows * CellSize) == false)
+		Result = RESULT_IO_ERROR;
+	else if (ProgOptions.PakFile[0] != '\0' && PakAddFile(cOutFileName, cOutFileName) == false)
+		Result = RESULT_IO_ERROR;
+	free(Sheet);
+
+	LogPrint(LOG_INFO, "\nDone!\n\n\n\n");
+
+	return Result;
+}
+
+int ProcessFile(int Job, const char * FileName)	// Check model and run job on it
+{
+	long long TraceStart = TraceClock();
+	int Result;
+
+	// Messages of one model are printed together
+	LogBeginGroup();
+	Result = RunJob(Job, FileName);
+	LogEndGroup();
+	TraceSpan(GetJobName(Job), TraceStart, FileName, 0, 0);
+	ReportResult(Job, FileName, Result);
+
+	return Result;
+}
+
+const char * GetJobName(int Job)	// Get job name for reports and traces
+{
+	switch (Job)
+	{
+	case JOB_CONVERT:
+		return "convert";
+	case JOB_EXTRACT:
+		return "extract";
+	case JOB_SCAN:
+		return "scan";
+	case JOB_THUMBS:
+		return "thumbs";
+	case JOB_PVR:
+		return "pvr";
+	case JOB_VERIFY:
+		return "verify";
+	}
+
+	return "unknown";
+}
+
+const char * GetResultName(int Result)	// Get name of job result for reports and server replies
+{
+	switch (Result)
+	{
+	case RESULT_OK:
+		return "ok";
+	case RESULT_WRONG_INPUT:
+		return "wrong-input";
+	case RESULT_BAD_MODEL:
+		return "bad-model";
+	case RESULT_BAD_TEXTURE:
+		return "bad-texture";
+	case RESULT_IO_ERROR:
+		return "io-error";
+	case RESULT_NO_MEMORY:
+		return "no-memory";
+	}
+
+	return "unknown";
+}
+
+int RunJob(int Job, const char * FileName)	// Check model type and run job on it
+{
+	char cFileExtension[5];
+	int ModelType;
+
+	FileGetExtension(FileName, cFileExtension, 5);
+
+	LogPrint(LOG_INFO, "\nProcessing file: %s\n", FileName);
+
+	// File that is missing or can't be read fails only its own job
+	if (CheckFile((char *)FileName) == false)
+	{
+		LogPrint(LOG_ERROR, "Error: can't open file: %s\n", FileName);
+		return RESULT_IO_ERROR;
+	}
+
+	// Loose textures
+	if (Job == JOB_PVR)
+	{
+		if (strcmp(".pvr", cFileExtension))
+		{
+			LogPrint(LOG_ERROR, "Wrong file extension.\n");
+			return RESULT_WRONG_INPUT;
+		}
+
+		return TranscodePVR(FileName);
+	}
+
+	if (strcmp(".mdl", cFileExtension))
+	{
+		LogPrint(LOG_ERROR, "Wrong file extension.\n");
+		return RESULT_WRONG_INPUT;
+	}
+
+	// Verification reads the whole file itself, so broken models get exact reason
+	if (Job == JOB_VERIFY)
+		return VerifyModel(FileName);
+
+	ModelType = CheckModel(FileName);
+
+	if (Job == JOB_CONVERT)
+	{
+		if (ModelType == NORMAL_MODEL)
+		{
+			// Check before backup is made, so backup of original model is never overwritten by converted one
+			if (CheckPVRModel(FileName) == false)
+			{
+				LogPrint(LOG_INFO, "Normal model, ignoring ...\n");
+				return RESULT_OK;
+			}
+
+			return ConvertPVRToMDL(FileName);
+		}
+		else if (ModelType == SEQ_MODEL || ModelType == NOTEXTURES_MODEL || ModelType == DUMMY_MODEL)
+		{
+			LogPrint(LOG_ERROR, "Can't find texture data ...\n");
+		}
+		else
+		{
+			LogPrint(LOG_ERROR, "Can't recognise model file ...\n");
+		}
+	}
+	else if (Job == JOB_EXTRACT)
+	{
+		if (ModelType == NORMAL_MODEL && ProgOptions.ListTextures == true)
+			return ListMDLTextures(FileName);
+		else if (ModelType == NORMAL_MODEL)
+			return ExtractMDLTextures(FileName);
+		else
+			LogPrint(LOG_ERROR, "Can't find texture data ...\n");
+	}
+	else if (Job == JOB_THUMBS)
+	{
+		if (ModelType == NORMAL_MODEL)
+			return MakeModelThumbs(FileName);
+		else
+			LogPrint(LOG_ERROR, "Can't find texture data ...\n");
+	}
+
+	return RESULT_BAD_MODEL;
+}
+
+bool ParseOption(const char * Option)	// Apply "--option" command line argument
+{
+	if (!strcmp(Option, "--dither"))
+		ProgOptions.Dither = true;
+	else if (!strcmp(Option, "--truecolor"))
+		ProgOptions.TrueColor = true;
+	else if (!strcmp(Option, "--headless"))
+		ProgOptions.Headless = true;
+	else if (!strcmp(Option, "--format=bmp"))
+		ProgOptions.TextureFormat = TEXTURE_BMP;
+	else if (!strcmp(Option, "--format=png"))
+		ProgOptions.TextureFormat = TEXTURE_PNG;
+	else if (!strcmp(Option, "--format=tga"))
+		ProgOptions.TextureFormat = TEXTURE_TGA;
+	else if (!strncmp(Option, "--threads=", 10))
+		return sscanf(Option + 10, "%u", &ProgOptions.Threads) == 1 && ProgOptions.Threads > 0;
+	else if (!strncmp(Option, "--max-memory=", 13))
+		return sscanf(Option + 13, "%lu", &ProgOptions.MaxMemory) == 1;
+	else if (!strncmp(Option, "--trace=", 8) && Option[8] != '\0')
+	{
+		strncpy(ProgOptions.TraceFile, Option + 8, sizeof(ProgOptions.TraceFile) - 1);
+		ProgOptions.TraceFile[sizeof(ProgOptions.TraceFile) - 1] = '\0';
+	}
+	else if (!strncmp(Option, "--report=", 9) && Option[9] != '\0')
+	{
+		strncpy(ProgOptions.ReportFile, Option + 9, sizeof(ProgOptions.ReportFile) - 1);
+		ProgOptions.ReportFile[sizeof(ProgOptions.ReportFile) - 1] = '\0';
+	}
+	else if (!strncmp(Option, "--time-budget=", 14))
+		return sscanf(Option + 14, "%lu", &ProgOptions.TimeBudget) == 1 && ProgOptions.TimeBudget > 0;
+	else if (!strncmp(Option, "--quality=", 10))
+		return sscanf(Option + 10, "%lf", &ProgOptions.QualityTarget) == 1 && ProgOptions.QualityTarget > 0.0;
+	else if (!strncmp(Option, "--thumb-size=", 13))
+		return sscanf(Option + 13, "%u", &ProgOptions.ThumbSize) == 1 && ProgOptions.ThumbSize > 0 && ProgOptions.ThumbSize <= 1024;
+	else if (!strncmp(Option, "--shard-index=", 14) && Option[14] != '\0')
+		ProgOptions.SetShardIndex(Option + 14);
+	else if (!strncmp(Option, "--shard=", 8))
+		return ProgOptions.SetShard(Option + 8);
+	else if (!strncmp(Option, "--out=", 6) && Option[6] != '\0')
+		ProgOptions.SetOutFolder(Option + 6);
+	else if (!strncmp(Option, "--bench-threads=", 16))
+		return ProgOptions.SetBenchThreads(Option + 16);
+	else if (!strncmp(Option, "--baseline=", 11) && Option[11] != '\0')
+	{
+		strncpy(ProgOptions.BaselineFile, Option + 11, sizeof(ProgOptions.BaselineFile) - 1);
+		ProgOptions.BaselineFile[sizeof(ProgOptions.BaselineFile) - 1] = '\0';
+	}
+	else if (!strncmp(Option, "--max-regression=", 17))
+		return sscanf(Option + 17, "%lf", &ProgOptions.MaxRegression) == 1 && ProgOptions.MaxRegression >= 0.0;
+	else if (!strncmp(Option, "--max-growth=", 13))
+		return sscanf(Option + 13, "%lf", &ProgOptions.MaxGrowth) == 1 && ProgOptions.MaxGrowth >= 0.0;
+	else if (!strcmp(Option, "--log=error"))
+		ProgOptions.SetLogLevel(LOG_ERROR);
+	else if (!strcmp(Option, "--log=info"))
+		ProgOptions.SetLogLevel(LOG_INFO);
+	else if (!strcmp(Option, "--log=detail"))
+		ProgOptions.SetLogLevel(LOG_DETAIL);
+	else if (!strcmp(Option, "--compare"))
+		ProgOptions.VerifyPixels = true;
+	else if (!strcmp(Option, "--list"))
+		ProgOptions.ListTextures = true;
+	else if (!strncmp(Option, "--texture=", 10) && Option[10] != '\0')
+		ProgOptions.SetTexturePattern(Option + 10);
+	else if (!strcmp(Option, "--wad"))
+		ProgOptions.Wad = true;
+	else if (!strncmp(Option, "--wad=", 6) && Option[6] != '\0')
+	{
+		strncpy(ProgOptions.WadFile, Option + 6, sizeof(ProgOptions.WadFile) - 1);
+		ProgOptions.WadFile[sizeof(ProgOptions.WadFile) - 1] = '\0';
+		ProgOptions.Wad = true;
+	}
+	else if (!strncmp(Option, "--pak=", 6) && Option[6] != '\0')
+	{
+		strncpy(ProgOptions.PakFile, Option + 6, sizeof(ProgOptions.PakFile) - 1);
+		ProgOptions.PakFile[sizeof(ProgOptions.PakFile) - 1] = '\0';
+	}
+	else
+		return false;
+
+	return true;
+}
+
+void PauseProgram()		// Wait for key press unless running unattended
+{
+	// Input that isn't console (pipe, NUL, build system) has nobody to press a key
+	if (ProgOptions.Headless == false && _isatty(_fileno(stdin)))
+		getchar();
+}
+
+int main(int argc, char * argv[])
+{
+	FILE * ptrInputFile;
+	uint Failed = 0;			// How many jobs failed
+
+	// Output info
+	printf("\nPVR2MDL v%s \n", PROG_VERSION);
+
+	// Apply options and remove them from argument list
+	ProgOptions.Initialize();
+	int ArgCount = 1;
+	for (int i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "--out") && i + 1 < argc)
+		{
+			// Output folder can also be given as separate argument
+			ProgOptions.SetOutFolder(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "--texture") && i + 1 < argc)
+		{
+			// Texture pattern can also be given as separate argument
+			ProgOptions.SetTexturePattern(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "--shard-index") && i + 1 < argc)
+		{
+			// Shard index can also be given as separate argument
+			ProgOptions.SetShardIndex(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "--shard") && i + 1 < argc)
+		{
+			// Shard can also be given as separate argument
+			if (ProgOptions.SetShard(argv[++i]) == false)
+			{
+				printf("Can't recognise shard: %s\n", argv[i]);
+				return EXIT_FAILURE;
+			}
+		}
+		else if (!strncmp(argv[i], "--", 2))
+		{
+			if (ParseOption(argv[i]) == false)
+			{
+				printf("Can't recognise option: %s\n", argv[i]);
+				return EXIT_FAILURE;
 			}
 		}
 		else
 		{
-			puts("Wrong file extension.");
+			argv[ArgCount++] = argv[i];
 		}
 	}
-	else if (argc == 3 && !strcmp(argv[1], "extract") == true)		// Extract textures from model
+	argc = ArgCount;
+
+	if (ProgOptions.TraceFile[0] != '\0')
+		TraceInitialize();
+
+	// Every shard leaves report, so results of all machines can be merged
+	if (ProgOptions.ShardCount > 1 && ProgOptions.ReportFile[0] == '\0')
+		snprintf(ProgOptions.ReportFile, sizeof(ProgOptions.ReportFile), "shard-%u-of-%u.txt", ProgOptions.ShardIndex + 1, ProgOptions.ShardCount);
+	if (ProgOptions.ReportFile[0] != '\0' && (argc < 2 || strcmp(argv[1], "merge")))
+		ReportOpen(ProgOptions.ReportFile);
+
+	// Results of batch commands can be packed into one PAK (they go through local staging folder)
+	if (ProgOptions.PakFile[0] != '\0')
 	{
-		char cFileExtension[5];
+		if (argc < 2 || !strcmp(argv[1], "serve") || !strcmp(argv[1], "watch") || !strcmp(argv[1], "merge") || !strcmp(argv[1], "verify") || !strcmp(argv[1], "bench"))
+		{
+			puts("Error: --pak works only with batch commands that write files.");
+			return EXIT_FAILURE;
+		}
 
-		FileGetExtension(argv[2], cFileExtension, 5);
+		// Names inside PAK are relative to common folder of input arguments
+		int InputFirst = (!strcmp(argv[1], "extract") || !strcmp(argv[1], "thumbs") || !strcmp(argv[1], "pvr")) ? 2 : 1;
+		if (PakOpen(ProgOptions.PakFile, &argv[InputFirst], argc - InputFirst) == false)
+			return EXIT_FAILURE;
+	}
 
-		printf("\nProcessing file: %s\n", argv[2]);
+	// Texture selection and listing belong to extract, other commands would silently convert whole models
+	if ((ProgOptions.ListTextures == true || ProgOptions.TexturePattern[0] != '\0') && (argc < 3 || strcmp(argv[1], "extract")))
+	{
+		puts("Error: --list and --texture work only with extract command.");
+		return EXIT_FAILURE;
+	}
 
-		if (!strcmp(".mdl", cFileExtension))
+	// Same for output options of extracted textures, convert would write 8-bit models without them
+	if (ProgOptions.Wad == true && (argc < 3 || strcmp(argv[1], "extract")))
+	{
+		puts("Error: --wad works only with extract command.");
+		return EXIT_FAILURE;
+	}
+	if (ProgOptions.TrueColor == true && (argc < 3 || (strcmp(argv[1], "extract") && strcmp(argv[1], "pvr"))))
+	{
+		puts("Error: --truecolor works only with extract and pvr commands.");
+		return EXIT_FAILURE;
+	}
+
+	// Listing only reads texture tables, there is nothing to write
+	if (ProgOptions.ListTextures == true && (ProgOptions.Wad == true || ProgOptions.PakFile[0] != '\0'))
+	{
+		puts("Error: --list can't be used with --wad or --pak.");
+		return EXIT_FAILURE;
+	}
+
+	// WAD keeps 8-bit textures only, whole batch can share one WAD
+	if (ProgOptions.Wad == true)
+	{
+		if (ProgOptions.TrueColor == true)
 		{
-			if (CheckModel(argv[2]) == NORMAL_MODEL)
-				ExtractMDLTextures(argv[2]);
+			puts("Error: --wad can't be used with --truecolor.");
+			return EXIT_FAILURE;
+		}
+
+		BatchWad.Initialize();
+		if (ProgOptions.WadFile[0] != '\0')
+		{
+			GenerateFolders(ProgOptions.WadFile);
+			if (WadOpen(&BatchWad, ProgOptions.WadFile) == false)
+				return EXIT_FAILURE;
+		}
+	}
+
+	// Check arguments
+	if (argc == 1)
+	{
+		// No arguments - show help screen
+		puts("\nDeveloped by Alexey Leusin. \nCopyright (c) 2018, Alexey Leushin. All rights reserved.\n");
+		puts("How to use: \n1) Windows explorer - drag and drop model file on pvr2mdl.exe \n2) Command line/Batch - pvr2mdl [model_file_name] \nOptional feature: extract textures - pvr2mdl extract [model_file_name]  \nOptional feature: convert loose PVR textures - pvr2mdl pvr [pvr_file_or_folder_name] \nOptional feature: texture previews - pvr2mdl thumbs [model_file_name] \nOptional feature: conversion server - pvr2mdl serve [pipe_name] \nOptional feature: watch folder - pvr2mdl watch [folder_name] \nOptional feature: merge shard reports - pvr2mdl merge [merged_report] [shard_reports] \nOptional feature: check converted models - pvr2mdl verify [model_file_or_folder_name] \nOptional feature: benchmark - pvr2mdl bench [model_file_or_folder_name] \nOptions: --dither, --threads=N, --max-memory=MB, --out DIR, --trace=FILE, --shard i/N, --shard-index FILE, --report=FILE, --pak=FILE, --wad[=FILE], --texture NAME|N, --list, --compare, --log=error|info|detail, --thumb-size=N, --headless, --format=bmp|png|tga, --truecolor, --quality=DB, --time-budget=MS, --bench-threads=N,N, --baseline=FILE, --max-regression=PCT, --max-growth=PCT \n\nFor more info read ReadMe.txt \n");
+		puts("Press any key to exit ...");
+
+		if (ProgOptions.Headless == false && _isatty(_fileno(stdin)))
+			_getch();
+	}
+	else if ((argc == 2 || argc == 3) && !strcmp(argv[1], "serve") == true)		// Run conversion server
+	{
+		ServeModels(argc == 3 ? argv[2] : SERVE_PIPE_NAME);
+	}
+	else if (argc == 3 && !strcmp(argv[1], "watch") == true)		// Convert models that appear in folder
+	{
+		WatchFolder(argv[2]);
+	}
+	else if (argc >= 4 && !strcmp(argv[1], "merge") == true)		// Combine reports of shards
+	{
+		if (MergeReports(argv[2], &argv[3], argc - 3) == false)
+			return EXIT_FAILURE;
+	}
+	else if (argc >= 3 && !strcmp(argv[1], "extract") == true)		// Extract textures from models
+	{
+		Failed = ProcessFiles(JOB_EXTRACT, &argv[2], argc - 2);
+	}
+	else if (argc >= 3 && !strcmp(argv[1], "thumbs") == true)		// Make texture previews
+	{
+		Failed = ProcessFiles(JOB_THUMBS, &argv[2], argc - 2);
+	}
+	else if (argc >= 3 && !strcmp(argv[1], "pvr") == true)		// Convert loose PVR textures
+	{
+		char ** FileNames = NULL;
+		int FileCount = 0;
+		int Capacity = 0;
+
+		// Folders are searched for *.pvr files
+		for (int i = 2; i < argc; i++)
+		{
+			if (CheckDir(argv[i]) == true)
+				FileListFolder(argv[i], ".pvr", &FileNames, &FileCount, &Capacity);
 			else
-				puts("Can't find texture data ...");
+				FileListAdd(&FileNames, &FileCount, &Capacity, argv[i]);
 		}
+
+		if (FileCount > 0)
+			Failed = ProcessFiles(JOB_PVR, FileNames, FileCount);
 		else
+			puts("Can't find PVR textures.");
+
+		FileListFree(FileNames, FileCount);
+	}
+	else if (argc >= 3 && !strcmp(argv[1], "verify") == true)		// Check converted models
+	{
+		char ** FileNames = NULL;
+		int FileCount = 0;
+		int Capacity = 0;
+
+		// Folders are searched for models, backups are sources and are not checked
+		for (int i = 2; i < argc; i++)
 		{
-			puts("Wrong file extension.");
+			if (CheckDir(argv[i]) == true)
+				FileListFolder(argv[i], ".mdl", &FileNames, &FileCount, &Capacity);
+			else
+				FileListAdd(&FileNames, &FileCount, &Capacity, argv[i]);
+		}
+		int Kept = 0;
+		for (int i = 0; i < FileCount; i++)
+		{
+			ulong Length = strlen(FileNames[i]);
+			if (Length >= 11 && _stricmp(&FileNames[i][Length - 11], "-backup.mdl") == 0)
+				free(FileNames[i]);
+			else
+				FileNames[Kept++] = FileNames[i];
 		}
+		FileCount = Kept;
+
+		if (FileCount > 0)
+			Failed = ProcessFiles(JOB_VERIFY, FileNames, FileCount);
+		else
+			puts("Can't find models.");
+
+		FileListFree(FileNames, FileCount);
+	}
+	else if (argc >= 2 && !strcmp(argv[1], "bench") == true)		// Measure batch jobs over corpus
+	{
+		Failed = RunBenchmark(&argv[2], argc - 2);
+	}
+	else if (argc >= 2)		// Convert models
+	{
+		Failed = ProcessFiles(JOB_CONVERT, &argv[1], argc - 1);
 	}
 	else
 	{
 		puts("Can't recognise arguments.");
 	}
 
+	if (ProgOptions.TraceFile[0] != '\0')
+		TraceSave(ProgOptions.TraceFile);
+
+	ReportClose();
+
+	if (WadClose(&BatchWad) == false)
+		return EXIT_FAILURE;
+
+	if (PakClose() == false)
+		return EXIT_FAILURE;
+
+	// Jobs never wait for key presses, so whoever dropped model on program sees why it failed only here
+	if (Failed > 0)
+	{
+		if (ProgOptions.Headless == false)
+		{
+			puts("Press any key to exit ...");
+			PauseProgram();
+		}
+
+		return EXIT_FAILURE;
+	}
+
 	//getchar();
 }
@@ -0,0 +1,364 @@
+/*
+=====================================================================
+Copyright (c) 2018, Alexey Leushin
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or
+without modification, are permitted provided that the following
+conditions are met:
+- Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+- Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+- Neither the name of the copyright holders nor the names of its
+contributors may be used to endorse or promote products derived
+from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+=====================================================================
+*/
+
+//
+// This file contains PAK output: results of all jobs are packed into one Half-Life *.pak file
+//
+
+////////// Includes //////////
+#include "main.h"
+
+////////// Definitions //////////
+#define PAK_NAME_SZ 56					// Longest file name inside PAK (with terminating zero)
+#define PAK_COPY_BUFF_SZ 0x10000		// Block that is moved from staged file to PAK at once
+#define PAK_MIN_HASH_SZ 512				// Smallest table of names (always power of 2)
+
+////////// Structures //////////
+
+// PAK header
+#pragma pack(1)
+struct sPakHeader
+{
+	char Signature[4];			// "PACK"
+	ulong DirectoryOffset;		// Location of directory (it's written at the end)
+	ulong DirectorySize;		// Size of directory (64 bytes per file)
+};
+#pragma pack()
+
+// PAK directory entry
+#pragma pack(1)
+struct sPakEntry
+{
+	char Name[PAK_NAME_SZ];		// File name inside PAK (forward slashes)
+	ulong Offset;				// Location of file data
+	ulong Size;					// Size of file data
+};
+#pragma pack()
+
+////////// Global variables //////////
+FILE * ptrPakFile = NULL;						// PAK that is being written (NULL - no PAK output)
+CRITICAL_SECTION PakLock;						// Workers append files one at a time
+sPakEntry * PakEntries = NULL;					// Directory that is written when PAK is closed
+ulong PakEntryCount = 0;
+ulong PakEntryCapacity = 0;
+ulong * PakNameHash = NULL;						// Open addressing table of entry numbers + 1 (0 - free slot), so names are checked without directory scan
+ulong PakNameHashSize = 0;
+ulong PakOffset = 0;							// Where next file goes
+char PakStagingFolder[MAX_PATH];				// Local folder where results are written before they are packed
+char PakNameRoot[MAX_PATH];						// Staged path of common input folder, names inside PAK are relative to it
+
+////////// Functions //////////
+bool PakFindEntry(const char * Name);																		// Check if file with this name is already packed
+bool PakGrowNames();																						// Make room for one more name (table is rebuilt twice as large when it gets half full)
+void PakAddName(ulong EntryIndex);																			// Put packed entry into table of names
+void PakSetNameRoot(char ** InputNames, int InputCount);													// Find common folder of inputs, so PAK names don't carry their absolute path
+void PakRemoveStaging(const char * FolderName);																// Remove staging folder and its subfolders
+
+bool PakOpen(const char * FileName, char ** InputNames, int InputCount)		// Start PAK output, results of jobs are redirected to staging folder
+{
+	sPakHeader PakHeader;
+	char TempPath[MAX_PATH];
+
+	fopen_s(&ptrPakFile, FileName, "wb");
+	if (ptrPakFile == NULL)
+	{
+		LogPrint(LOG_ERROR, "Error: can't create PAK: %s\n", FileName);
+		return false;
+	}
+
+	// Directory location is not known yet, header is rewritten at the end
+	memcpy(PakHeader.Signature, "PACK", 4);
+	PakHeader.DirectoryOffset = 0;
+	PakHeader.DirectorySize = 0;
+	FileWriteBlock(&ptrPakFile, &PakHeader, sizeof(PakHeader));
+	PakOffset = sizeof(PakHeader);
+
+	InitializeCriticalSection(&PakLock);
+
+	// Jobs write their results to local temporary folder just like with --out, every finished
+	// file is moved to PAK right away, so output store sees only one file
+	GetTempPathA(sizeof(TempPath), TempPath);
+	snprintf(PakStagingFolder, sizeof(PakStagingFolder), "%spvr2mdl-%lu", TempPath, (ulong)GetCurrentProcessId());
+	ProgOptions.SetOutFolder(PakStagingFolder);
+	PakSetNameRoot(InputNames, InputCount);
+
+	return true;
+}
+
+bool PakAddFile(const char * FileName, const char * OutFileName)		// Move staged result into PAK (OutFileName is its name in output tree)
+{
+	FILE * ptrInFile;
+	sPakEntry Entry;
+	char Buffer[PAK_COPY_BUFF_SZ];
+	ulong Size;
+	bool Result = true;
+
+	// Name inside PAK is relative to common input folder (or at least to staging folder) and uses forward slashes
+	const char * Name = OutFileName;
+	ulong RootLength = strlen(PakNameRoot);
+	if (RootLength > 0 && !_strnicmp(Name, PakNameRoot, RootLength) && (Name[RootLength] == '\\' || Name[RootLength] == '/'))
+		Name += RootLength;
+	else if (!strncmp(Name, PakStagingFolder, RootLength = strlen(PakStagingFolder)))
+		Name += RootLength;
+	while (*Name == '\\' || *Name == '/')
+		Name++;
+
+	if (strlen(Name) >= sizeof(Entry.Name))
+	{
+		LogPrint(LOG_ERROR, "Error: name is too long for PAK: %s\n", Name);
+		remove(FileName);
+		return false;
+	}
+
+	memset(&Entry, 0x00, sizeof(Entry));
+	strcpy(Entry.Name, Name);
+	PatchSlashes(Entry.Name, strlen(Entry.Name), false);
+
+	if (fopen_s(&ptrInFile, FileName, "rb") != 0)
+	{
+		LogPrint(LOG_ERROR, "Error: can't open result: %s\n", FileName);
+		return false;
+	}
+	Size = FileSize(&ptrInFile);
+	fseek(ptrInFile, 0, SEEK_SET);
+
+	// Files are appended one after another by one writer at a time
+	EnterCriticalSection(&PakLock);
+	if (PakFindEntry(Entry.Name) == true)
+	{
+		LogPrint(LOG_ERROR, "Error: file is already in PAK: %s\n", Entry.Name);
+		Result = false;
+	}
+	else if (PakGrowNames() == false)
+	{
+		LogPrint(LOG_ERROR, "Unable to allocate memory ...\n");
+		Result = false;
+	}
+	else if (PakEntryCount == PakEntryCapacity)
+	{
+		ulong NewCapacity = (PakEntryCapacity == 0) ? 256 : PakEntryCapacity * 2;
+		sPakEntry * NewEntries = (sPakEntry *)realloc(PakEntries, NewCapacity * sizeof(sPakEntry));
+		if (NewEntries == NULL)
+		{
+			LogPrint(LOG_ERROR, "Unable to allocate memory ...\n");
+			Result = false;
+		}
+		else
+		{
+			PakEntries = NewEntries;
+			PakEntryCapacity = NewCapacity;
+		}
+	}
+
+	if (Result == true)
+	{
+		Entry.Offset = PakOffset;
+		Entry.Size = Size;
+
+		fseek(ptrPakFile, PakOffset, SEEK_SET);
+		for (ulong Done = 0; Done < Size && Result == true; )
+		{
+			ulong Block = (Size - Done > sizeof(Buffer)) ? sizeof(Buffer) : Size - Done;
+			if (fread(Buffer, 1, Block, ptrInFile) != Block || fwrite(Buffer, 1, Block, ptrPakFile) != Block)
+			{
+				LogPrint(LOG_ERROR, "Error: can't write PAK entry: %s\n", Entry.Name);
+				Result = false;
+			}
+			Done += Block;
+		}
+
+		// Broken entry is not listed, next file overwrites its data
+		if (Result == true)
+		{
+			PakEntries[PakEntryCount] = Entry;
+			PakAddName(PakEntryCount++);
+			PakOffset += Size;
+		}
+	}
+	LeaveCriticalSection(&PakLock);
+
+	fclose(ptrInFile);
+	remove(FileName);
+
+	return Result;
+}
+
+bool PakClose()		// Write directory and finish PAK
+{
+	sPakHeader PakHeader;
+	bool Result = true;
+
+	if (ptrPakFile == NULL)
+		return true;
+
+	// Directory goes after the last file
+	memcpy(PakHeader.Signature, "PACK", 4);
+	PakHeader.DirectoryOffset = PakOffset;
+	PakHeader.DirectorySize = PakEntryCount * sizeof(sPakEntry);
+	fseek(ptrPakFile, PakOffset, SEEK_SET);
+	if (PakEntryCount > 0 && fwrite(PakEntries, sizeof(sPakEntry), PakEntryCount, ptrPakFile) != PakEntryCount)
+		Result = false;
+	FileWriteBlock(&ptrPakFile, &PakHeader, 0, sizeof(PakHeader));
+	if (fclose(ptrPakFile) != 0)
+		Result = false;
+
+	if (Result == false)
+		LogPrint(LOG_ERROR, "Error: can't write PAK directory.\n");
+	else
+		LogPrint(LOG_RESULT, "PAK: %lu files, %lu bytes\n", PakEntryCount, PakOffset + PakHeader.DirectorySize);
+
+	PakRemoveStaging(PakStagingFolder);
+
+	free(PakEntries);
+	free(PakNameHash);
+	PakEntries = NULL;
+	PakNameHash = NULL;
+	PakEntryCount = 0;
+	PakEntryCapacity = 0;
+	PakNameHashSize = 0;
+	ptrPakFile = NULL;
+	DeleteCriticalSection(&PakLock);
+
+	return Result;
+}
+
+bool PakFindEntry(const char * Name)		// Check if file with this name is already packed
+{
+	if (PakNameHashSize == 0)
+		return false;
+
+	for (ulong Slot = HashFileName(Name) & (PakNameHashSize - 1); PakNameHash[Slot] != 0; Slot = (Slot + 1) & (PakNameHashSize - 1))
+		if (!_stricmp(PakEntries[PakNameHash[Slot] - 1].Name, Name))
+			return true;
+
+	return false;
+}
+
+bool PakGrowNames()		// Make room for one more name (table is rebuilt twice as large when it gets half full)
+{
+	if (PakEntryCount * 2 < PakNameHashSize)
+		return true;
+
+	ulong NewSize = (PakNameHashSize == 0) ? PAK_MIN_HASH_SZ : PakNameHashSize * 2;
+	ulong * NewHash = (ulong *)calloc(NewSize, sizeof(ulong));
+	if (NewHash == NULL)
+		return false;
+
+	free(PakNameHash);
+	PakNameHash = NewHash;
+	PakNameHashSize = NewSize;
+	for (ulong i = 0; i < PakEntryCount; i++)
+		PakAddName(i);
+
+	return true;
+}
+
+void PakAddName(ulong EntryIndex)		// Put packed entry into table of names
+{
+	ulong Slot = HashFileName(PakEntries[EntryIndex].Name) & (PakNameHashSize - 1);
+
+	while (PakNameHash[Slot] != 0)
+		Slot = (Slot + 1) & (PakNameHashSize - 1);
+	PakNameHash[Slot] = EntryIndex + 1;
+}
+
+void PakSetNameRoot(char ** InputNames, int InputCount)		// Find common folder of inputs, so PAK names don't carry their absolute path
+{
+	char cFolderName[MAX_PATH];
+
+	// Folder argument is root of its files, file argument is in root of its folder,
+	// staged names are compared (so drive letters and "." / ".." are already dropped)
+	for (int i = 0; i < InputCount; i++)
+	{
+		strncpy(cFolderName, InputNames[i], sizeof(cFolderName) - 1);
+		cFolderName[sizeof(cFolderName) - 1] = '\0';
+		if (CheckDir(InputNames[i]) == false)
+		{
+			ulong Length = strlen(cFolderName);
+			while (Length > 0 && cFolderName[Length - 1] != '\\' && cFolderName[Length - 1] != '/')
+				Length--;
+			cFolderName[Length] = '\0';
+		}
+
+		char cStagedName[MAX_PATH];
+		FileMirrorName(PakStagingFolder, cFolderName, cStagedName, sizeof(cStagedName));
+		if (i == 0)
+		{
+			strcpy(PakNameRoot, cStagedName);
+			continue;
+		}
+
+		// Keep only whole folders that both names share
+		ulong Length = 0;
+		ulong Common = strlen(PakStagingFolder);
+		while (PakNameRoot[Length] != '\0' && tolower(PakNameRoot[Length]) == tolower(cStagedName[Length]))
+		{
+			Length++;
+			if (PakNameRoot[Length] == '\\' && (cStagedName[Length] == '\\' || cStagedName[Length] == '\0'))
+				Common = Length;
+		}
+		if (PakNameRoot[Length] == '\0' && (cStagedName[Length] == '\\' || cStagedName[Length] == '\0'))
+			Common = Length;
+		PakNameRoot[Common] = '\0';
+	}
+
+	if (InputCount == 0)
+		strcpy(PakNameRoot, PakStagingFolder);
+}
+
+void PakRemoveStaging(const char * FolderName)		// Remove staging folder and its subfolders
+{
+	WIN32_FIND_DATAA FindData;
+	HANDLE hFind;
+	char cPattern[MAX_PATH];
+	char cFileName[MAX_PATH];
+
+	// Only folders are left there, files are removed as soon as they are packed
+	snprintf(cPattern, sizeof(cPattern), "%s\\*", FolderName);
+	hFind = FindFirstFileA(cPattern, &FindData);
+	if (hFind != INVALID_HANDLE_VALUE)
+	{
+		do
+		{
+			if (!strcmp(FindData.cFileName, ".") || !strcmp(FindData.cFileName, ".."))
+				continue;
+
+			snprintf(cFileName, sizeof(cFileName), "%s\\%s", FolderName, FindData.cFileName);
+			if (FindData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+				PakRemoveStaging(cFileName);
+		} while (FindNextFileA(hFind, &FindData) != FALSE);
+
+		FindClose(hFind);
+	}
+
+	RemoveDirectoryA(FolderName);
+}
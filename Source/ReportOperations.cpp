@@ -0,0 +1,518 @@
+/*
+=====================================================================
+Copyright (c) 2018, Alexey Leushin
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or
+without modification, are permitted provided that the following
+conditions are met:
+- Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+- Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+- Neither the name of the copyright holders nor the names of its
+contributors may be used to endorse or promote products derived
+from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+=====================================================================
+*/
+
+//
+// This file contains result reports and splitting of batch work between machines (shards)
+//
+
+////////// Includes //////////
+#include "main.h"
+
+////////// Definitions //////////
+#define REPORT_LINE_SZ (MAX_PATH + 32)
+#define REPORT_SIGNATURE "# pvr2mdl report"
+#define SHARD_INDEX_SIGNATURE "# pvr2mdl shard index"
+
+////////// Structures //////////
+
+// Input file as seen by shard planner
+struct sShardEntry
+{
+	char * FileName;			// File name from shard index
+	ulong Size;					// File size when index was made (balancing weight)
+	ulong Hash;					// Hash of normalized file name (stable tie breaker)
+	uint Shard;					// Which shard processes file
+};
+
+////////// Global variables //////////
+FILE * ptrReportFile = NULL;					// Report of current run (NULL - no report)
+CRITICAL_SECTION ReportLock;					// Workers add lines one at a time
+
+////////// Functions //////////
+int CompareShardEntries(const void * ptrEntry1, const void * ptrEntry2);									// Order files from largest to smallest, then by hash
+int CompareShardHashes(const void * ptrEntry1, const void * ptrEntry2);										// Order files by hash, so file names can be looked up
+bool SameFileName(const char * FileName1, const char * FileName2);											// Compare file names like HashFileName() sees them
+bool ShardWriteIndex(const char * IndexName, char ** FileNames, int FileCount);								// Scan sizes of input files and save them as shard index (only if nobody did it first)
+sShardEntry * ShardReadIndex(const char * IndexName, int * ptrEntryCount);									// Load shard index (NULL - error)
+int CompareReportLines(const void * ptrLine1, const void * ptrLine2);										// Order report lines by file name
+
+ulong HashFileName(const char * FileName)		// Hash file name, so different spellings of the same path match
+{
+	ulong Hash = 2166136261;	// FNV-1a
+
+	// Skip "current folder" prefix
+	while (FileName[0] == '.' && (FileName[1] == '\\' || FileName[1] == '/'))
+		FileName += 2;
+
+	for (; *FileName != '\0'; FileName++)
+	{
+		char Char = (*FileName == '/') ? '\\' : tolower(*FileName);
+		Hash = (Hash ^ (uchar)Char) * 16777619;
+	}
+
+	return Hash;
+}
+
+int CompareShardEntries(const void * ptrEntry1, const void * ptrEntry2)		// Order files from largest to smallest, then by hash
+{
+	const sShardEntry * Entry1 = (const sShardEntry *)ptrEntry1;
+	const sShardEntry * Entry2 = (const sShardEntry *)ptrEntry2;
+
+	if (Entry1->Size != Entry2->Size)
+		return (Entry1->Size < Entry2->Size) ? 1 : -1;
+	if (Entry1->Hash != Entry2->Hash)
+		return (Entry1->Hash < Entry2->Hash) ? -1 : 1;
+
+	return strcmp(Entry1->FileName, Entry2->FileName);
+}
+
+int CompareShardHashes(const void * ptrEntry1, const void * ptrEntry2)		// Order files by hash, so file names can be looked up
+{
+	const sShardEntry * Entry1 = (const sShardEntry *)ptrEntry1;
+	const sShardEntry * Entry2 = (const sShardEntry *)ptrEntry2;
+
+	if (Entry1->Hash != Entry2->Hash)
+		return (Entry1->Hash < Entry2->Hash) ? -1 : 1;
+
+	return strcmp(Entry1->FileName, Entry2->FileName);
+}
+
+bool SameFileName(const char * FileName1, const char * FileName2)		// Compare file names like HashFileName() sees them
+{
+	while (FileName1[0] == '.' && (FileName1[1] == '\\' || FileName1[1] == '/'))
+		FileName1 += 2;
+	while (FileName2[0] == '.' && (FileName2[1] == '\\' || FileName2[1] == '/'))
+		FileName2 += 2;
+
+	for (; *FileName1 != '\0' && *FileName2 != '\0'; FileName1++, FileName2++)
+	{
+		char Char1 = (*FileName1 == '/') ? '\\' : tolower(*FileName1);
+		char Char2 = (*FileName2 == '/') ? '\\' : tolower(*FileName2);
+		if (Char1 != Char2)
+			return false;
+	}
+
+	return *FileName1 == *FileName2;
+}
+
+bool ShardWriteIndex(const char * IndexName, char ** FileNames, int FileCount)		// Scan sizes of input files and save them as shard index (only if nobody did it first)
+{
+	char cTempName[MAX_PATH];
+	struct stat FileStat;
+	FILE * ptrIndexFile;
+
+	snprintf(cTempName, sizeof(cTempName), "%s.%lu.tmp", IndexName, (ulong)GetCurrentProcessId());
+	if (SafeFileOpen(&ptrIndexFile, cTempName, "w") == false)
+		return false;
+
+	fprintf(ptrIndexFile, "%s\n", SHARD_INDEX_SIGNATURE);
+	for (int i = 0; i < FileCount; i++)
+		fprintf(ptrIndexFile, "%lu\t%s\n", (stat(FileNames[i], &FileStat) == 0) ? (ulong)FileStat.st_size : 0, FileNames[i]);
+
+	if (ferror(ptrIndexFile) != 0 || fclose(ptrIndexFile) != 0)
+	{
+		printf("Error: can't write shard index: %s\n", cTempName);
+		remove(cTempName);
+		return false;
+	}
+
+	// Rename fails when other machine saved index first, then its index is used
+	if (MoveFileExA(cTempName, IndexName, MOVEFILE_WRITE_THROUGH) == FALSE)
+		remove(cTempName);
+	else
+		printf("Shard index saved: %s (%i files)\n", IndexName, FileCount);
+
+	return true;
+}
+
+sShardEntry * ShardReadIndex(const char * IndexName, int * ptrEntryCount)		// Load shard index (NULL - error)
+{
+	FILE * ptrIndexFile;
+	char Line[REPORT_LINE_SZ];
+	sShardEntry * Entries = NULL;
+	int Capacity = 0;
+	ulong Size;
+	int Length;
+
+	*ptrEntryCount = 0;
+
+	if (SafeFileOpen(&ptrIndexFile, IndexName, "r") == false)
+		return NULL;
+
+	if (fgets(Line, sizeof(Line), ptrIndexFile) == NULL || strncmp(Line, SHARD_INDEX_SIGNATURE, strlen(SHARD_INDEX_SIGNATURE)))
+	{
+		printf("Error: not a shard index: %s\n", IndexName);
+		fclose(ptrIndexFile);
+		return NULL;
+	}
+
+	while (fgets(Line, sizeof(Line), ptrIndexFile) != NULL)
+	{
+		Line[strcspn(Line, "\r\n")] = '\0';
+		if (sscanf(Line, "%lu\t%n", &Size, &Length) != 1 || Line[Length] == '\0')
+			continue;
+
+		if (*ptrEntryCount == Capacity)
+		{
+			Capacity = (Capacity == 0) ? 256 : Capacity * 2;
+			sShardEntry * NewEntries = (sShardEntry *)realloc(Entries, Capacity * sizeof(sShardEntry));
+			if (NewEntries == NULL)
+			{
+				puts("Unable to allocate memory ...");
+				break;
+			}
+			Entries = NewEntries;
+		}
+
+		Entries[*ptrEntryCount].FileName = _strdup(Line + Length);
+		if (Entries[*ptrEntryCount].FileName == NULL)
+			break;
+		Entries[*ptrEntryCount].Size = Size;
+		Entries[*ptrEntryCount].Hash = HashFileName(Line + Length);
+		Entries[*ptrEntryCount].Shard = 0;
+		(*ptrEntryCount)++;
+	}
+
+	fclose(ptrIndexFile);
+
+	// Index without files is still valid, everything is then split by hash
+	if (Entries == NULL)
+		Entries = (sShardEntry *)malloc(sizeof(sShardEntry));
+
+	return Entries;
+}
+
+int SelectShard(char ** FileNames, int FileCount)		// Keep only files of current shard in list, returns new file count
+{
+	sShardEntry * Entries = NULL;
+	int EntryCount = 0;
+	unsigned long long * ShardLoads;
+	int Count = 0;
+
+	if (ProgOptions.ShardCount < 2)
+		return FileCount;
+
+	// Sizes are taken once and shared through index, files that are rewritten later don't change the plan
+	if (ProgOptions.ShardIndexFile[0] != '\0')
+	{
+		if (CheckFile(ProgOptions.ShardIndexFile) == false && ShardWriteIndex(ProgOptions.ShardIndexFile, FileNames, FileCount) == false)
+			return 0;
+
+		Entries = ShardReadIndex(ProgOptions.ShardIndexFile, &EntryCount);
+		if (Entries == NULL)
+			return 0;
+	}
+
+	ShardLoads = (unsigned long long *)calloc(ProgOptions.ShardCount, sizeof(unsigned long long));
+	if (ShardLoads == NULL)
+	{
+		puts("Unable to allocate memory ...");
+		for (int i = 0; i < EntryCount; i++)
+			free(Entries[i].FileName);
+		free(Entries);
+		return 0;
+	}
+
+	// Whole index is planned on every machine, so plan doesn't depend on command line
+	if (EntryCount > 0)
+		qsort(Entries, EntryCount, sizeof(sShardEntry), CompareShardEntries);
+	for (int i = 0; i < EntryCount; i++)
+	{
+		uint Shard = 0;
+		for (uint j = 1; j < ProgOptions.ShardCount; j++)
+			if (ShardLoads[j] < ShardLoads[Shard])
+				Shard = j;
+
+		// Empty files still count, so they are spread too
+		ShardLoads[Shard] += Entries[i].Size + 1;
+		Entries[i].Shard = Shard;
+	}
+	if (EntryCount > 0)
+		qsort(Entries, EntryCount, sizeof(sShardEntry), CompareShardHashes);
+
+	// Files that aren't in index (or all files without index) go by hash of their name only
+	for (int i = 0; i < FileCount; i++)
+	{
+		ulong Hash = HashFileName(FileNames[i]);
+		uint Shard = Hash % ProgOptions.ShardCount;
+		int First = 0;
+		int Last = EntryCount;
+
+		while (First < Last)
+		{
+			int Middle = (First + Last) / 2;
+			if (Entries[Middle].Hash < Hash)
+				First = Middle + 1;
+			else
+				Last = Middle;
+		}
+		for (int j = First; j < EntryCount && Entries[j].Hash == Hash; j++)
+		{
+			if (SameFileName(Entries[j].FileName, FileNames[i]) == true)
+			{
+				Shard = Entries[j].Shard;
+				break;
+			}
+		}
+
+		if (Shard == ProgOptions.ShardIndex)
+			FileNames[Count++] = FileNames[i];
+	}
+
+	printf("Shard %u/%u: %i of %i files\n", ProgOptions.ShardIndex + 1, ProgOptions.ShardCount, Count, FileCount);
+
+	for (int i = 0; i < EntryCount; i++)
+		free(Entries[i].FileName);
+	free(Entries);
+	free(ShardLoads);
+
+	return Count;
+}
+
+bool ReportOpen(const char * FileName)		// Start report of current run
+{
+	fopen_s(&ptrReportFile, FileName, "w");
+	if (ptrReportFile == NULL)
+	{
+		printf("Error: can't create report: %s\n", FileName);
+		return false;
+	}
+
+	InitializeCriticalSection(&ReportLock);
+
+	if (ProgOptions.ShardCount > 1)
+		fprintf(ptrReportFile, "%s: shard %u/%u\n", REPORT_SIGNATURE, ProgOptions.ShardIndex + 1, ProgOptions.ShardCount);
+	else
+		fprintf(ptrReportFile, "%s\n", REPORT_SIGNATURE);
+
+	return true;
+}
+
+void ReportResult(int Job, const char * FileName, int Result)		// Add result of job to report
+{
+	if (ptrReportFile == NULL)
+		return;
+
+	// Failed jobs get reason before file name (file name stays the last field)
+	EnterCriticalSection(&ReportLock);
+	if (Result == RESULT_OK)
+		fprintf(ptrReportFile, "ok\t%s\t%s\n", GetJobName(Job), FileName);
+	else
+		fprintf(ptrReportFile, "failed\t%s\t%s\t%s\n", GetJobName(Job), GetResultName(Result), FileName);
+	fflush(ptrReportFile);
+	LeaveCriticalSection(&ReportLock);
+}
+
+void ReportQuality(const char * FileName, const sTexture * ptrTexture)		// Add quality metrics of converted texture to report
+{
+	char PSNR[16];
+
+	if (ptrReportFile == NULL)
+		return;
+
+	// File name stays the last field, so lines are merged and sorted together with job results
+	ptrTexture->Quality.GetPSNR(PSNR, sizeof(PSNR));
+	EnterCriticalSection(&ReportLock);
+	fprintf(ptrReportFile, "quality\t%s\t%.2f\t%.2f\t%s\t%s\n", PSNR, ptrTexture->Quality.GetMaxDeltaE(), ptrTexture->Quality.GetChangedShare(), ptrTexture->Name, FileName);
+	LeaveCriticalSection(&ReportLock);
+}
+
+void ReportClose()		// Finish report of current run
+{
+	if (ptrReportFile == NULL)
+		return;
+
+	fclose(ptrReportFile);
+	ptrReportFile = NULL;
+	DeleteCriticalSection(&ReportLock);
+}
+
+int CompareReportLines(const void * ptrLine1, const void * ptrLine2)		// Order report lines by file name
+{
+	const char * Line1 = *(const char **)ptrLine1;
+	const char * Line2 = *(const char **)ptrLine2;
+	int Result;
+
+	// File name is the last field
+	Result = strcmp(strrchr(Line1, '\t'), strrchr(Line2, '\t'));
+	if (Result == 0)
+		Result = strcmp(Line1, Line2);
+
+	return Result;
+}
+
+bool MergeReports(const char * OutFileName, char ** FileNames, int FileCount)		// Combine shard reports into one report
+{
+	FILE * ptrInFile;
+	FILE * ptrOutFile;
+	char Line[REPORT_LINE_SZ];
+	char ** Lines = NULL;
+	uint LineCount = 0;
+	uint LineCapacity = 0;
+	uint ShardCount = 0;
+	bool * ShardSeen = NULL;
+	uint Jobs = 0;
+	uint Failed = 0;
+	uint Duplicates = 0;
+	const char * PrevJobLine = NULL;
+	bool Result = true;
+
+	for (int i = 0; i < FileCount; i++)
+	{
+		fopen_s(&ptrInFile, FileNames[i], "r");
+		if (ptrInFile == NULL)
+		{
+			printf("Error: can't open report: %s\n", FileNames[i]);
+			Result = false;
+			continue;
+		}
+
+		// Check header and remember which shard report came from
+		if (fgets(Line, sizeof(Line), ptrInFile) == NULL || strncmp(Line, REPORT_SIGNATURE, strlen(REPORT_SIGNATURE)))
+		{
+			printf("Error: not a report: %s\n", FileNames[i]);
+			fclose(ptrInFile);
+			Result = false;
+			continue;
+		}
+
+		uint Shard, Count;
+		if (sscanf(Line + strlen(REPORT_SIGNATURE), ": shard %u/%u", &Shard, &Count) == 2 && Shard >= 1 && Shard <= Count)
+		{
+			if (ShardSeen == NULL)
+			{
+				ShardCount = Count;
+				ShardSeen = (bool *)calloc(ShardCount, sizeof(bool));
+			}
+
+			if (Count != ShardCount)
+			{
+				printf("Warning: %s is shard of %u, others are shards of %u\n", FileNames[i], Count, ShardCount);
+				Result = false;
+			}
+			else if (ShardSeen != NULL)
+			{
+				if (ShardSeen[Shard - 1] == true)
+				{
+					printf("Warning: shard %u/%u is given twice\n", Shard, Count);
+					Result = false;
+				}
+				ShardSeen[Shard - 1] = true;
+			}
+		}
+
+		// Collect results
+		while (fgets(Line, sizeof(Line), ptrInFile) != NULL)
+		{
+			Line[strcspn(Line, "\r\n")] = '\0';
+			if (Line[0] == '#' || strchr(Line, '\t') == NULL)
+				continue;
+
+			if (LineCount == LineCapacity)
+			{
+				LineCapacity = (LineCapacity == 0) ? 256 : LineCapacity * 2;
+				Lines = (char **)realloc(Lines, LineCapacity * sizeof(char *));
+				if (Lines == NULL)
+				{
+					puts("Unable to allocate memory ...");
+					fclose(ptrInFile);
+					return false;
+				}
+			}
+
+			Lines[LineCount] = _strdup(Line);
+			if (Lines[LineCount] != NULL)
+				LineCount++;
+		}
+
+		fclose(ptrInFile);
+	}
+
+	// Missing shards mean that part of corpus wasn't processed
+	for (uint i = 0; ShardSeen != NULL && i < ShardCount; i++)
+	{
+		if (ShardSeen[i] == false)
+		{
+			printf("Warning: report of shard %u/%u is missing\n", i + 1, ShardCount);
+			Result = false;
+		}
+	}
+	free(ShardSeen);
+
+	qsort(Lines, LineCount, sizeof(char *), CompareReportLines);
+
+	fopen_s(&ptrOutFile, OutFileName, "w");
+	if (ptrOutFile == NULL)
+	{
+		printf("Error: can't create report: %s\n", OutFileName);
+		Result = false;
+	}
+	else
+	{
+		fprintf(ptrOutFile, "%s: merged %i reports\n", REPORT_SIGNATURE, FileCount);
+	}
+
+	for (uint i = 0; i < LineCount; i++)
+	{
+		// Quality lines of textures follow result of their model
+		if (!strncmp(Lines[i], "ok\t", 3) || !strncmp(Lines[i], "failed\t", 7))
+		{
+			Jobs++;
+			if (!strncmp(Lines[i], "failed", 6))
+				Failed++;
+
+			// The same file in two shards means shards were planned from different file lists
+			if (PrevJobLine != NULL && !strcmp(strrchr(Lines[i], '\t'), strrchr(PrevJobLine, '\t')))
+				Duplicates++;
+			PrevJobLine = Lines[i];
+		}
+
+		if (ptrOutFile != NULL)
+			fprintf(ptrOutFile, "%s\n", Lines[i]);
+	}
+
+	for (uint i = 0; i < LineCount; i++)
+		free(Lines[i]);
+	free(Lines);
+
+	if (ptrOutFile != NULL)
+		fclose(ptrOutFile);
+
+	printf("Merged %i reports: %u jobs, %u ok, %u failed\n", FileCount, Jobs, Jobs - Failed, Failed);
+	if (Duplicates > 0)
+	{
+		printf("Warning: %u files were processed more than once\n", Duplicates);
+		Result = false;
+	}
+
+	return Result && Failed == 0;
+}
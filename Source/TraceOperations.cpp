@@ -0,0 +1,203 @@
+/*
+=====================================================================
+Copyright (c) 2018, Alexey Leushin
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or
+without modification, are permitted provided that the following
+conditions are met:
+- Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+- Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+- Neither the name of the copyright holders nor the names of its
+contributors may be used to endorse or promote products derived
+from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+=====================================================================
+*/
+
+//
+// This file contains timeline tracing of processing stages (Chrome trace format, can be opened in Perfetto)
+//
+
+////////// Includes //////////
+#include "main.h"
+
+////////// Definitions //////////
+#define TRACE_RING_SZ 8192				// How many spans every thread keeps (older ones are overwritten)
+
+////////// Structures //////////
+
+// Finished processing stage
+struct sTraceEvent
+{
+	const char * Name;			// Stage name (string constant)
+	char Detail[64];			// Model or texture name
+	ulong Width;				// Texture width (0 for model stages)
+	ulong Height;				// Texture height (0 for model stages)
+	long long Start;			// Performance counter at start of stage
+	long long End;				// Performance counter at end of stage
+};
+
+// Spans recorded by one thread (only owner thread writes to it, so no locking is needed)
+struct sTraceBuffer
+{
+	sTraceEvent Events[TRACE_RING_SZ];	// Ring buffer with spans
+	ulong Count;						// How many spans were recorded
+	DWORD ThreadID;						// Owner thread
+	sTraceBuffer * Next;				// Buffer of another thread
+};
+
+////////// Global variables //////////
+bool TraceEnabled = false;						// Set when --trace option is used
+LARGE_INTEGER TraceOrigin;						// Performance counter at program start
+LARGE_INTEGER TraceFrequency;					// Performance counter ticks per second
+CRITICAL_SECTION TraceLock;						// Protects list of buffers
+sTraceBuffer * TraceBuffers = NULL;				// Buffers of all threads that recorded something
+thread_local sTraceBuffer * ThreadTrace = NULL;	// Buffer of current thread
+
+////////// Functions //////////
+void TraceWriteString(FILE ** ptrFile, const char * String);												// Write JSON string
+
+void TraceInitialize()		// Start recording spans
+{
+	InitializeCriticalSection(&TraceLock);
+	QueryPerformanceFrequency(&TraceFrequency);
+	QueryPerformanceCounter(&TraceOrigin);
+	TraceEnabled = true;
+}
+
+long long TraceClock()		// Get time for start of span (0 if tracing is off)
+{
+	LARGE_INTEGER Counter;
+
+	if (TraceEnabled == false)
+		return 0;
+
+	QueryPerformanceCounter(&Counter);
+
+	return Counter.QuadPart;
+}
+
+void TraceSpan(const char * Name, long long Start, const char * Detail, ulong Width, ulong Height)		// Record stage that started at Start and ends now
+{
+	LARGE_INTEGER Counter;
+	sTraceEvent * ptrEvent;
+
+	if (TraceEnabled == false)
+		return;
+
+	QueryPerformanceCounter(&Counter);
+
+	// First span of this thread
+	if (ThreadTrace == NULL)
+	{
+		ThreadTrace = (sTraceBuffer *)malloc(sizeof(sTraceBuffer));
+		if (ThreadTrace == NULL)
+			return;
+
+		ThreadTrace->Count = 0;
+		ThreadTrace->ThreadID = GetCurrentThreadId();
+
+		EnterCriticalSection(&TraceLock);
+		ThreadTrace->Next = TraceBuffers;
+		TraceBuffers = ThreadTrace;
+		LeaveCriticalSection(&TraceLock);
+	}
+
+	ptrEvent = &ThreadTrace->Events[ThreadTrace->Count % TRACE_RING_SZ];
+	ptrEvent->Name = Name;
+	strncpy(ptrEvent->Detail, (Detail != NULL) ? Detail : "", sizeof(ptrEvent->Detail) - 1);
+	ptrEvent->Detail[sizeof(ptrEvent->Detail) - 1] = '\0';
+	ptrEvent->Width = Width;
+	ptrEvent->Height = Height;
+	ptrEvent->Start = Start;
+	ptrEvent->End = Counter.QuadPart;
+	ThreadTrace->Count++;
+}
+
+void TraceWriteString(FILE ** ptrFile, const char * String)		// Write JSON string
+{
+	fputc('"', *ptrFile);
+
+	for (; *String != '\0'; String++)
+	{
+		if (*String == '"' || *String == '\\')
+			fprintf(*ptrFile, "\\%c", *String);
+		else if ((uchar)*String < 0x20)
+			fprintf(*ptrFile, "\\u%04x", (uchar)*String);
+		else
+			fputc(*String, *ptrFile);
+	}
+
+	fputc('"', *ptrFile);
+}
+
+bool TraceSave(const char * FileName)		// Write recorded spans to *.json file (call when workers are stopped)
+{
+	FILE * ptrTraceFile;
+	bool NeedComma = false;
+	ulong Lost = 0;
+
+	if (TraceEnabled == false)
+		return true;
+
+	fopen_s(&ptrTraceFile, FileName, "w");
+	if (ptrTraceFile == NULL)
+	{
+		printf("Error: can't save trace: %s\n", FileName);
+		return false;
+	}
+
+	fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", ptrTraceFile);
+
+	EnterCriticalSection(&TraceLock);
+	for (sTraceBuffer * ptrBuffer = TraceBuffers; ptrBuffer != NULL; ptrBuffer = ptrBuffer->Next)
+	{
+		// Only last TRACE_RING_SZ spans are kept
+		ulong Oldest = (ptrBuffer->Count > TRACE_RING_SZ) ? ptrBuffer->Count - TRACE_RING_SZ : 0;
+		Lost += Oldest;
+
+		for (ulong i = Oldest; i < ptrBuffer->Count; i++)
+		{
+			sTraceEvent * ptrEvent = &ptrBuffer->Events[i % TRACE_RING_SZ];
+
+			// Complete event: timestamps are in microseconds since program start
+			fprintf(ptrTraceFile, "%s{\"name\":\"%s\",\"cat\":\"pvr2mdl\",\"ph\":\"X\",\"pid\":1,\"tid\":%lu,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"name\":",
+				(NeedComma == true) ? ",\n" : "",
+				ptrEvent->Name,
+				(unsigned long)ptrBuffer->ThreadID,
+				(double)(ptrEvent->Start - TraceOrigin.QuadPart) * 1000000.0 / TraceFrequency.QuadPart,
+				(double)(ptrEvent->End - ptrEvent->Start) * 1000000.0 / TraceFrequency.QuadPart);
+			TraceWriteString(&ptrTraceFile, ptrEvent->Detail);
+			if (ptrEvent->Width != 0)
+				fprintf(ptrTraceFile, ",\"width\":%lu,\"height\":%lu", (unsigned long)ptrEvent->Width, (unsigned long)ptrEvent->Height);
+			fputs("}}", ptrTraceFile);
+			NeedComma = true;
+		}
+	}
+	LeaveCriticalSection(&TraceLock);
+
+	fputs("\n]}\n", ptrTraceFile);
+	fclose(ptrTraceFile);
+
+	if (Lost > 0)
+		printf("Trace: %lu oldest spans were overwritten\n", (unsigned long)Lost);
+	printf("Trace saved to %s\n", FileName);
+
+	return true;
+}
@@ -0,0 +1,348 @@
+/*
+=====================================================================
+Copyright (c) 2018, Alexey Leushin
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or
+without modification, are permitted provided that the following
+conditions are met:
+- Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+- Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+- Neither the name of the copyright holders nor the names of its
+contributors may be used to endorse or promote products derived
+from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+=====================================================================
+*/
+
+//
+// This file contains verification of converted models: model file is mapped and its tables are checked
+// against layout that ConvertPVRToMDL() writes, textures can also be compared with PVR originals
+//
+
+////////// Includes //////////
+#include "main.h"
+
+////////// Definitions //////////
+#define VERIFY_MIN_PSNR 15.0			// Texture that is further from its PVR original is reported as damaged (in dB)
+#define VERIFY_MAX_SIDE 4096			// Largest texture side that is taken seriously
+
+////////// Structures //////////
+
+// Read-only view of whole file
+struct sMappedFile
+{
+	HANDLE hFile;
+	HANDLE hMapping;
+	const uchar * Data;
+	ulong Size;
+};
+
+////////// Functions //////////
+bool VerifyMapFile(sMappedFile * ptrMapped, const char * FileName);											// Map whole file for reading
+void VerifyUnmapFile(sMappedFile * ptrMapped);																// Release mapped file
+void VerifyProblem(uint * ptrProblems, const char * Format, ...);											// Print problem of model and count it
+int VerifyLayout(const uchar * Data, ulong Size);															// Check header, texture table and skin table of mapped model
+int VerifyTextures(const char * FileName, const uchar * Data, const char * SourceName);						// Compare textures of mapped model with PVR textures of source model
+
+bool VerifyMapFile(sMappedFile * ptrMapped, const char * FileName)	// Map whole file for reading
+{
+	LARGE_INTEGER Size;
+
+	ptrMapped->hMapping = NULL;
+	ptrMapped->Data = NULL;
+
+	ptrMapped->hFile = CreateFileA(FileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (ptrMapped->hFile == INVALID_HANDLE_VALUE)
+		return false;
+
+	if (GetFileSizeEx(ptrMapped->hFile, &Size) == FALSE || Size.QuadPart > 0x7FFFFFFF)
+	{
+		CloseHandle(ptrMapped->hFile);
+		return false;
+	}
+	ptrMapped->Size = (ulong)Size.QuadPart;
+
+	// Empty file can't be mapped, it's left for layout check to reject
+	if (ptrMapped->Size == 0)
+		return true;
+
+	ptrMapped->hMapping = CreateFileMappingA(ptrMapped->hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (ptrMapped->hMapping != NULL)
+		ptrMapped->Data = (const uchar *)MapViewOfFile(ptrMapped->hMapping, FILE_MAP_READ, 0, 0, 0);
+
+	if (ptrMapped->Data == NULL)
+	{
+		VerifyUnmapFile(ptrMapped);
+		return false;
+	}
+
+	return true;
+}
+
+void VerifyUnmapFile(sMappedFile * ptrMapped)	// Release mapped file
+{
+	if (ptrMapped->Data != NULL)
+		UnmapViewOfFile(ptrMapped->Data);
+	if (ptrMapped->hMapping != NULL)
+		CloseHandle(ptrMapped->hMapping);
+	CloseHandle(ptrMapped->hFile);
+
+	ptrMapped->Data = NULL;
+	ptrMapped->hMapping = NULL;
+}
+
+void VerifyProblem(uint * ptrProblems, const char * Format, ...)	// Print problem of model and count it
+{
+	char Message[512];
+	va_list Args;
+
+	va_start(Args, Format);
+	vsnprintf(Message, sizeof(Message), Format, Args);
+	va_end(Args);
+	LogPrint(LOG_ERROR, "Error: %s\n", Message);
+
+	(*ptrProblems)++;
+}
+
+int VerifyLayout(const uchar * Data, ulong Size)	// Check header, texture table and skin table of mapped model
+{
+	sModelHeader ModelHeader;
+	sModelTextureEntry TextureEntry;
+	uint Problems = 0;
+
+	// Fields are copied out of mapping, nothing in file is trusted to be aligned
+	if (Size < sizeof(sModelHeader))
+	{
+		LogPrint(LOG_ERROR, "Error: file is too small to be a model.\n");
+		return RESULT_BAD_MODEL;
+	}
+	memcpy(&ModelHeader, Data, sizeof(sModelHeader));
+	ModelHeader.Name[63] = '\0';
+	if (ModelHeader.CheckModel() != NORMAL_MODEL)
+	{
+		LogPrint(LOG_ERROR, "Error: not a model with textures.\n");
+		return RESULT_BAD_MODEL;
+	}
+	LogPrint(LOG_DETAIL, "Internal name: %s \nTextures: %i, Texture table offset: 0x%X \n", ModelHeader.Name, ModelHeader.TextureCount, ModelHeader.TextureTableOffset);
+
+	if (ModelHeader.FileSize != Size)
+		VerifyProblem(&Problems, "file size field is %lu, but file has %lu bytes.", ModelHeader.FileSize, Size);
+
+	// Tables have to be inside file before anything in them can be checked (sizes are counted in 64 bits, so huge counts don't wrap)
+	unsigned long long TableEnd = (unsigned long long)ModelHeader.TextureTableOffset + (unsigned long long)ModelHeader.TextureCount * sizeof(sModelTextureEntry);
+	unsigned long long SkinTableSize = (unsigned long long)ModelHeader.SkinCount * ModelHeader.SkinEntrySize * 2;
+	if (TableEnd > Size)
+	{
+		LogPrint(LOG_ERROR, "Error: texture table (%lu entries at 0x%X) doesn't fit into file.\n", ModelHeader.TextureCount, ModelHeader.TextureTableOffset);
+		return RESULT_BAD_MODEL;
+	}
+	if ((unsigned long long)ModelHeader.SkinTableOffset + SkinTableSize > Size)
+	{
+		LogPrint(LOG_ERROR, "Error: skin table (%lu x %lu entries at 0x%X) doesn't fit into file.\n", ModelHeader.SkinCount, ModelHeader.SkinEntrySize, ModelHeader.SkinTableOffset);
+		return RESULT_BAD_MODEL;
+	}
+
+	// Converted model has skins right after texture table and texture data right after skins
+	if (ModelHeader.TextureDataOffset != TableEnd + SkinTableSize)
+		VerifyProblem(&Problems, "texture data offset is 0x%X, expected 0x%X.", ModelHeader.TextureDataOffset, (ulong)(TableEnd + SkinTableSize));
+
+	// Every skin refers to existing texture
+	for (ulong i = 0; i < ModelHeader.SkinCount * ModelHeader.SkinEntrySize; i++)
+	{
+		ushort SkinTexture;
+
+		memcpy(&SkinTexture, &Data[ModelHeader.SkinTableOffset + i * 2], sizeof(SkinTexture));
+		if (SkinTexture >= ModelHeader.TextureCount)
+		{
+			VerifyProblem(&Problems, "skin table refers to texture #%i, model has %lu textures.", SkinTexture + 1, ModelHeader.TextureCount);
+			break;
+		}
+	}
+
+	// Textures go one after another: no gaps, no overlaps, last one ends where file ends
+	unsigned long long Expected = ModelHeader.TextureDataOffset;
+	for (ulong i = 0; i < ModelHeader.TextureCount; i++)
+	{
+		char Extension[5];
+
+		memcpy(&TextureEntry, &Data[ModelHeader.TextureTableOffset + i * sizeof(sModelTextureEntry)], sizeof(sModelTextureEntry));
+		TextureEntry.Name[sizeof(TextureEntry.Name) - 1] = '\0';
+
+		FileGetExtension(TextureEntry.Name, Extension, sizeof(Extension));
+		if (strcmp(Extension, ".bmp"))
+			VerifyProblem(&Problems, "texture #%i (%s) isn't converted.", i + 1, TextureEntry.Name);
+
+		if (TextureEntry.Width == 0 || TextureEntry.Height == 0 || TextureEntry.Width > VERIFY_MAX_SIDE || TextureEntry.Height > VERIFY_MAX_SIDE)
+		{
+			VerifyProblem(&Problems, "texture #%i (%s) has wrong size: %lux%lu.", i + 1, TextureEntry.Name, TextureEntry.Width, TextureEntry.Height);
+			continue;
+		}
+
+		unsigned long long TextureEnd = (unsigned long long)TextureEntry.Offset + TextureEntry.Width * TextureEntry.Height + _8BIT_PLTE_SZ * MDL_PLTE_ENTRY_SZ;
+		if (TextureEntry.Offset < Expected)
+			VerifyProblem(&Problems, "texture #%i (%s) at 0x%X overlaps data that ends at 0x%X.", i + 1, TextureEntry.Name, TextureEntry.Offset, (ulong)Expected);
+		else if (TextureEntry.Offset > Expected)
+			VerifyProblem(&Problems, "texture #%i (%s) is at 0x%X, expected 0x%X.", i + 1, TextureEntry.Name, TextureEntry.Offset, (ulong)Expected);
+		if (TextureEnd > Size)
+		{
+			VerifyProblem(&Problems, "texture #%i (%s) ends at 0x%X, past end of file (bitmap or palette is cut off).", i + 1, TextureEntry.Name, (ulong)TextureEnd);
+			break;
+		}
+
+		Expected = TextureEnd;
+	}
+	if (Problems == 0 && Expected != Size)
+		VerifyProblem(&Problems, "last texture ends at 0x%X, file has %lu bytes.", (ulong)Expected, Size);
+
+	return (Problems == 0) ? RESULT_OK : RESULT_BAD_MODEL;
+}
+
+int VerifyTextures(const char * FileName, const uchar * Data, const char * SourceName)	// Compare textures of mapped model with PVR textures of source model
+{
+	FILE * ptrSrcFile;
+	sModelHeader ModelHeader;
+	sModelHeader SrcHeader;
+	sModelTextureEntry TextureEntry;
+	sModelTextureEntry SrcEntry;
+	sPVRImageHeader PVRImageHeader;
+	sTexture Texture;
+	ushort Palette16[_8BIT_PLTE_SZ];
+	uint Problems = 0;
+
+	if (SafeFileOpen(&ptrSrcFile, SourceName, "rb") == false)
+		return RESULT_IO_ERROR;
+
+	// Layout is already checked, so every table of converted model can be read from mapping
+	memcpy(&ModelHeader, Data, sizeof(sModelHeader));
+	if (FileSize(&ptrSrcFile) < sizeof(sModelHeader))
+		SrcHeader.TextureCount = 0;
+	else
+		SrcHeader.UpdateFromFile(&ptrSrcFile);
+	if (SrcHeader.CheckModel() != NORMAL_MODEL || SrcHeader.TextureCount != ModelHeader.TextureCount)
+	{
+		LogPrint(LOG_ERROR, "Error: source model doesn't match: %s\n", SourceName);
+		fclose(ptrSrcFile);
+
+		return RESULT_BAD_MODEL;
+	}
+
+	Texture.Initialize();
+	for (ulong i = 0; i < ModelHeader.TextureCount; i++)
+	{
+		memcpy(&TextureEntry, &Data[ModelHeader.TextureTableOffset + i * sizeof(sModelTextureEntry)], sizeof(sModelTextureEntry));
+		TextureEntry.Name[sizeof(TextureEntry.Name) - 1] = '\0';
+		SrcEntry.UpdateFromFile(&ptrSrcFile, SrcHeader.TextureTableOffset, i);
+		LogPrint(LOG_DETAIL, "\nComparing texture #%i: %s \n", i + 1, TextureEntry.Name);
+
+		// Source is decoded the same way it was decoded for conversion
+		strcpy(Texture.Name, TextureEntry.Name);
+		ushort * DirectImage = Texture.LoadPVRImage(&ptrSrcFile, SrcEntry.Offset, &PVRImageHeader);
+		if (DirectImage == NULL)
+		{
+			VerifyProblem(&Problems, "can't decode source texture #%i.", i + 1);
+			continue;
+		}
+		if (PVRImageHeader.Width != TextureEntry.Width || PVRImageHeader.Height != TextureEntry.Height)
+		{
+			VerifyProblem(&Problems, "texture #%i is %lux%lu, source is %lux%lu.", i + 1, TextureEntry.Width, TextureEntry.Height, (ulong)PVRImageHeader.Width, (ulong)PVRImageHeader.Height);
+			continue;
+		}
+
+		// Palette entries were expanded from 16-bit colors, so shifting them back gives colors that quantizer picked
+		const uchar * Bitmap = &Data[TextureEntry.Offset];
+		const uchar * Palette = &Data[TextureEntry.Offset + TextureEntry.Width * TextureEntry.Height];
+		for (int j = 0; j < _8BIT_PLTE_SZ; j++)
+			Palette16[j] = ((Palette[j * MDL_PLTE_ENTRY_SZ + 0] >> 3) << 11) | ((Palette[j * MDL_PLTE_ENTRY_SZ + 1] >> 2) << 5) | (Palette[j * MDL_PLTE_ENTRY_SZ + 2] >> 3);
+
+		sQualityMetrics Quality;
+		Quality.Reset();
+		MeasureQuality(DirectImage, Bitmap, Palette16, TextureEntry.Width * TextureEntry.Height, &Quality);
+		Texture.Quality = Quality;
+		Texture.PrintQuality();
+		ReportQuality(FileName, &Texture);
+
+		// Lossy quantization never gives exact match, but wrong bitmap or palette is far from original
+		double MSE = (double)Quality.SquaredError / ((double)Quality.PixelCount * 3.0);
+		if (MSE > 0.0 && 10.0 * log10(255.0 * 255.0 / MSE) < VERIFY_MIN_PSNR)
+			VerifyProblem(&Problems, "texture #%i (%s) doesn't match its source.", i + 1, TextureEntry.Name);
+	}
+
+	fclose(ptrSrcFile);
+
+	return (Problems == 0) ? RESULT_OK : RESULT_BAD_TEXTURE;
+}
+
+int VerifyModel(const char * FileName)	// Check converted model (and compare its textures with source when it's asked)
+{
+	char cModelName[MAX_PATH];
+	char cSourceName[MAX_PATH];
+	sMappedFile Mapped;
+	int Result;
+
+	// With --out results are in output tree and command line names their sources, otherwise source is backup
+	if (ProgOptions.OutFolder[0] == '\0')
+	{
+		strcpy(cModelName, FileName);
+		FileGetFullName(FileName, cSourceName, sizeof(cSourceName));
+		strcat(cSourceName, "-backup.mdl");
+	}
+	else
+	{
+		// Models without PVR textures are never written to output tree
+		if (CheckPVRModel(FileName) == false)
+		{
+			LogPrint(LOG_INFO, "Normal model, nothing to verify ...\n");
+			return RESULT_OK;
+		}
+
+		FileMirrorName(ProgOptions.OutFolder, FileName, cModelName, sizeof(cModelName));
+		strcpy(cSourceName, FileName);
+	}
+
+	if (VerifyMapFile(&Mapped, cModelName) == false)
+	{
+		LogPrint(LOG_ERROR, "Error: can't map file: %s\n", cModelName);
+		return RESULT_IO_ERROR;
+	}
+
+	long long TraceStart = TraceClock();
+	Result = VerifyLayout(Mapped.Data, Mapped.Size);
+	TraceSpan("verify layout", TraceStart, FileName, 0, 0);
+
+	if (Result == RESULT_OK && ProgOptions.VerifyPixels == true)
+	{
+		if (CheckFile(cSourceName) == false)
+		{
+			LogPrint(LOG_INFO, "No source model, textures are not compared: %s\n", cSourceName);
+		}
+		else
+		{
+			TraceStart = TraceClock();
+			Result = VerifyTextures(FileName, Mapped.Data, cSourceName);
+			TraceSpan("verify pixels", TraceStart, FileName, 0, 0);
+		}
+	}
+
+	VerifyUnmapFile(&Mapped);
+
+	if (Result == RESULT_OK)
+		LogPrint(LOG_INFO, "\nModel is OK.\n\n\n\n");
+
+	return Result;
+}
@@ -0,0 +1,336 @@
+/*
+=====================================================================
+Copyright (c) 2018, Alexey Leushin
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or
+without modification, are permitted provided that the following
+conditions are met:
+- Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+- Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+- Neither the name of the copyright holders nor the names of its
+contributors may be used to endorse or promote products derived
+from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+=====================================================================
+*/
+
+//
+// This file contains WAD3 output: extracted textures are appended to one GoldSrc *.wad file
+//
+
+////////// Includes //////////
+#include "main.h"
+
+////////// Definitions //////////
+#define WAD_NAME_SZ 16					// Longest lump name (with terminating zero)
+#define WAD_TYPE_MIPTEX 0x43			// Lump type of textures with mip levels
+#define WAD_MIN_HASH_SZ 512				// Smallest table of names (always power of 2)
+
+////////// Structures //////////
+
+// WAD header
+#pragma pack(1)
+struct sWadHeader
+{
+	char Signature[4];			// "WAD3"
+	ulong LumpCount;			// Number of lumps in directory
+	ulong DirectoryOffset;		// Location of directory (it's written at the end)
+};
+#pragma pack()
+
+// WAD directory entry
+#pragma pack(1)
+struct sWadEntry
+{
+	ulong Offset;				// Location of lump data
+	ulong DiskSize;				// Size of lump in file
+	ulong Size;					// Size of lump after decompression (the same, lumps aren't compressed)
+	char Type;					// Lump type (WAD_TYPE_MIPTEX)
+	char Compression;			// Compression (0 - none)
+	ushort Padding;
+	char Name[WAD_NAME_SZ];		// Lump name
+};
+#pragma pack()
+
+// Texture lump header (followed by 4 mip levels, palette size and palette)
+#pragma pack(1)
+struct sMipTexHeader
+{
+	char Name[WAD_NAME_SZ];		// Texture name
+	ulong Width;
+	ulong Height;
+	ulong Offsets[4];			// Locations of mip levels (counted from start of lump)
+};
+#pragma pack()
+
+////////// Global variables //////////
+sWadFile BatchWad;								// WAD that gets textures of whole batch (--wad=FILE)
+
+////////// Functions //////////
+bool WadNameTaken(sWadFile * ptrWad, const char * Name);													// Check if lump with this name is already in WAD
+bool WadGrowNames(sWadFile * ptrWad);																		// Make room for one more name (table is rebuilt twice as large when it gets half full)
+void WadAddName(sWadFile * ptrWad, ulong EntryIndex);														// Put lump into table of names
+void WadMakeMipLevel(const sTexture * ptrTexture, ulong Scale, uchar * DstBitmap);							// Shrink 8-bit texture, pixels are averaged and matched to palette
+
+bool WadOpen(sWadFile * ptrWad, const char * FileName)		// Create WAD, lumps are appended until WadClose()
+{
+	sWadHeader WadHeader;
+
+	ptrWad->Initialize();
+	fopen_s(&ptrWad->ptrFile, FileName, "wb");
+	if (ptrWad->ptrFile == NULL)
+	{
+		LogPrint(LOG_ERROR, "Error: can't create WAD: %s\n", FileName);
+		return false;
+	}
+
+	// Directory location is not known yet, header is rewritten at the end
+	memcpy(WadHeader.Signature, "WAD3", 4);
+	WadHeader.LumpCount = 0;
+	WadHeader.DirectoryOffset = 0;
+	FileWriteBlock(&ptrWad->ptrFile, &WadHeader, sizeof(WadHeader));
+	ptrWad->Offset = sizeof(WadHeader);
+
+	InitializeCriticalSection(&ptrWad->Lock);
+
+	return true;
+}
+
+bool WadAddTexture(sWadFile * ptrWad, const sTexture * ptrTexture)		// Append 8-bit texture with its mip levels
+{
+	static thread_local sScratchBuffer MipScratch = { NULL, 0 };	// Mip levels 1...3
+	sMipTexHeader MipHeader;
+	sWadEntry Entry;
+	char Name[64];
+	ulong MipSizes[4];
+	ushort ColorCount = _8BIT_PLTE_SZ;
+	uchar Padding[2] = { 0, 0 };
+	bool Result = true;
+
+	// Sizes of mip levels are rounded down like engine does it, so sizes don't have to be multiple of 16
+	// (small textures of models just get tiny or empty last levels)
+	for (ulong Level = 0; Level < 4; Level++)
+		MipSizes[Level] = (ptrTexture->Width >> Level) * (ptrTexture->Height >> Level);
+	ulong PixelCount = MipSizes[0];
+	ulong MipsSize = MipSizes[1] + MipSizes[2] + MipSizes[3];
+
+	// Mip levels are made before WAD is locked
+	uchar * Mips = (uchar *)MipScratch.Reserve(MipsSize + 1);
+	if (Mips == NULL)
+	{
+		LogPrint(LOG_ERROR, "Memory allocation failure!\n");
+		return false;
+	}
+	WadMakeMipLevel(ptrTexture, 2, Mips);
+	WadMakeMipLevel(ptrTexture, 4, Mips + MipSizes[1]);
+	WadMakeMipLevel(ptrTexture, 8, Mips + MipSizes[1] + MipSizes[2]);
+
+	// Lump: header, 4 mip levels, palette size, palette, padding to 4 bytes
+	memset(&MipHeader, 0x00, sizeof(MipHeader));
+	MipHeader.Width = ptrTexture->Width;
+	MipHeader.Height = ptrTexture->Height;
+	MipHeader.Offsets[0] = sizeof(MipHeader);
+	MipHeader.Offsets[1] = MipHeader.Offsets[0] + MipSizes[0];
+	MipHeader.Offsets[2] = MipHeader.Offsets[1] + MipSizes[1];
+	MipHeader.Offsets[3] = MipHeader.Offsets[2] + MipSizes[2];
+	ulong LumpSize = MipHeader.Offsets[3] + MipSizes[3] + sizeof(ColorCount) + _8BIT_PLTE_SZ * MDL_PLTE_ENTRY_SZ + sizeof(Padding);
+
+	FileGetName(ptrTexture->Name, Name, sizeof(Name), false);
+
+	EnterCriticalSection(&ptrWad->Lock);
+
+	// Lump names are limited to 15 characters and textures of different models often share names
+	snprintf(MipHeader.Name, sizeof(MipHeader.Name), "%s", Name);
+	for (ulong Copy = 1; WadNameTaken(ptrWad, MipHeader.Name) == true; Copy++)
+	{
+		char Suffix[16];
+		snprintf(Suffix, sizeof(Suffix), "~%lu", Copy);
+		snprintf(MipHeader.Name, sizeof(MipHeader.Name), "%.*s%s", (int)(sizeof(MipHeader.Name) - 1 - strlen(Suffix)), Name, Suffix);
+	}
+
+	if (ptrWad->EntryCount == ptrWad->EntryCapacity)
+	{
+		ulong NewCapacity = (ptrWad->EntryCapacity == 0) ? 256 : ptrWad->EntryCapacity * 2;
+		sWadEntry * NewEntries = (sWadEntry *)realloc(ptrWad->Entries, NewCapacity * sizeof(sWadEntry));
+		if (NewEntries == NULL)
+		{
+			LogPrint(LOG_ERROR, "Unable to allocate memory ...\n");
+			LeaveCriticalSection(&ptrWad->Lock);
+			return false;
+		}
+
+		ptrWad->Entries = NewEntries;
+		ptrWad->EntryCapacity = NewCapacity;
+	}
+
+	if (WadGrowNames(ptrWad) == false)
+	{
+		LogPrint(LOG_ERROR, "Unable to allocate memory ...\n");
+		LeaveCriticalSection(&ptrWad->Lock);
+		return false;
+	}
+
+	memset(&Entry, 0x00, sizeof(Entry));
+	Entry.Offset = ptrWad->Offset;
+	Entry.DiskSize = LumpSize;
+	Entry.Size = LumpSize;
+	Entry.Type = WAD_TYPE_MIPTEX;
+	memcpy(Entry.Name, MipHeader.Name, sizeof(Entry.Name));
+
+	fseek(ptrWad->ptrFile, ptrWad->Offset, SEEK_SET);
+	if (fwrite(&MipHeader, sizeof(MipHeader), 1, ptrWad->ptrFile) != 1 ||
+		fwrite(ptrTexture->Bitmap, 1, PixelCount, ptrWad->ptrFile) != PixelCount ||
+		fwrite(Mips, 1, MipsSize, ptrWad->ptrFile) != MipsSize ||
+		fwrite(&ColorCount, sizeof(ColorCount), 1, ptrWad->ptrFile) != 1 ||
+		fwrite(ptrTexture->Palette, 1, _8BIT_PLTE_SZ * MDL_PLTE_ENTRY_SZ, ptrWad->ptrFile) != _8BIT_PLTE_SZ * MDL_PLTE_ENTRY_SZ ||
+		fwrite(Padding, 1, sizeof(Padding), ptrWad->ptrFile) != sizeof(Padding))
+	{
+		LogPrint(LOG_ERROR, "Error: can't write WAD lump: %s\n", MipHeader.Name);
+		Result = false;
+	}
+
+	// Broken lump is not listed, next one overwrites it
+	if (Result == true)
+	{
+		ptrWad->Entries[ptrWad->EntryCount] = Entry;
+		WadAddName(ptrWad, ptrWad->EntryCount++);
+		ptrWad->Offset += LumpSize;
+	}
+
+	LeaveCriticalSection(&ptrWad->Lock);
+
+	return Result;
+}
+
+bool WadClose(sWadFile * ptrWad)		// Write directory and finish WAD
+{
+	sWadHeader WadHeader;
+	bool Result = true;
+
+	if (ptrWad->ptrFile == NULL)
+		return true;
+
+	// Directory goes after the last lump
+	memcpy(WadHeader.Signature, "WAD3", 4);
+	WadHeader.LumpCount = ptrWad->EntryCount;
+	WadHeader.DirectoryOffset = ptrWad->Offset;
+	fseek(ptrWad->ptrFile, ptrWad->Offset, SEEK_SET);
+	if (ptrWad->EntryCount > 0 && fwrite(ptrWad->Entries, sizeof(sWadEntry), ptrWad->EntryCount, ptrWad->ptrFile) != ptrWad->EntryCount)
+		Result = false;
+	FileWriteBlock(&ptrWad->ptrFile, &WadHeader, 0, sizeof(WadHeader));
+	if (fclose(ptrWad->ptrFile) != 0)
+		Result = false;
+
+	if (Result == false)
+		LogPrint(LOG_ERROR, "Error: can't write WAD directory.\n");
+	else
+		LogPrint(LOG_RESULT, "WAD: %lu textures, %lu bytes\n", ptrWad->EntryCount, ptrWad->Offset + ptrWad->EntryCount * (ulong)sizeof(sWadEntry));
+
+	free(ptrWad->Entries);
+	free(ptrWad->NameHash);
+	DeleteCriticalSection(&ptrWad->Lock);
+	ptrWad->Initialize();
+
+	return Result;
+}
+
+bool WadNameTaken(sWadFile * ptrWad, const char * Name)		// Check if lump with this name is already in WAD
+{
+	if (ptrWad->NameHashSize == 0)
+		return false;
+
+	// Engine looks lumps up without case, hash ignores it too
+	for (ulong Slot = HashFileName(Name) & (ptrWad->NameHashSize - 1); ptrWad->NameHash[Slot] != 0; Slot = (Slot + 1) & (ptrWad->NameHashSize - 1))
+		if (!_strnicmp(ptrWad->Entries[ptrWad->NameHash[Slot] - 1].Name, Name, WAD_NAME_SZ))
+			return true;
+
+	return false;
+}
+
+bool WadGrowNames(sWadFile * ptrWad)		// Make room for one more name (table is rebuilt twice as large when it gets half full)
+{
+	if (ptrWad->EntryCount * 2 < ptrWad->NameHashSize)
+		return true;
+
+	ulong NewSize = (ptrWad->NameHashSize == 0) ? WAD_MIN_HASH_SZ : ptrWad->NameHashSize * 2;
+	ulong * NewHash = (ulong *)calloc(NewSize, sizeof(ulong));
+	if (NewHash == NULL)
+		return false;
+
+	free(ptrWad->NameHash);
+	ptrWad->NameHash = NewHash;
+	ptrWad->NameHashSize = NewSize;
+	for (ulong i = 0; i < ptrWad->EntryCount; i++)
+		WadAddName(ptrWad, i);
+
+	return true;
+}
+
+void WadAddName(sWadFile * ptrWad, ulong EntryIndex)		// Put lump into table of names
+{
+	ulong Slot = HashFileName(ptrWad->Entries[EntryIndex].Name) & (ptrWad->NameHashSize - 1);
+
+	while (ptrWad->NameHash[Slot] != 0)
+		Slot = (Slot + 1) & (ptrWad->NameHashSize - 1);
+	ptrWad->NameHash[Slot] = EntryIndex + 1;
+}
+
+void WadMakeMipLevel(const sTexture * ptrTexture, ulong Scale, uchar * DstBitmap)		// Shrink 8-bit texture, pixels are averaged and matched to palette
+{
+	ulong DstWidth = ptrTexture->Width / Scale;
+	ulong DstHeight = ptrTexture->Height / Scale;
+	const uchar * Palette = ptrTexture->Palette;
+
+	for (ulong DY = 0; DY < DstHeight; DY++)
+	{
+		for (ulong DX = 0; DX < DstWidth; DX++)
+		{
+			ulong Sum[3] = { 0, 0, 0 };
+
+			// Average color of the block
+			for (ulong Y = DY * Scale; Y < (DY + 1) * Scale; Y++)
+			{
+				const uchar * Line = &ptrTexture->Bitmap[Y * ptrTexture->Width];
+				for (ulong X = DX * Scale; X < (DX + 1) * Scale; X++)
+					for (int c = 0; c < 3; c++)
+						Sum[c] += Palette[Line[X] * MDL_PLTE_ENTRY_SZ + c];
+			}
+			for (int c = 0; c < 3; c++)
+				Sum[c] /= Scale * Scale;
+
+			// Nearest palette color
+			ulong Best = 0;
+			long BestDistance = 0x7FFFFFFF;
+			for (ulong i = 0; i < _8BIT_PLTE_SZ; i++)
+			{
+				long DR = (long)Palette[i * MDL_PLTE_ENTRY_SZ + 0] - (long)Sum[0];
+				long DG = (long)Palette[i * MDL_PLTE_ENTRY_SZ + 1] - (long)Sum[1];
+				long DB = (long)Palette[i * MDL_PLTE_ENTRY_SZ + 2] - (long)Sum[2];
+				long Distance = DR * DR + DG * DG + DB * DB;
+				if (Distance < BestDistance)
+				{
+					BestDistance = Distance;
+					Best = i;
+				}
+			}
+
+			DstBitmap[DY * DstWidth + DX] = (uchar)Best;
+		}
+	}
+}
@@ -40,13 +40,16 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <stdio.h>		// puts(), printf(), sscanf(), snprintf()
 #include <conio.h>		// _getch()
 #include <direct.h>		// _mkdir()
+#include <io.h>			// _chsize_s(), _fileno(), _isatty()
 #include <string.h>		// strcpy(), strcat(), strlen(), strtok(), strncpy()
 #include <malloc.h>		// malloc(), free()
 #include <stdlib.h>		// exit()
-#include <math.h>		// round()
+#include <stdarg.h>		// va_list, vprintf(), vsnprintf()
+#include <math.h>		// round(), sqrt(), log10(), pow()
 #include <ctype.h>		// tolower()
 #include <sys\stat.h>	// stat()
-#include <windows.h>	// CreateDitectoryA()
+#include <windows.h>	// CreateDitectoryA(), CopyFileA()
+#include <psapi.h>		// GetProcessMemoryInfo()
 
 ////////// Definitions //////////
 #define PROG_VERSION "0.93"
@@ -58,6 +61,30 @@ POSSIBILITY OF SUCH DAMAGE.
 #define SEQ_MODEL 2
 #define DUMMY_MODEL 3
 #define UNKNOWN_MODEL -1
+#define JOB_CONVERT 0
+#define JOB_EXTRACT 1
+#define JOB_SCAN 2
+#define JOB_THUMBS 3
+#define JOB_PVR 4
+#define JOB_VERIFY 5
+#define RESULT_OK 0				// Results of jobs (reported by batch, report and server)
+#define RESULT_WRONG_INPUT 1
+#define RESULT_BAD_MODEL 2
+#define RESULT_BAD_TEXTURE 3
+#define RESULT_IO_ERROR 4
+#define RESULT_NO_MEMORY 5
+#define RESULT_COUNT 6
+#define TEXTURE_BMP 0
+#define TEXTURE_PNG 1
+#define TEXTURE_TGA 2
+#define WATCH_DEBOUNCE_MS 200
+#define LOG_RESULT 0			// Message levels: results that were asked for (always printed), errors, progress of jobs, details of textures
+#define LOG_ERROR 1
+#define LOG_INFO 2
+#define LOG_DETAIL 3
+#define LogPrint(Level, ...) do { if ((Level) <= ProgOptions.LogLevel) LogWrite(__VA_ARGS__); } while (0)
+#define SERVE_PIPE_NAME "\\\\.\\pipe\\pvr2mdl"
+#define BENCH_MAX_PASSES 8		// Most thread counts that one benchmark can compare
 
 ////////// Typedefs //////////
 typedef unsigned short int ushort;
@@ -66,26 +93,241 @@ typedef unsigned int uint;
 typedef unsigned char uchar;
 
 ////////// Functions //////////
-ulong FileSize(FILE **ptrFile);																			// Get size of file
-void FileReadBlock(FILE **ptrSrcFile, void * DstBuff, ulong Addr, ulong Size);							// Read block from file to buffer
-void FileWriteBlock(FILE **ptrDstFile, void * SrcBuff, ulong Addr, ulong Size);							// Write data from buffer to file
-void FileWriteBlock(FILE **ptrDstFile, void * SrcBuff, ulong Size);										// Write data from buffer to file
-void SafeFileOpen(FILE **ptrFile, const char * FileName, char * Mode);									// Try to open file, if problem oocur then exit
-void FileGetExtension(const char * Path, char * OutputBuffer, uint OutputBufferSize);					// Get file extension
-void FileGetName(const char * Path, char * OutputBuffer, uint OutputBufferSize, bool WithExtension);	// Get name of file with or without extension
-void FileGetFullName(const char * Path, char * OutputBuffer, uint OutputBufferSize);					// Get full file name (with folders) without extension
-void FileGetPath(const char * Path, char * OutputBuffer, uint OutputBufferSize);						// Get file path
-bool CheckFile(char * FileName);																		// Check existance of file
-void GenerateFolders(char * cPath);																		// Make sure, that all folders in path are existing
-void PatchSlashes(char * cPathBuff, ulong BuffSize, bool SlashToBackslash);								// Patch slashes when transitioning between PAK and Windows file names
-bool CheckDir(const char * Path);																		// Check if path is directory
-void NewDir(const char * DirName);																		// Create directory
-void FileSafeRename(char * OldName, char * NewName);													// Raname file
+struct sJobQueue;																							// Declared below
+struct sQualityMetrics;																						// Declared below
+struct sTexture;																							// Declared below
+struct sWadFile;																							// Declared below
+ulong FileSize(FILE **ptrFile);																				// Get size of file
+void FileReadBlock(FILE **ptrSrcFile, void * DstBuff, ulong Addr, ulong Size);								// Read block from file to buffer
+void FileWriteBlock(FILE **ptrDstFile, void * SrcBuff, ulong Addr, ulong Size);								// Write data from buffer to file
+void FileWriteBlock(FILE **ptrDstFile, void * SrcBuff, ulong Size);											// Write data from buffer to file
+bool SafeFileOpen(FILE **ptrFile, const char * FileName, char * Mode);										// Try to open file, if problem occur then print error and return false
+bool SafeFileClose(FILE **ptrFile, const char * FileName);													// Close written file, if any write failed then print error, remove file and return false
+void FileGetExtension(const char * Path, char * OutputBuffer, uint OutputBufferSize);						// Get file extension
+void FileGetName(const char * Path, char * OutputBuffer, uint OutputBufferSize, bool WithExtension);		// Get name of file with or without extension
+void FileGetFullName(const char * Path, char * OutputBuffer, uint OutputBufferSize);						// Get full file name (with folders) without extension
+void FileGetPath(const char * Path, char * OutputBuffer, uint OutputBufferSize);							// Get file path
+bool FileMatchPattern(const char * Pattern, const char * Name);												// Check if name matches pattern with '*' and '?' wildcards
+bool CheckFile(char * FileName);																			// Check existance of file
+void GenerateFolders(const char * cPath);																	// Make sure, that all folders in path are existing
+void FileMirrorName(const char * Root, const char * Path, char * OutputBuffer, uint OutputBufferSize);		// Get name of file that mirrors Path inside Root folder
+bool FileCloneBlocks(const char * SrcName, const char * DstName);											// Make copy that shares data blocks with original (block cloning volumes only)
+bool FileCloneCopy(const char * SrcName, const char * DstName);												// Copy file, data blocks are shared with original where file system can do it
+bool FileAtomicReplace(const char * TempName, const char * NewName);										// Put complete temporary file in place of another file
+void PatchSlashes(char * cPathBuff, ulong BuffSize, bool SlashToBackslash);									// Patch slashes when transitioning between PAK and Windows file names
+bool CheckDir(const char * Path);																			// Check if path is directory
+void NewDir(const char * DirName);																			// Create directory
+void FileSafeRename(char * OldName, char * NewName);														// Raname file
+bool FileListAdd(char *** ptrFileNames, int * ptrFileCount, int * ptrCapacity, const char * FileName);		// Add copy of file name to growing list
+void FileListFolder(const char * FolderName, const char * Extension, char *** ptrFileNames, int * ptrFileCount, int * ptrCapacity);	// Add files with extension from folder and its subfolders to list
+void FileListFree(char ** FileNames, int FileCount);														// Free list of file names
+int CheckModel(const char * FileName);																		// Check model type
+int ProcessFile(int Job, const char * FileName);															// Check model and run job on it
+const char * GetJobName(int Job);																			// Get job name for reports and traces
+const char * GetResultName(int Result);																		// Get name of job result for reports and server replies
+void PauseProgram();																						// Wait for key press unless running unattended
+bool CheckPVRModel(const char * FileName);																	// Check if model has PVR textures
+HANDLE * StartWorkers(sJobQueue * ptrQueue);																// Start worker threads that take jobs from queue
+void StopWorkers(sJobQueue * ptrQueue, HANDLE * Workers);													// Close queue and wait until workers finish
+void WatchFolder(const char * FolderName);																	// Convert models that appear in folder
+void ServeModels(const char * PipeName);																	// Run conversion server on named pipe
+uint ProcessFiles(int Job, char ** FileNames, int FileCount);												// Run job on every file (in parallel when there are several files), returns number of failed jobs
+bool QueueJobs(sJobQueue * ptrQueue, int Job, char ** FileNames, int FileCount);							// Add job for every file to queue, largest first
+void DitherRGB565(const ushort * SrcImage, ushort * DstImage, ulong Width, ulong Height, ushort ShrinkMask);	// Ordered dithering of 16-bit image before color shrinking
+ulong ZlibCompress(const uchar * Src, ulong SrcSize, uchar * Dst);											// Compress data to zlib stream (fast mode), returns compressed size
+ulong ClusterColors(const ushort * Pixels, ulong PixelCount, ushort * Palette16, uchar * ColorMap, ulong TimeBudget);	// Build palette of up to 256 colors by median cut and k-means (ColorMap gets index for every RGB565 color)
+ulong DeflateBound(ulong SrcSize);																			// Maximal size of compressed data
+ulong UpdateCRC32(ulong CRC, const uchar * Data, ulong Size);												// Update CRC-32 (start from 0)
+void ExpandRGB565(const ushort * SrcImage, uchar * DstImage, ulong PixelCount, bool RGBAOrder);				// Convert 16-bit pixels to 32-bit BGRA (or RGBA)
+void DownscaleRGBA(const uchar * SrcImage, ulong SrcWidth, ulong SrcHeight, uchar * DstImage, ulong DstWidth, ulong DstHeight);	// Shrink 32-bit image with box filter
+void MeasureQuality(const ushort * SrcPixels, const uchar * Indices, const ushort * Palette16, ulong PixelCount, sQualityMetrics * ptrMetrics);	// Add difference between 16-bit pixels and their palette colors to metrics
+ulong QuantizeSmallTexture(const ushort * Texels, ulong PixelCount, bool AllowShrink, ushort * ColorSlots, uchar * Indices, uchar * Palette, sQualityMetrics * ptrMetrics);	// Convert texture of up to PVR_SMALL_PIXELS texels with exact palette or color shrinking (returns color count, 0 - other quantizer is needed)
+bool SavePNG(const char * FileName, const uchar * Bitmap, const uchar * Palette, ulong Width, ulong Height);	// Save 8-bit image with RGB palette (or 32-bit RGBA image if Palette == NULL) to *.png file
+bool SaveTGA(const char * FileName, const uchar * Bitmap, const uchar * Palette, ulong Width, ulong Height);	// Save 8-bit image with BGR palette (or 32-bit BGRA image if Palette == NULL) to RLE *.tga file
+void TraceInitialize();																						// Start recording spans
+long long TraceClock();																						// Get time for start of span (0 if tracing is off)
+void TraceSpan(const char * Name, long long Start, const char * Detail, ulong Width, ulong Height);			// Record stage that started at Start and ends now
+bool TraceSave(const char * FileName);																		// Write recorded spans to *.json file (call when workers are stopped)
+ulong HashFileName(const char * FileName);																	// Hash file name, so different spellings of the same path match
+int SelectShard(char ** FileNames, int FileCount);															// Keep only files of current shard in list, returns new file count
+bool ReportOpen(const char * FileName);																		// Start report of current run
+void ReportResult(int Job, const char * FileName, int Result);												// Add result of job to report
+void ReportQuality(const char * FileName, const sTexture * ptrTexture);										// Add quality metrics of converted texture to report
+void ReportClose();																							// Finish report of current run
+bool MergeReports(const char * OutFileName, char ** FileNames, int FileCount);								// Combine shard reports into one report
+bool PakOpen(const char * FileName, char ** InputNames, int InputCount);									// Start PAK output, results of jobs are redirected to staging folder
+bool PakAddFile(const char * FileName, const char * OutFileName);											// Move staged result into PAK (OutFileName is its name in output tree)
+bool PakClose();																							// Write directory and finish PAK
+bool WadOpen(sWadFile * ptrWad, const char * FileName);														// Create WAD, lumps are appended until WadClose()
+bool WadAddTexture(sWadFile * ptrWad, const sTexture * ptrTexture);											// Append 8-bit texture with its mip levels
+bool WadClose(sWadFile * ptrWad);																			// Write directory and finish WAD
+int VerifyModel(const char * FileName);																		// Check converted model (and compare its textures with source when it's asked)
+void LogStart();																							// Start background writer of batch and server messages
+void LogStop();																								// Write out remaining messages and stop background writer
+void LogWrite(const char * Format, ...);																	// Print message (queued for background writer while workers run)
+void LogBeginGroup();																						// Hold back messages of current thread until LogEndGroup(), so output of one model isn't mixed with others
+void LogEndGroup();																							// Let held back messages of current thread go out
+long long BenchClock();																						// Get time for benchmark (in microseconds)
+uint RunBenchmark(char ** FileNames, int FileCount);														// Measure convert and extract over corpus (generated one if there are no files), returns number of failures and regressions
 
 ////////// Structures //////////
 
+// Program options (set from command line)
+struct sProgOptions
+{
+	bool Dither;				// Dither 16-bit image when colors have to be shrinked
+	bool TrueColor;				// Extract PVR textures without conversion to 8-bit
+	bool Headless;				// Never wait for key presses
+	uint Threads;				// How many worker threads to use in batch modes
+	ulong MaxMemory;			// Memory budget of worker threads in batch modes (in MB, 0 - no limit)
+	int TextureFormat;			// Format of extracted textures (TEXTURE_BMP, TEXTURE_PNG, TEXTURE_TGA)
+	char OutFolder[MAX_PATH];	// Root of output tree that mirrors input (empty - results replace original files)
+	char TraceFile[MAX_PATH];	// Where to save timeline of processing stages (empty - no tracing)
+	char ReportFile[MAX_PATH];	// Where to save results of jobs (empty - no report)
+	uint ShardIndex;			// Which part of file list is processed by this run (counted from 0)
+	uint ShardCount;			// In how many parts file list is split between machines (0 or 1 - no splitting)
+	char ShardIndexFile[MAX_PATH];	// Sizes of input files shared by all machines (empty - files are split by name hash)
+	uint ThumbSize;				// Maximal width and height of texture previews (in pixels)
+	char PakFile[MAX_PATH];		// Where to pack results of all jobs (empty - results are separate files)
+	ulong TimeBudget;			// Time for clustering quantizer per texture (in ms, 0 - not set)
+	double QualityTarget;		// Lowest PSNR that color shrinking may give before clustering is used (in dB, 0 - not set)
+	bool Wad;					// Extract textures into one *.wad file per model instead of separate images
+	char WadFile[MAX_PATH];		// Where to put textures of whole batch (empty - WAD per model)
+	char TexturePattern[64];	// Which textures to extract: name pattern or number (empty - all textures)
+	bool ListTextures;			// Only print texture tables of models, nothing is decoded
+	bool VerifyPixels;			// Compare textures of verified models with PVR textures of their sources
+	int LogLevel;				// Most detailed level of messages that are printed (LOG_ERROR, LOG_INFO, LOG_DETAIL)
+	bool LogLevelSet;			// Level was given by --log (otherwise batch modes print less)
+	uint BenchThreads[BENCH_MAX_PASSES];	// Thread counts that benchmark runs with
+	uint BenchThreadCount;		// How many thread counts are set (0 - one thread and default thread count)
+	char BaselineFile[MAX_PATH];	// Benchmark results to compare with (empty - no comparison)
+	double MaxRegression;		// How much slower than baseline benchmark may get (in %)
+	double MaxGrowth;			// How much more memory and I/O calls than baseline benchmark may use (in %)
+
+	void Initialize()			// Set default options
+	{
+		SYSTEM_INFO SystemInfo;
+
+		// Use one worker per CPU by default
+		GetSystemInfo(&SystemInfo);
+
+		this->Dither = false;
+		this->TrueColor = false;
+		this->Headless = false;
+		this->Threads = SystemInfo.dwNumberOfProcessors;
+		this->MaxMemory = 0;
+		this->TextureFormat = TEXTURE_BMP;
+		this->OutFolder[0] = '\0';
+		this->TraceFile[0] = '\0';
+		this->ReportFile[0] = '\0';
+		this->ShardIndex = 0;
+		this->ShardCount = 0;
+		this->ShardIndexFile[0] = '\0';
+		this->ThumbSize = 64;
+		this->PakFile[0] = '\0';
+		this->TimeBudget = 0;
+		this->QualityTarget = 0.0;
+		this->Wad = false;
+		this->WadFile[0] = '\0';
+		this->TexturePattern[0] = '\0';
+		this->ListTextures = false;
+		this->VerifyPixels = false;
+		this->LogLevel = LOG_DETAIL;
+		this->LogLevelSet = false;
+		this->BenchThreadCount = 0;
+		this->BaselineFile[0] = '\0';
+		this->MaxRegression = 10.0;
+		this->MaxGrowth = 20.0;
+	}
+
+	bool SetShard(const char * Shard)	// Set shard from "i/N" string (i is counted from 1)
+	{
+		uint Index, Count;
+
+		if (sscanf(Shard, "%u/%u", &Index, &Count) != 2 || Index < 1 || Index > Count)
+			return false;
+
+		this->ShardIndex = Index - 1;
+		this->ShardCount = Count;
+
+		return true;
+	}
+
+	bool SetBenchThreads(const char * List)	// Set thread counts of benchmark from "1,2,8" string
+	{
+		uint Count = 0;
+
+		while (*List != '\0' && Count < BENCH_MAX_PASSES)
+		{
+			uint Threads;
+			int Length;
+
+			if (sscanf(List, "%u%n", &Threads, &Length) != 1 || Threads == 0)
+				return false;
+
+			this->BenchThreads[Count++] = Threads;
+			List += Length;
+
+			if (*List == ',')
+				List++;
+			else if (*List != '\0')
+				return false;
+		}
+
+		if (*List != '\0' || Count == 0)
+			return false;
+
+		this->BenchThreadCount = Count;
+
+		return true;
+	}
+
+	void SetLogLevel(int Level)	// Set most detailed level of printed messages
+	{
+		this->LogLevel = Level;
+		this->LogLevelSet = true;
+	}
+
+	void SetTexturePattern(const char * Pattern)	// Set which textures are extracted
+	{
+		strncpy(this->TexturePattern, Pattern, sizeof(this->TexturePattern) - 1);
+		this->TexturePattern[sizeof(this->TexturePattern) - 1] = '\0';
+	}
+
+	bool TextureSelected(const char * TextureName, int Index)	// Check if texture (Index is counted from 1) is selected by pattern
+	{
+		char Name[64];
+		char * End;
+
+		if (this->TexturePattern[0] == '\0')
+			return true;
+
+		// Number selects texture by its place in table
+		long Number = strtol(this->TexturePattern, &End, 10);
+		if (*End == '\0')
+			return Number == Index;
+
+		// Pattern can be given with or without extension
+		FileGetName(TextureName, Name, sizeof(Name), false);
+		return FileMatchPattern(this->TexturePattern, TextureName) || FileMatchPattern(this->TexturePattern, Name);
+	}
+
+	void SetShardIndex(const char * FileName)	// Set shared shard index
+	{
+		strncpy(this->ShardIndexFile, FileName, sizeof(this->ShardIndexFile) - 1);
+		this->ShardIndexFile[sizeof(this->ShardIndexFile) - 1] = '\0';
+	}
+
+	void SetOutFolder(const char * FolderName)	// Set root of output tree
+	{
+		strncpy(this->OutFolder, FolderName, sizeof(this->OutFolder) - 1);
+		this->OutFolder[sizeof(this->OutFolder) - 1] = '\0';
+	}
+};
+extern sProgOptions ProgOptions;
+
 // MDL model header
-#pragma pack(1)					// Eliminate unwanted 0x00 bytes
+#pragma pack(push, 1)				// Eliminate unwanted 0x00 bytes
 struct sModelHeader
 {
 	char Signature[4];			// "IDST"
@@ -142,9 +384,10 @@ struct sModelHeader
 		strcpy(this->Name, NewName);
 	}
 };
+#pragma pack(pop)
 
 // MDL texture table entry
-#pragma pack(1)					// Eliminate unwanted 0x00 bytes
+#pragma pack(push, 1)				// Eliminate unwanted 0x00 bytes
 struct sModelTextureEntry
 {
 	char Name[68];				// Texture name
@@ -169,9 +412,10 @@ struct sModelTextureEntry
 		this->Offset = NewOffset;
 	}
 };
+#pragma pack(pop)
 
 // 8-bit *.bmp header
-#pragma pack(1)				// Fix unwanted 0x00 bytes in structure
+#pragma pack(push, 1)			// Fix unwanted 0x00 bytes in structure
 struct sBMPHeader
 {
 	char Signature1[2];		// "BM" Signature
@@ -209,13 +453,95 @@ struct sBMPHeader
 		this->PixelDataSize = Height * Width;					// For this case it = Height * Width
 		this->FileSize = this->PixelDataSize + this->Offset;	// For this case it = PixelDataSize + Offset
 	}
+
+	void UpdateTrueColor(unsigned long int Width, unsigned long int Height)	// Update all fields of BMP header for 32-bit image
+	{
+		this->Update(Width, Height);
+		this->Offset = 0x00000036;				// No color table
+		this->BitsPerPixel = 0x0020;			// 32 bit BGRX bitmap
+		this->ColorTabSize = 0x00000000;		// No color table
+		this->ColorTabAlloc = 0x00000000;		//
+		this->PixelDataSize = Height * Width * 4;				// 4 bytes per pixel, no padding is needed
+		this->FileSize = this->PixelDataSize + this->Offset;	//
+	}
 };
+#pragma pack(pop)
+
+// 8-bit RLE *.tga header
+#pragma pack(push, 1)			// Fix unwanted 0x00 bytes in structure
+struct sTGAHeader
+{
+	uchar IDLength;			// Length of image ID field
+	uchar ColorMapType;		// 1 - image has color map
+	uchar ImageType;		// 9 - RLE color mapped image
+	ushort ColorMapStart;	// First color map entry
+	ushort ColorMapLength;	// How many colors are in color map
+	uchar ColorMapEntrySize;// Bits per color map entry
+	ushort XOrigin;			// Lower left corner of image
+	ushort YOrigin;			//
+	ushort Width;			// Picture Width (in pixels)
+	ushort Height;			// Picture Height (in pixels)
+	uchar BitsPerPixel;		// How many bits per 1 pixel
+	uchar Descriptor;		// Pixel order and alpha bits
+
+	void Update(ushort Width, ushort Height)		// Update all fields of TGA header
+	{
+		this->IDLength = 0;						// No image ID
+		this->ColorMapType = 1;					// Color map is present
+		this->ImageType = 9;					// RLE color mapped image
+		this->ColorMapStart = 0;				// Color map starts from first color
+		this->ColorMapLength = _8BIT_PLTE_SZ;	// 256 colors
+		this->ColorMapEntrySize = 24;			// BGR colors
+		this->XOrigin = 0;						// Not used
+		this->YOrigin = 0;						//
+		this->Width = Width;					// Picture Width (in pixels)
+		this->Height = Height;					// Picture Height (in pixels)
+		this->BitsPerPixel = 8;					// 8 bit palettized image
+		this->Descriptor = 0x20;				// Top to bottom pixel order (like in MDL), no alpha
+	}
+
+	void UpdateTrueColor(ushort Width, ushort Height)	// Update all fields of TGA header for 32-bit image
+	{
+		this->Update(Width, Height);
+		this->ColorMapType = 0;					// No color map
+		this->ImageType = 10;					// RLE true color image
+		this->ColorMapLength = 0;				//
+		this->ColorMapEntrySize = 0;			//
+		this->BitsPerPixel = 32;				// BGRA
+		this->Descriptor = 0x28;				// Top to bottom pixel order, 8 alpha bits
+	}
+};
+#pragma pack(pop)
 
 // PVR headers
 #define PVR_TWIDDLE	0x01
 #define PVR_VQ		0x03
 #define PVR_RECT	0x09
-#pragma pack(1)				// Fix unwanted 0x00 bytes in structure
+#define PVR_TWIDDLE_CHUNK	4096	// Twiddled texels that are read from file at once by fused decoder
+#define PVR_SMALL_PIXELS	1024	// Textures up to this size (32x32) are converted together with other small textures of model
+#define PVR_SMALL_SPAN		0x100000	// Largest part of model that is read at once for small textures
+
+// Quantizers
+#define QUANTIZER_EXACT		0	// Image has up to 256 colors, palette holds them all
+#define QUANTIZER_MASK		1	// Colors are shrinked with one of PVRShrinkMasks
+#define QUANTIZER_CLUSTER	2	// Palette is built by median cut and refined by k-means
+#define QUANTIZER_SAMPLES	16384	// How many pixels are looked at to choose quantizer
+#define QUANTIZER_SAMPLE_RUN	64	// Texels that are read at once when twiddled PVR is sampled (8x8 block)
+#define QUANTIZER_MAX_PASSES	8	// Most k-means passes of clustering quantizer
+#define QUANTIZER_CLUSTER_RATE	500000	// Pixel and color distance steps of clustering per ms (slow CPU, so estimate doesn't overrun budget)
+// Masks that shrink RGB565 colors step by step until image fits into 256 colors
+static const ushort PVRShrinkMasks[9] = {
+	0xFFFF,	// RGB565 (Full color set)
+	0xFFDF,	// RGB555
+	0xFFDE,	// RGB554
+	0xF7DE,	// RGB454
+	0xF79E,	// RGB444
+	0xF79C,	// RGB443
+	0xE79C,	// RGB343
+	0xE71C,	// RGB333
+	0xE718	// RGB332 (Forced 8-bit color set)
+};
+#pragma pack(push, 1)			// Fix unwanted 0x00 bytes in structure
 struct sPVRGlobalHeader
 {
 	ulong Signature;					// "GBIX" (0x58494247 in little endian)
@@ -233,9 +559,437 @@ struct sPVRImageHeader
 	ushort Width;						// Width
 	ushort Height;						// Height
 };
+#pragma pack(pop)
+
+// PVR texture of model that is waiting for conversion
+struct sPVRSource
+{
+	ulong FileOffset;					// Location of PVR headers
+	ulong DataOffset;					// Location of image data
+	sPVRImageHeader Header;				// Size and format of image
+	ulong BatchOffset;					// Location of result in buffer of small textures
+	bool Converted;						// Set when texture was converted by small texture batch
+};
+
+// Job for worker thread
+struct sJob
+{
+	int Job;					// What to do (JOB_CONVERT, JOB_EXTRACT, ...)
+	char FileName[MAX_PATH];	// Model file name
+	ulong Memory;				// Estimated peak memory use (in KB)
+};
+
+// Queue of jobs shared by worker threads
+struct sJobQueue
+{
+	sJob * Jobs;				// Ring buffer with queued jobs
+	uint Capacity;				// Size of ring buffer (in jobs)
+	uint First;					// Index of first queued job
+	uint Count;					// How many jobs are queued
+	bool Closed;				// Set when no more jobs would be added
+	bool LockFiles;				// Jobs of the same file wait for each other (file can be queued again while it's processed)
+	ulong MemoryBudget;			// How much memory running jobs may use together (in KB, 0 - no limit)
+	ulong MemoryInUse;			// Estimated memory use of running jobs (in KB)
+	uint Results[RESULT_COUNT];	// How many finished jobs got every result
+	long long * Latencies;		// Time of every finished job (in microseconds, NULL - not measured)
+	uint LatencyCapacity;		// Size of latency array
+	uint LatencyCount;			// How many times were recorded
+	CRITICAL_SECTION Lock;		// Protects all fields above
+	CONDITION_VARIABLE Changed;	// Signaled when job is added or queue is closed
+
+	void Initialize()			// Initialize structure
+	{
+		this->Jobs = NULL;
+		this->Capacity = 0;
+		this->First = 0;
+		this->Count = 0;
+		this->Closed = false;
+		this->LockFiles = false;
+		this->MemoryBudget = 0;
+		this->MemoryInUse = 0;
+		memset(this->Results, 0x00, sizeof(this->Results));
+		this->Latencies = NULL;
+		this->LatencyCapacity = 0;
+		this->LatencyCount = 0;
+		InitializeCriticalSection(&this->Lock);
+		InitializeConditionVariable(&this->Changed);
+	}
+
+	void Destroy()				// Free resources
+	{
+		DeleteCriticalSection(&this->Lock);
+		free(this->Jobs);
+		this->Jobs = NULL;
+	}
+
+	bool Push(int Job, const char * FileName, ulong Memory)	// Add job to the end of queue
+	{
+		EnterCriticalSection(&this->Lock);
+
+		// Grow ring buffer if it is full
+		if (this->Count == this->Capacity)
+		{
+			uint NewCapacity = (this->Capacity == 0) ? 64 : this->Capacity * 2;
+			sJob * NewJobs = (sJob *)malloc(NewCapacity * sizeof(sJob));
+			if (NewJobs == NULL)
+			{
+				LeaveCriticalSection(&this->Lock);
+				LogPrint(LOG_ERROR, "Unable to allocate memory ...\n");
+				return false;
+			}
+
+			// Unwrap queued jobs to the start of new buffer
+			for (uint i = 0; i < this->Count; i++)
+				NewJobs[i] = this->Jobs[(this->First + i) % this->Capacity];
+
+			free(this->Jobs);
+			this->Jobs = NewJobs;
+			this->Capacity = NewCapacity;
+			this->First = 0;
+		}
+
+		// Add job
+		sJob * ptrJob = &this->Jobs[(this->First + this->Count) % this->Capacity];
+		ptrJob->Job = Job;
+		strncpy(ptrJob->FileName, FileName, sizeof(ptrJob->FileName) - 1);
+		ptrJob->FileName[sizeof(ptrJob->FileName) - 1] = '\0';
+		ptrJob->Memory = Memory;
+		this->Count++;
+
+		LeaveCriticalSection(&this->Lock);
+		WakeConditionVariable(&this->Changed);
+
+		return true;
+	}
+
+	bool Pop(sJob * ptrJob)		// Take first job that fits memory budget, wait if there is none. Returns false when queue is closed and empty.
+	{
+		uint Index;
+
+		EnterCriticalSection(&this->Lock);
+
+		while (true)
+		{
+			Index = this->FindAdmissible();
+			if (Index < this->Count || (this->Count == 0 && this->Closed == true))
+				break;
+
+			SleepConditionVariableCS(&this->Changed, &this->Lock, INFINITE);
+		}
+
+		if (this->Count == 0)
+		{
+			LeaveCriticalSection(&this->Lock);
+			return false;
+		}
+
+		*ptrJob = this->Jobs[(this->First + Index) % this->Capacity];
+
+		// Close the gap by shifting jobs that were queued before taken one
+		for (uint i = Index; i > 0; i--)
+			this->Jobs[(this->First + i) % this->Capacity] = this->Jobs[(this->First + i - 1) % this->Capacity];
+		this->First = (this->First + 1) % this->Capacity;
+		this->Count--;
+
+		this->MemoryInUse += ptrJob->Memory;
+
+		LeaveCriticalSection(&this->Lock);
+
+		return true;
+	}
+
+	uint FindAdmissible()		// Find first queued job that fits memory budget (returns Count if there is none, call with Lock held)
+	{
+		for (uint i = 0; i < this->Count; i++)
+		{
+			ulong Memory = this->Jobs[(this->First + i) % this->Capacity].Memory;
+
+			// Job that doesn't fit whole budget is run when nothing else is running
+			if (this->MemoryBudget == 0 || this->MemoryInUse == 0 || this->MemoryInUse + Memory <= this->MemoryBudget)
+				return i;
+		}
+
+		return this->Count;
+	}
+
+	void Release(const sJob * ptrJob)	// Return memory of finished job to budget
+	{
+		EnterCriticalSection(&this->Lock);
+		this->MemoryInUse -= ptrJob->Memory;
+		LeaveCriticalSection(&this->Lock);
+		WakeAllConditionVariable(&this->Changed);
+	}
+
+	void CountResult(int Result)	// Add result of finished job to summary
+	{
+		if (Result < 0 || Result >= RESULT_COUNT)
+			return;
+
+		EnterCriticalSection(&this->Lock);
+		this->Results[Result]++;
+		LeaveCriticalSection(&this->Lock);
+	}
+
+	void AddLatency(long long Time)	// Record time of finished job (in microseconds)
+	{
+		EnterCriticalSection(&this->Lock);
+		if (this->LatencyCount < this->LatencyCapacity)
+			this->Latencies[this->LatencyCount++] = Time;
+		LeaveCriticalSection(&this->Lock);
+	}
+
+	bool Contains(const char * FileName)	// Check if job for file is waiting in queue
+	{
+		bool Result = false;
+
+		EnterCriticalSection(&this->Lock);
+
+		for (uint i = 0; i < this->Count; i++)
+		{
+			if (!strcmp(this->Jobs[(this->First + i) % this->Capacity].FileName, FileName))
+			{
+				Result = true;
+				break;
+			}
+		}
+
+		LeaveCriticalSection(&this->Lock);
+
+		return Result;
+	}
+
+	void Close()				// Let workers finish when queue runs empty
+	{
+		EnterCriticalSection(&this->Lock);
+		this->Closed = true;
+		LeaveCriticalSection(&this->Lock);
+		WakeAllConditionVariable(&this->Changed);
+	}
+};
+
+// Scratch buffers allocated by current thread (so worker can release them)
+struct sScratchBuffer;
+extern thread_local sScratchBuffer * ScratchBuffers;
+
+// Reusable memory block (grows on demand and is kept between textures)
+struct sScratchBuffer
+{
+	void * Data;				// Pointer to memory block
+	ulong Size;					// Size of memory block
+	bool Listed;				// Set when buffer is in list of thread's buffers
+	sScratchBuffer * Next;		// Next buffer of the same thread
+
+	void * Reserve(ulong NewSize)	// Get memory block that is at least NewSize bytes long
+	{
+		if (NewSize > this->Size)
+		{
+			free(this->Data);
+			this->Data = malloc(NewSize);
+			this->Size = (this->Data != NULL) ? NewSize : 0;
+
+			// Remember buffer, so thread can release it when it runs out of work
+			if (this->Listed == false && this->Data != NULL)
+			{
+				this->Next = ScratchBuffers;
+				ScratchBuffers = this;
+				this->Listed = true;
+			}
+		}
+
+		return this->Data;
+	}
+};
+
+// Difference between 16-bit PVR image and its 8-bit version
+struct sQualityMetrics
+{
+	unsigned long long SquaredError;	// Sum of squared channel differences (in 8-bit units)
+	ulong PixelCount;					// How many pixels were measured
+	ulong ChangedPixels;				// How many pixels got different color
+	float MaxDeltaE2;					// Largest squared CIE76 color difference
+
+	void Reset()				// Start new measurement
+	{
+		this->SquaredError = 0;
+		this->PixelCount = 0;
+		this->ChangedPixels = 0;
+		this->MaxDeltaE2 = 0.0f;
+	}
+
+	void GetPSNR(char * Buffer, ulong BufferSize) const	// Peak signal to noise ratio in dB ("inf" if colors are exact)
+	{
+		if (this->SquaredError == 0 || this->PixelCount == 0)
+		{
+			snprintf(Buffer, BufferSize, "inf");
+			return;
+		}
+
+		double MSE = (double)this->SquaredError / ((double)this->PixelCount * 3.0);
+		snprintf(Buffer, BufferSize, "%.2f", 10.0 * log10(255.0 * 255.0 / MSE));
+	}
+
+	double GetMaxDeltaE() const		// Largest color difference (2.3 is just noticeable)
+	{
+		return sqrt(this->MaxDeltaE2);
+	}
+
+	double GetChangedShare() const	// Share of pixels that got different color (in percent)
+	{
+		return (this->PixelCount != 0) ? this->ChangedPixels * 100.0 / this->PixelCount : 0.0;
+	}
+};
+
+// Colors of sampled pixels, used to pick quantizer before image is converted
+struct sColorEstimate
+{
+	ushort Colors[QUANTIZER_SAMPLES];			// Distinct sampled colors (Finish() must be called after samples, so color bits are left empty)
+	ulong ColorCount;
+	ulong Samples;								// How many pixels were sampled
+	bool Exact;									// Set when every pixel was sampled
+	ulong TierColors[9];						// Distinct colors after every shrink mask
+	unsigned long long TierError[9];			// Squared error of samples after every shrink mask (in 8-bit units)
+
+	static ulong * GetColorBits(int Set)		// One bit per RGB565 color, every user clears bits that it set
+	{
+		static thread_local ulong ColorBits[2][65536 / 32];
+		return ColorBits[Set];
+	}
+
+	void Reset()				// Start new estimate
+	{
+		memset(this->TierError, 0x00, sizeof(this->TierError));
+		this->ColorCount = 0;
+		this->Samples = 0;
+		this->Exact = true;
+	}
+
+	void AddSamples(const ushort * Pixels, ulong PixelCount, ulong Stride)	// Look at every Stride-th pixel
+	{
+		ulong * Seen = GetColorBits(0);
+
+		if (Stride > 1)
+			this->Exact = false;
+
+		for (ulong i = 0; i < PixelCount; i += Stride)
+		{
+			ushort Color = Pixels[i];
+			if ((Seen[Color >> 5] & (1UL << (Color & 31))) == 0 && this->ColorCount < QUANTIZER_SAMPLES)
+			{
+				Seen[Color >> 5] |= 1UL << (Color & 31);
+				this->Colors[this->ColorCount++] = Color;
+			}
+			this->Samples++;
+
+			// Error of every tier is known without converting image
+			for (int Tier = 1; Tier < 9; Tier++)
+			{
+				ushort Masked = Color & PVRShrinkMasks[Tier];
+				int DR = ((Color >> 11) - (Masked >> 11)) * 8;
+				int DG = (((Color >> 5) & 0x3F) - ((Masked >> 5) & 0x3F)) * 4;
+				int DB = ((Color & 0x1F) - (Masked & 0x1F)) * 8;
+				this->TierError[Tier] += DR * DR + DG * DG + DB * DB;
+			}
+		}
+	}
+
+	void Finish()				// Count distinct colors of every tier
+	{
+		ulong * Seen = GetColorBits(0);
+		ulong * Masked = GetColorBits(1);
+
+		// Only sampled colors are visited, bits are cleared the same way
+		this->TierColors[0] = this->ColorCount;
+		for (int Tier = 1; Tier < 9; Tier++)
+		{
+			this->TierColors[Tier] = 0;
+			for (ulong i = 0; i < this->ColorCount; i++)
+			{
+				ushort Shrinked = this->Colors[i] & PVRShrinkMasks[Tier];
+				if ((Masked[Shrinked >> 5] & (1UL << (Shrinked & 31))) == 0)
+				{
+					Masked[Shrinked >> 5] |= 1UL << (Shrinked & 31);
+					this->TierColors[Tier]++;
+				}
+			}
+			for (ulong i = 0; i < this->ColorCount; i++)
+				Masked[(this->Colors[i] & PVRShrinkMasks[Tier]) >> 5] = 0;
+		}
+
+		for (ulong i = 0; i < this->ColorCount; i++)
+			Seen[this->Colors[i] >> 5] = 0;
+	}
+
+	ulong GetClusterTime(ulong PixelCount)		// Guess how long clustering of image takes (in ms)
+	{
+		// Sampled colors are scaled up like every pixel could bring new one, so guess is rather too long than too short
+		unsigned long long Colors = this->ColorCount;
+		if (this->Exact == false && this->Samples > 0)
+			Colors = Colors * PixelCount / this->Samples;
+		if (Colors > PixelCount)
+			Colors = PixelCount;
+		if (Colors > 65536)
+			Colors = 65536;
+
+		// Histogram, color list, median cut (8 splits deep) and first mapping of every color to 256 palette colors
+		unsigned long long Steps = PixelCount + 65536 + Colors * 8 + Colors * 256;
+		return (ulong)(Steps / QUANTIZER_CLUSTER_RATE);
+	}
+
+	int ChooseQuantizer(uchar * ptrStartTier, ulong PixelCount)	// Pick quantizer from options and estimate (sampled counts are lower bounds, so mask quantizer may still shrink further)
+	{
+		uchar Tier = 0;
+		while (Tier < 8 && this->TierColors[Tier] > 256)
+			Tier++;
+
+		*ptrStartTier = Tier;
+
+		if (Tier == 0)
+			return QUANTIZER_EXACT;
+
+		// Clustering is used when shrinking loses too much
+		if (ProgOptions.QualityTarget > 0.0)
+		{
+			double MSE = (double)this->TierError[Tier] / ((double)this->Samples * 3.0);
+			if (MSE > 0.0 && 10.0 * log10(255.0 * 255.0 / MSE) < ProgOptions.QualityTarget)
+				return QUANTIZER_CLUSTER;
+
+			return QUANTIZER_MASK;
+		}
+
+		// Or when it fits into time budget, otherwise the cheapest quantizer is taken
+		if (ProgOptions.TimeBudget > 0 && GetClusterTime(PixelCount) < ProgOptions.TimeBudget)
+			return QUANTIZER_CLUSTER;
+
+		return QUANTIZER_MASK;
+	}
+};
+
+// WAD3 file that is being written (textures are appended by workers, directory is written at the end)
+struct sWadFile
+{
+	FILE * ptrFile;				// NULL - WAD is not open
+	CRITICAL_SECTION Lock;		// Workers append textures one at a time
+	struct sWadEntry * Entries;	// Directory of lumps
+	ulong EntryCount;
+	ulong EntryCapacity;
+	ulong Offset;				// Where next lump goes
+	ulong * NameHash;			// Open addressing table of entry numbers + 1 (0 - free slot), so names are checked without directory scan
+	ulong NameHashSize;
+
+	void Initialize()			// Set empty WAD
+	{
+		this->ptrFile = NULL;
+		this->Entries = NULL;
+		this->EntryCount = 0;
+		this->EntryCapacity = 0;
+		this->Offset = 0;
+		this->NameHash = NULL;
+		this->NameHashSize = 0;
+	}
+};
+extern sWadFile BatchWad;
 
 // Model texture data
-#pragma pack(1)					// Eliminate unwanted 0x00 bytes
 struct sTexture
 {
 	char Name[64];				// Texture name
@@ -244,6 +998,7 @@ struct sTexture
 	uchar * Palette;			// Texture palette
 	ulong PaletteSize;			// Texture palette size
 	uchar * Bitmap;				// Pointer to bitmap
+	sQualityMetrics Quality;	// How close 8-bit version is to PVR original (set by UpdateFromPVR)
 	
 	void Initialize()			// Initialize structure
 	{
@@ -253,9 +1008,10 @@ struct sTexture
 		this->Palette = NULL;
 		this->PaletteSize = 0;
 		this->Bitmap = NULL;
+		this->Quality.Reset();
 	}
 
-	void UpdateFromFile(FILE ** ptrFile, ulong FileBitmapOffset, ulong FileBitmapSize, ulong FilePaletteOffset, ulong FilePaletteSize, const char * NewName, ulong NewWidth, ulong NewHeight)	// Update from file
+	bool UpdateFromFile(FILE ** ptrFile, ulong FileBitmapOffset, ulong FileBitmapSize, ulong FilePaletteOffset, ulong FilePaletteSize, const char * NewName, ulong NewWidth, ulong NewHeight)	// Update from file
 	{
 		// Destroy old palette and bitmap
 		free(Palette);
@@ -266,9 +1022,9 @@ struct sTexture
 		Bitmap = (uchar *) malloc(FileBitmapSize);
 		if (Palette == NULL || Bitmap == NULL)
 		{
-			puts("Unable to allocate memory ...");
-			_getch();
-			exit(EXIT_FAILURE);
+			LogPrint(LOG_ERROR, "Unable to allocate memory ...\n");
+			this->Free();
+			return false;
 		}
 
 		// Copy data from file to memory
@@ -280,9 +1036,11 @@ struct sTexture
 		this->Width = NewWidth;
 		this->Height = NewHeight;
 		this->PaletteSize = FilePaletteSize;
+
+		return true;
 	}
 
-	void FlipBitmap()		// Flip bitmap vertically. Needed for DOL\MDL to BMP conversion and vice versa.
+	bool FlipBitmap()		// Flip bitmap vertically. Needed for DOL\MDL to BMP conversion and vice versa.
 	{
 		char * NewBitmap;
 
@@ -290,9 +1048,8 @@ struct sTexture
 		NewBitmap = (char *)malloc(this->Width * this->Height);
 		if (NewBitmap == NULL)
 		{
-			puts("Unable to allocate memory!");
-			_getch();
-			exit(EXIT_FAILURE);
+			LogPrint(LOG_ERROR, "Unable to allocate memory!\n");
+			return false;
 		}
 
 		// Copy flipped bitmap to new place
@@ -305,9 +1062,11 @@ struct sTexture
 
 		// Save pointer to new bitmap
 		this->Bitmap = (uchar *) NewBitmap;
+
+		return true;
 	}
 
-	void PaletteAddSpacers(char Spacer)		// Convert palette to DOL\BMP format
+	bool PaletteAddSpacers(char Spacer)		// Convert palette to DOL\BMP format
 	{
 		char * NewPalette;
 		ulong NewPaletteSize = _8BIT_PLTE_SZ * BMP_PLTE_ENTRY_SZ;
@@ -318,9 +1077,8 @@ struct sTexture
 			NewPalette = (char *)malloc(NewPaletteSize);
 			if (NewPalette == NULL)
 			{
-				puts("Unable to allocate memory!");
-				_getch();
-				exit(EXIT_FAILURE);
+				LogPrint(LOG_ERROR, "Unable to allocate memory!\n");
+				return false;
 			}
 
 			// Copy palette with spacers to new place
@@ -348,6 +1106,8 @@ struct sTexture
 			// Update size
 			this->PaletteSize = NewPaletteSize;
 		}
+
+		return true;
 	}
 
 	void PaletteSwapRedAndGreen(int ElementSize)		// Needed for MDL/DOL to BMP conversion and vice versa.
@@ -362,66 +1122,103 @@ struct sTexture
 		}
 	}
 
-	bool UpdateFromPVR(FILE ** ptrFile, ulong FileOffset, const char * NewName)
+	void Free()					// Destroy palette and bitmap
+	{
+		free(this->Palette);
+		free(this->Bitmap);
+		this->Palette = NULL;
+		this->Bitmap = NULL;
+	}
+
+	bool LoadPVRHeader(FILE ** ptrFile, ulong FileOffset, sPVRImageHeader * ptrImageHeader, ulong * ptrDataOffset)	// Load and check PVR headers without decoding image
 	{
 		ulong Offset = FileOffset;
 		sPVRGlobalHeader PVRGlobalHeader;
-		sPVRImageHeader PVRImageHeader;
-		ulong DirectImageSz = 0;
-		ushort * DirectImage;
 
-		puts("Analyzing PVR headers ...");
-
-		// Load first header and check
+		// Load first header and check (loose *.pvr files may start right from image header)
 		FileReadBlock(ptrFile, &PVRGlobalHeader, Offset, sizeof(PVRGlobalHeader));
-		if (PVRGlobalHeader.Signature != 0x58494247)
+		if (PVRGlobalHeader.Signature == 0x58494247)
 		{
-			puts("Can't recognise global header ...");
+			Offset += sizeof(PVRGlobalHeader.Signature) + sizeof(PVRGlobalHeader.ImageHeaderOffset) + PVRGlobalHeader.ImageHeaderOffset;
+		}
+		else if (PVRGlobalHeader.Signature != 0x54525650)
+		{
+			LogPrint(LOG_ERROR, "Can't recognise global header ...\n");
 			return false;
 		}
 
 		// Load second header and check
-		Offset += sizeof(PVRGlobalHeader.Signature) + sizeof(PVRGlobalHeader.ImageHeaderOffset) + PVRGlobalHeader.ImageHeaderOffset;
-		FileReadBlock(ptrFile, &PVRImageHeader, Offset, sizeof(PVRImageHeader));
-		if (PVRImageHeader.Signature != 0x54525650)
+		FileReadBlock(ptrFile, ptrImageHeader, Offset, sizeof(sPVRImageHeader));
+		if (ptrImageHeader->Signature != 0x54525650)
 		{
-			puts("Can't recognise image header ...");
+			LogPrint(LOG_ERROR, "Can't recognise image header ...\n");
 			return false;
 		}
 
-		// Output some info
-		printf("PVR image:\n Width: %d, Height: %d\n Color type: 0x%X, Image type: 0x%X\n",
-			PVRImageHeader.Width,
-			PVRImageHeader.Height,
-			PVRImageHeader.ColorFormat,
-			PVRImageHeader.ImageFormat);
-
-		if (PVRImageHeader.ColorFormat != 0x01)
+		if (ptrImageHeader->ColorFormat != 0x01)
 		{
-			puts("Unsupported color format ...");
+			LogPrint(LOG_ERROR, "Unsupported color format ...\n");
 			return false;
 		}
 
-		if (PVRImageHeader.ImageFormat != PVR_TWIDDLE &&
-			PVRImageHeader.ImageFormat != PVR_VQ &&
-			PVRImageHeader.ImageFormat != PVR_RECT)
+		if (ptrImageHeader->ImageFormat != PVR_TWIDDLE &&
+			ptrImageHeader->ImageFormat != PVR_VQ &&
+			ptrImageHeader->ImageFormat != PVR_RECT)
 		{
-			puts("Unsupported image format ...");
+			LogPrint(LOG_ERROR, "Unsupported image format ...\n");
 			return false;
 		}
 
+		// Image data follows image header
+		*ptrDataOffset = Offset + sizeof(sPVRImageHeader);
+
+		return true;
+	}
+
+	ushort * LoadPVRImage(FILE ** ptrFile, ulong FileOffset, sPVRImageHeader * ptrImageHeader)	// Decode PVR to 16-bit direct color image (buffer is reused by next call from the same thread)
+	{
+		ulong Offset;
+		sPVRImageHeader PVRImageHeader;
+		ulong DirectImageSz = 0;
+		ushort * DirectImage;
+
+		// Decoding buffers are kept per thread, so they stay warm between textures
+		static thread_local sScratchBuffer DirectScratch = { NULL, 0 };		// 16-bit direct color image
+		static thread_local sScratchBuffer SourceScratch = { NULL, 0 };		// Twiddled or VQ data from file
+
+		LogPrint(LOG_DETAIL, "Analyzing PVR headers ...\n");
+
+		// Load and check headers
+		long long TraceStart = TraceClock();
+		if (LoadPVRHeader(ptrFile, FileOffset, &PVRImageHeader, &Offset) == false)
+			return NULL;
+		TraceSpan("pvr parse", TraceStart, this->Name, PVRImageHeader.Width, PVRImageHeader.Height);
+
+		// Output some info
+		LogPrint(LOG_DETAIL, "PVR image:\n Width: %d, Height: %d\n Color type: 0x%X, Image type: 0x%X\n",
+			PVRImageHeader.Width,
+			PVRImageHeader.Height,
+			PVRImageHeader.ColorFormat,
+			PVRImageHeader.ImageFormat);
+
 		// Allocate space for 16-bit direct color image
 		DirectImageSz = PVRImageHeader.Width * PVRImageHeader.Height * 2;
-		DirectImage = (ushort *)malloc(DirectImageSz);
+		DirectImage = (ushort *)DirectScratch.Reserve(DirectImageSz);
+		if (DirectImage == NULL)
+		{
+			LogPrint(LOG_ERROR, "Memory allocation failure!\n");
+			return NULL;
+		}
 
-		puts("Loading PVR image ...");
+		LogPrint(LOG_DETAIL, "Loading PVR image ...\n");
 
 		// Read 16-bit direct color image
-		Offset += sizeof(sPVRImageHeader);
 		if (PVRImageHeader.ImageFormat == PVR_RECT)
 		{
 			// Normal image
+			TraceStart = TraceClock();
 			FileReadBlock(ptrFile, DirectImage, Offset, DirectImageSz);
+			TraceSpan("read", TraceStart, this->Name, PVRImageHeader.Width, PVRImageHeader.Height);
 		}
 		else if (PVRImageHeader.ImageFormat == PVR_TWIDDLE)
 		{
@@ -429,23 +1226,19 @@ struct sTexture
 			ushort * TwiddledBitmap;
 
 			// Allocate memory
-			TwiddledBitmap = (ushort *)malloc(DirectImageSz);
+			TwiddledBitmap = (ushort *)SourceScratch.Reserve(DirectImageSz);
 			if (TwiddledBitmap == NULL)
 			{
-				puts("Memory allocation faiure!");
-				return false;
+				LogPrint(LOG_ERROR, "Memory allocation faiure!\n");
+				return NULL;
 			}
 
 			// Read image
+			TraceStart = TraceClock();
 			FileReadBlock(ptrFile, TwiddledBitmap, Offset, DirectImageSz);
+			TraceSpan("read", TraceStart, this->Name, PVRImageHeader.Width, PVRImageHeader.Height);
 
-			// Untwiddle
-			for (ushort Y = 0; Y < PVRImageHeader.Height; Y++)
-				for (ushort X = 0; X < PVRImageHeader.Width; X++)
-					DirectImage[Y * PVRImageHeader.Width + X] = TwiddledBitmap[TwiddleToLinear(X, Y)];
-
-			// Free memory
-			free(TwiddledBitmap);
+			DecodePVRData((uchar *)TwiddledBitmap, &PVRImageHeader, DirectImage);
 		}
 		else if (PVRImageHeader.ImageFormat == PVR_VQ)
 		{
@@ -456,22 +1249,62 @@ struct sTexture
 			ushort VQWidth = PVRImageHeader.Width >> 1;
 			ushort VQHieght = PVRImageHeader.Height >> 1;
 
-			// Allocate memory
-			Codebook = (uchar *)malloc(CodebookSz);
-			VQBitmap = (uchar *)malloc(VQWidth * VQHieght);
-			if (Codebook == NULL || VQBitmap == NULL)
+			// Allocate memory (codebook is followed by VQ bitmap)
+			Codebook = (uchar *)SourceScratch.Reserve(CodebookSz + VQWidth * VQHieght);
+			if (Codebook == NULL)
 			{
-				puts("Memory allocation faiure!");
-				return false;
+				LogPrint(LOG_ERROR, "Memory allocation faiure!\n");
+				return NULL;
 			}
+			VQBitmap = Codebook + CodebookSz;
 
 			// Read codebook and VQ bitmap
+			TraceStart = TraceClock();
 			FileReadBlock(ptrFile, Codebook, Offset, CodebookSz);
 			Offset += CodebookSz;
 			FileReadBlock(ptrFile, VQBitmap, Offset, VQWidth * VQHieght);
+			TraceSpan("read", TraceStart, this->Name, PVRImageHeader.Width, PVRImageHeader.Height);
+
+			DecodePVRData(Codebook, &PVRImageHeader, DirectImage);
+		}
+
+		*ptrImageHeader = PVRImageHeader;
+
+		return DirectImage;
+	}
+
+	void DecodePVRData(const uchar * Source, const sPVRImageHeader * ptrImageHeader, ushort * DirectImage)	// Decode PVR image data that is already in memory to 16-bit direct color image
+	{
+		ushort Width = ptrImageHeader->Width;
+		ushort Height = ptrImageHeader->Height;
+		long long TraceStart = TraceClock();
+
+		if (ptrImageHeader->ImageFormat == PVR_RECT)
+		{
+			// Normal image
+			memcpy(DirectImage, Source, Width * Height * 2);
+		}
+		else if (ptrImageHeader->ImageFormat == PVR_TWIDDLE)
+		{
+			// Twiddled image
+			const ushort * TwiddledBitmap = (const ushort *)Source;
+
+			for (ushort Y = 0; Y < Height; Y++)
+				for (ushort X = 0; X < Width; X++)
+					DirectImage[Y * Width + X] = TwiddledBitmap[TwiddleToLinear(X, Y)];
+			TraceSpan("untwiddle", TraceStart, this->Name, Width, Height);
+		}
+		else if (ptrImageHeader->ImageFormat == PVR_VQ)
+		{
+			// VQ image (codebook is followed by VQ bitmap)
+			const uchar * Codebook = Source;
+			ushort CodebookSz = 0x800;
+			const uchar * VQBitmap = Codebook + CodebookSz;
+			ushort VQWidth = Width >> 1;
+			ushort VQHieght = Height >> 1;
 
 			// Reconstruct full 16-bit bitmap
-			ushort * CodebookEntry;
+			const ushort * CodebookEntry;
 			uchar CodeBookEntrySz = 0x08;
 			for (uint VY = 0; VY < VQHieght; VY++)
 			{
@@ -481,59 +1314,122 @@ struct sTexture
 					uchar VQIndex = VQBitmap[TwiddleToLinear(VX, VY)];
 
 					// Set pointer to codebook entry (texel)
-					CodebookEntry = (ushort *)&Codebook[VQIndex * CodeBookEntrySz];
+					CodebookEntry = (const ushort *)&Codebook[VQIndex * CodeBookEntrySz];
 
 					// Write texel from codebook to full bitmap
-					DirectImage[(VY << 1) * PVRImageHeader.Width + (VX << 1)] = *(CodebookEntry + 0);				// Upper left
-					DirectImage[(VY << 1) * PVRImageHeader.Width + (VX << 1) + 1] = *(CodebookEntry + 2);			// Uper right
-					DirectImage[((VY << 1) + 1) * PVRImageHeader.Width + (VX << 1)] = *(CodebookEntry + 1);			// Bottom left
-					DirectImage[((VY << 1) + 1) * PVRImageHeader.Width + (VX << 1) + 1] = *(CodebookEntry + 3);		// Bototm right
+					DirectImage[(VY << 1) * Width + (VX << 1)] = *(CodebookEntry + 0);				// Upper left
+					DirectImage[(VY << 1) * Width + (VX << 1) + 1] = *(CodebookEntry + 2);			// Uper right
+					DirectImage[((VY << 1) + 1) * Width + (VX << 1)] = *(CodebookEntry + 1);			// Bottom left
+					DirectImage[((VY << 1) + 1) * Width + (VX << 1) + 1] = *(CodebookEntry + 3);		// Bototm right
 				}
 			}
-
-			// Free memory
-			free(Codebook);
-			free(VQBitmap);
+			TraceSpan("vq decode", TraceStart, this->Name, Width, Height);
 		}
+	}
 
-		// Destroy old palette and bitmap
-		if (Palette != NULL)
-			free(Palette);
-		if (Bitmap != NULL)
-			free(Bitmap);
+	ulong PVRDataSize(const sPVRImageHeader * ptrImageHeader)	// Size of image data that follows PVR image header
+	{
+		if (ptrImageHeader->ImageFormat == PVR_VQ)
+			return 0x800 + (ptrImageHeader->Width >> 1) * (ptrImageHeader->Height >> 1);
 
-		// Update properties
+		return ptrImageHeader->Width * ptrImageHeader->Height * 2;
+	}
+
+	bool IsFusedPVR(const sPVRImageHeader * ptrImageHeader)	// Check if PVR is quantized right in its twiddled order (square twiddled image, no dithering)
+	{
+		return (ptrImageHeader->ImageFormat == PVR_TWIDDLE &&
+			ptrImageHeader->Width == ptrImageHeader->Height &&
+			(ptrImageHeader->Width & (ptrImageHeader->Width - 1)) == 0 &&
+			ProgOptions.Dither == false);
+	}
+
+	int UpdateFromPVR(FILE ** ptrFile, ulong FileOffset, const char * NewName)	// Convert PVR texture to 8-bit (returns result of job, so lack of memory isn't blamed on texture)
+	{
+		sPVRImageHeader PVRImageHeader;
+		ulong DirectImageSz = 0;
+		ushort * DirectImage;
+
+		ulong Offset;
+		sColorEstimate Estimate;
+		uchar ShrinkTier = 0;
+
+		static thread_local sScratchBuffer DitherScratch = { NULL, 0 };		// Dithered 16-bit image
+
+		// Name is set first, so it can be seen in trace
 		strcpy(this->Name, NewName);
-		this->Height = PVRImageHeader.Height;
-		this->Width = PVRImageHeader.Width;
-		this->PaletteSize = _8BIT_PLTE_SZ * MDL_PLTE_ENTRY_SZ;
 
-		// Allocate new palette and bitmap
-		this->Palette = (uchar *)malloc(this->PaletteSize);
-		this->Bitmap = (uchar *)malloc(this->Width * this->Height);
-		if (this->Palette == NULL || this->Bitmap == NULL)
+		// Square twiddled textures are quantized right from file data (dithering needs linear image, so it takes long way)
+		if (LoadPVRHeader(ptrFile, FileOffset, &PVRImageHeader, &Offset) == false)
+			return RESULT_BAD_TEXTURE;
+		bool Fused = IsFusedPVR(&PVRImageHeader);
+		ulong PixelCount = PVRImageHeader.Width * PVRImageHeader.Height;
+
+		// Look at part of pixels first, so easy textures take the cheapest path and hard ones don't retry
+		DirectImage = NULL;
+		Estimate.Reset();
+		if (Fused == true)
 		{
-			puts("Memory allocation failure!");
-			return false;
+			LogPrint(LOG_DETAIL, "PVR image:\n Width: %d, Height: %d\n Color type: 0x%X, Image type: 0x%X\n",
+				PVRImageHeader.Width,
+				PVRImageHeader.Height,
+				PVRImageHeader.ColorFormat,
+				PVRImageHeader.ImageFormat);
+
+			EstimateTwiddledPVR(ptrFile, Offset, PixelCount, &Estimate);
+		}
+		else
+		{
+			// Headers are already checked, only allocation can fail
+			DirectImage = LoadPVRImage(ptrFile, FileOffset, &PVRImageHeader);
+			if (DirectImage == NULL)
+				return RESULT_NO_MEMORY;
+
+			long long EstimateStart = TraceClock();
+			Estimate.AddSamples(DirectImage, PixelCount, (PixelCount + QUANTIZER_SAMPLES - 1) / QUANTIZER_SAMPLES);
+			TraceSpan("estimate", EstimateStart, this->Name, PVRImageHeader.Width, PVRImageHeader.Height);
 		}
+		Estimate.Finish();
+		int Quantizer = Estimate.ChooseQuantizer(&ShrinkTier, PixelCount);
+
+		if (Quantizer == QUANTIZER_EXACT)
+			LogPrint(LOG_DETAIL, "Quantizer: exact palette (%lu colors%s)\n", Estimate.TierColors[0], (Estimate.Exact == true) ? "" : " in samples");
+		else if (Quantizer == QUANTIZER_MASK)
+			LogPrint(LOG_DETAIL, "Quantizer: color shrinking, tier %u (%lu colors%s)\n", ShrinkTier, Estimate.TierColors[ShrinkTier], (Estimate.Exact == true) ? "" : " in samples");
+		else
+			LogPrint(LOG_DETAIL, "Quantizer: clustering (%lu colors%s)\n", Estimate.TierColors[0], (Estimate.Exact == true) ? "" : " in samples");
+
+		// Dithering changes colors before they are counted, so it starts from full color set
+		if (ProgOptions.Dither == true)
+			ShrinkTier = 0;
+
+		// Quantizers below fail only when memory runs out
+		if (Fused == true && Quantizer != QUANTIZER_CLUSTER)
+			return (UpdateFromTwiddledPVR(ptrFile, Offset, &PVRImageHeader, ShrinkTier) == true) ? RESULT_OK : RESULT_NO_MEMORY;
+
+		// Decode image
+		if (DirectImage == NULL)
+		{
+			DirectImage = LoadPVRImage(ptrFile, FileOffset, &PVRImageHeader);
+			if (DirectImage == NULL)
+				return RESULT_NO_MEMORY;
+		}
+		DirectImageSz = PixelCount * 2;
+
+		if (AllocateIndexed(PVRImageHeader.Width, PVRImageHeader.Height) == false)
+			return RESULT_NO_MEMORY;
+
+		if (Quantizer == QUANTIZER_CLUSTER)
+			return (QuantizeClusters(DirectImage) == true) ? RESULT_OK : RESULT_NO_MEMORY;
 
-		puts("Converting to 8-bit indexed format ...");
+		LogPrint(LOG_DETAIL, "Converting to 8-bit indexed format ...\n");
+		long long TraceStart = TraceClock();
 
 		// Fetch colors
 		ushort Palette16[256];	// Temporary 16-bit palette
-		uchar ShrinkTier = 0;
-		ushort ShrinkMasks[9] = {
-			0xFFFF,	// RGB565 (Full color set)
-			0xFFDF,	// RGB555
-			0xFFDE,	// RGB554
-			0xF7DE,	// RGB454
-			0xF79E,	// RGB444
-			0xF79C,	// RGB443
-			0xE79C,	// RGB343
-			0xE71C,	// RGB333
-			0xE718	// RGB332 (Forced 8-bit color set)
-		};
 		ushort ColorCount = 0;
+		ushort * SourceImage = DirectImage;		// Image that colors are fetched from
+		ushort * DitheredImage = NULL;			// Dithered copy of direct color image
+		sQualityMetrics Quality;				// Collected here and copied to texture when it's done
 		bool Complete = false;
 		while (Complete == false)
 		{
@@ -544,9 +1440,29 @@ struct sTexture
 			memset(this->Palette, 0x00, this->PaletteSize);
 			memset(Palette16, 0x00, sizeof(Palette16));
 			ColorCount = 0;
+			Quality.Reset();
 
 			// Get next color shrink mask
-			ushort ShrinkMask = ShrinkMasks[ShrinkTier];
+			ushort ShrinkMask = PVRShrinkMasks[ShrinkTier];
+
+			// Add ordered (4x4 Bayer) threshold pattern before shrinking, so gradients turn into patterns instead of bands
+			if (ShrinkTier != 0 && ProgOptions.Dither == true)
+			{
+				if (DitheredImage == NULL)
+				{
+					DitheredImage = (ushort *)DitherScratch.Reserve(DirectImageSz);
+					if (DitheredImage == NULL)
+					{
+						LogPrint(LOG_ERROR, "Memory allocation failure!\n");
+						return RESULT_NO_MEMORY;
+					}
+				}
+
+				long long DitherStart = TraceClock();
+				DitherRGB565(DirectImage, DitheredImage, this->Width, this->Height, ShrinkMask);
+				TraceSpan("dither", DitherStart, this->Name, this->Width, this->Height);
+				SourceImage = DitheredImage;
+			}
 
 			// Process image
 			for (uint Y = 0; Y < this->Height; Y++)
@@ -558,76 +1474,284 @@ struct sTexture
 				{
 					// Get color of the next pixel
 					ulong CurrentPixel = LineOffset + X;
-					ushort CurrentColor = DirectImage[CurrentPixel];
+					ushort CurrentColor = SourceImage[CurrentPixel];
 
 					// Apply mask
 					if (ShrinkTier != 0)
 						CurrentColor &= ShrinkMask;
 
-					// Check if color is present in the palette
-					bool IsPresent = false;
-					ushort ColorIndex;
-					for (ColorIndex = 0; ColorIndex < ColorCount; ColorIndex++)
+					// Find color in the palette or add it there
+					int ColorIndex = PaletteFetchColor(CurrentColor, Palette16, &ColorCount);
+					if (ColorIndex < 0)
 					{
-						if (CurrentColor == Palette16[ColorIndex])
-						{
-							IsPresent = true;
-							break;
-						}
+						// Too many colors
+						LogPrint(LOG_DETAIL, "Shrinking colors ...\n");
+						ShrinkTier++;
+						Complete = false;
+						break;
 					}
 
-					// Add color if it isn't present in the palette
-					if (IsPresent == false)
+					// Put pixel index in the 8-bit indexed bitmap
+					this->Bitmap[CurrentPixel] = (uchar)ColorIndex;
+				}
+
+				// Retry
+				if (Complete == false)
+					break;
+
+				// Compare finished line with original while it's still in cache
+				MeasureQuality(&DirectImage[LineOffset], &this->Bitmap[LineOffset], Palette16, this->Width, &Quality);
+			}
+		}
+		TraceSpan("quantize", TraceStart, this->Name, this->Width, this->Height);
+		this->Quality = Quality;
+		PrintQuality();
+
+		return RESULT_OK;
+	}
+
+	void EstimateTwiddledPVR(FILE ** ptrFile, ulong DataOffset, ulong PixelCount, sColorEstimate * ptrEstimate)	// Sample colors of twiddled PVR
+	{
+		ushort Chunk[PVR_TWIDDLE_CHUNK];
+		long long TraceStart = TraceClock();
+
+		// Small image is read whole, otherwise only sampled blocks are read
+		if (PixelCount <= QUANTIZER_SAMPLES)
+		{
+			for (ulong ChunkStart = 0; ChunkStart < PixelCount; ChunkStart += PVR_TWIDDLE_CHUNK)
+			{
+				ulong ChunkSize = (PixelCount - ChunkStart > PVR_TWIDDLE_CHUNK) ? PVR_TWIDDLE_CHUNK : PixelCount - ChunkStart;
+				FileReadBlock(ptrFile, Chunk, DataOffset + ChunkStart * 2, ChunkSize * 2);
+				ptrEstimate->AddSamples(Chunk, ChunkSize, 1);
+			}
+		}
+		else
+		{
+			// Run of twiddled texels is square block of image, runs are spread evenly over all of it
+			ulong RunCount = QUANTIZER_SAMPLES / QUANTIZER_SAMPLE_RUN;
+			for (ulong r = 0; r < RunCount; r++)
+			{
+				ulong RunStart = (ulong)((unsigned long long)PixelCount * r / RunCount) & ~(ulong)(QUANTIZER_SAMPLE_RUN - 1);
+				FileReadBlock(ptrFile, Chunk, DataOffset + RunStart * 2, QUANTIZER_SAMPLE_RUN * 2);
+				ptrEstimate->AddSamples(Chunk, QUANTIZER_SAMPLE_RUN, 1);
+			}
+			ptrEstimate->Exact = false;
+		}
+
+		TraceSpan("estimate", TraceStart, this->Name, 0, 0);
+	}
+
+	bool QuantizeClusters(const ushort * DirectImage)	// Convert 16-bit image with palette that is built by clustering
+	{
+		static thread_local sScratchBuffer MapScratch = { NULL, 0 };	// Palette index of every RGB565 color
+		ushort Palette16[256];
+		sQualityMetrics Quality;
+		ulong PixelCount = this->Width * this->Height;
+
+		uchar * ColorMap = (uchar *)MapScratch.Reserve(65536);
+		if (ColorMap == NULL)
+		{
+			LogPrint(LOG_ERROR, "Memory allocation failure!\n");
+			return false;
+		}
+
+		LogPrint(LOG_DETAIL, "Converting to 8-bit indexed format ...\n");
+		long long TraceStart = TraceClock();
+
+		// Palette keeps RGB565 colors, so they are expanded the same way as with other quantizers
+		ulong ColorCount = ClusterColors(DirectImage, PixelCount, Palette16, ColorMap, ProgOptions.TimeBudget);
+		if (ColorCount == 0)
+		{
+			LogPrint(LOG_ERROR, "Memory allocation failure!\n");
+			return false;
+		}
+		memset(this->Palette, 0x00, this->PaletteSize);
+		for (ulong i = 0; i < ColorCount; i++)
+		{
+			this->Palette[i * MDL_PLTE_ENTRY_SZ + 0] = (Palette16[i] >> 11) << 3;
+			this->Palette[i * MDL_PLTE_ENTRY_SZ + 1] = ((Palette16[i] >> 5) & 0x3F) << 2;
+			this->Palette[i * MDL_PLTE_ENTRY_SZ + 2] = (Palette16[i] & 0x1F) << 3;
+		}
+
+		// Map pixels and compare them with original line by line
+		Quality.Reset();
+		for (ulong Y = 0; Y < this->Height; Y++)
+		{
+			ulong LineOffset = Y * this->Width;
+
+			for (ulong X = 0; X < this->Width; X++)
+				this->Bitmap[LineOffset + X] = ColorMap[DirectImage[LineOffset + X]];
+
+			MeasureQuality(&DirectImage[LineOffset], &this->Bitmap[LineOffset], Palette16, this->Width, &Quality);
+		}
+		TraceSpan("cluster", TraceStart, this->Name, this->Width, this->Height);
+		this->Quality = Quality;
+		PrintQuality();
+
+		return true;
+	}
+
+	bool UpdateFromTwiddledPVR(FILE ** ptrFile, ulong DataOffset, sPVRImageHeader * ptrImageHeader, uchar ShrinkTier)	// Quantize square twiddled PVR while it's read, indices go straight to their linear positions
+	{
+		ushort Chunk[PVR_TWIDDLE_CHUNK];		// Twiddled texels from file
+		uchar ChunkIndices[PVR_TWIDDLE_CHUNK];	// Their palette indices (for quality metrics)
+		ulong PixelCount = ptrImageHeader->Width * ptrImageHeader->Height;
+
+		if (AllocateIndexed(ptrImageHeader->Width, ptrImageHeader->Height) == false)
+			return false;
+
+		LogPrint(LOG_DETAIL, "Converting to 8-bit indexed format ...\n");
+		long long TraceStart = TraceClock();
+
+		// Fetch colors
+		ushort Palette16[256];	// Temporary 16-bit palette
+		ushort ColorCount = 0;
+		sQualityMetrics Quality;
+		bool Complete = false;
+		while (Complete == false)
+		{
+			// This flag would be unset if image has too many colors
+			Complete = true;
+
+			// Clear palettes
+			memset(this->Palette, 0x00, this->PaletteSize);
+			memset(Palette16, 0x00, sizeof(Palette16));
+			ColorCount = 0;
+			Quality.Reset();
+
+			// Get next color shrink mask
+			ushort ShrinkMask = PVRShrinkMasks[ShrinkTier];
+
+			// Neighbouring texels of twiddled image are often the same, so last lookup is remembered
+			int LastColor = -1;
+			int LastIndex = 0;
+
+			// Walk texels in file (Morton) order, file is read again if palette overflows
+			for (ulong ChunkStart = 0; ChunkStart < PixelCount && Complete == true; ChunkStart += PVR_TWIDDLE_CHUNK)
+			{
+				ulong ChunkSize = PixelCount - ChunkStart;
+				if (ChunkSize > PVR_TWIDDLE_CHUNK)
+					ChunkSize = PVR_TWIDDLE_CHUNK;
+				FileReadBlock(ptrFile, Chunk, DataOffset + ChunkStart * 2, ChunkSize * 2);
+
+				for (ulong i = 0; i < ChunkSize; i++)
+				{
+					// Twiddled position keeps Y in even bits and X in odd bits
+					ulong Twiddled = ChunkStart + i;
+					ulong CurrentPixel = CompactBits(Twiddled) * this->Width + CompactBits(Twiddled >> 1);
+					ushort CurrentColor = Chunk[i] & ShrinkMask;
+
+					if (CurrentColor != LastColor)
 					{
-						if (ColorCount < 256)
-						{
-							// Add color to 16-bit palette
-							Palette16[ColorCount] = CurrentColor;
-
-							// Add color to 8-bit palette
-							// Get components
-							uchar R = CurrentColor >> 11;
-							uchar G = (CurrentColor >> 5) & 0x003F;
-							uchar B = CurrentColor & 0x001F;
-							// Convert to 24-bit format
-							R = R << 3;
-							G = G << 2;
-							B = B << 3;
-							// Write color to palette
-							this->Palette[ColorCount * MDL_PLTE_ENTRY_SZ + 0] = R;
-							this->Palette[ColorCount * MDL_PLTE_ENTRY_SZ + 1] = G;
-							this->Palette[ColorCount * MDL_PLTE_ENTRY_SZ + 2] = B;
-
-							// Update index and increment color count 
-							ColorIndex = ColorCount;
-							ColorCount++;
-						}
-						else
+						LastIndex = PaletteFetchColor(CurrentColor, Palette16, &ColorCount);
+						if (LastIndex < 0)
 						{
 							// Too many colors
-							puts("Shrinking colors ...");
+							LogPrint(LOG_DETAIL, "Shrinking colors ...\n");
 							ShrinkTier++;
 							Complete = false;
 							break;
 						}
+						LastColor = CurrentColor;
 					}
 
 					// Put pixel index in the 8-bit indexed bitmap
-					this->Bitmap[CurrentPixel] = ColorIndex;
+					this->Bitmap[CurrentPixel] = (uchar)LastIndex;
+					ChunkIndices[i] = (uchar)LastIndex;
 				}
 
-				// Retry
-				if (Complete == false)
-					break;
+				// Metrics don't depend on pixel order, so chunk is compared as it is
+				if (Complete == true)
+					MeasureQuality(Chunk, ChunkIndices, Palette16, ChunkSize, &Quality);
 			}
 		}
+		TraceSpan("untwiddle quantize", TraceStart, this->Name, this->Width, this->Height);
+		this->Quality = Quality;
+		PrintQuality();
+
+		return true;
+	}
+
+	void PrintQuality()		// Show how close 8-bit version is to PVR original
+	{
+		char PSNR[16];
 
-		// Free memory
-		free(DirectImage);
+		this->Quality.GetPSNR(PSNR, sizeof(PSNR));
+		LogPrint(LOG_DETAIL, "Quality: PSNR %s dB, max dE %.2f, changed %.2f%% \n", PSNR, this->Quality.GetMaxDeltaE(), this->Quality.GetChangedShare());
+	}
+
+	bool AllocateIndexed(ushort NewWidth, ushort NewHeight)	// Replace palette and bitmap with empty 8-bit ones
+	{
+		// Destroy old palette and bitmap
+		if (Palette != NULL)
+			free(Palette);
+		if (Bitmap != NULL)
+			free(Bitmap);
+
+		// Update properties
+		this->Height = NewHeight;
+		this->Width = NewWidth;
+		this->PaletteSize = _8BIT_PLTE_SZ * MDL_PLTE_ENTRY_SZ;
+
+		// Allocate new palette and bitmap
+		this->Palette = (uchar *)malloc(this->PaletteSize);
+		this->Bitmap = (uchar *)malloc(this->Width * this->Height);
+		if (this->Palette == NULL || this->Bitmap == NULL)
+		{
+			LogPrint(LOG_ERROR, "Memory allocation failure!\n");
+			return false;
+		}
 
 		return true;
 	}
 
+	int PaletteFetchColor(ushort Color, ushort * Palette16, ushort * ptrColorCount)	// Find 16-bit color in palette or add it there (-1 if palette is full)
+	{
+		ushort ColorIndex;
+
+		// Check if color is present in the palette
+		for (ColorIndex = 0; ColorIndex < *ptrColorCount; ColorIndex++)
+			if (Color == Palette16[ColorIndex])
+				return ColorIndex;
+
+		// Add color if it isn't present in the palette
+		if (*ptrColorCount == 256)
+			return -1;
+
+		// Add color to 16-bit palette
+		Palette16[ColorIndex] = Color;
+
+		// Add color to 8-bit palette
+		// Get components
+		uchar R = Color >> 11;
+		uchar G = (Color >> 5) & 0x003F;
+		uchar B = Color & 0x001F;
+		// Convert to 24-bit format
+		R = R << 3;
+		G = G << 2;
+		B = B << 3;
+		// Write color to palette
+		this->Palette[ColorIndex * MDL_PLTE_ENTRY_SZ + 0] = R;
+		this->Palette[ColorIndex * MDL_PLTE_ENTRY_SZ + 1] = G;
+		this->Palette[ColorIndex * MDL_PLTE_ENTRY_SZ + 2] = B;
+
+		// Increment color count
+		(*ptrColorCount)++;
+
+		return ColorIndex;
+	}
+
+	ulong CompactBits(ulong Twiddled)	// Gather even bits of value (reverse of Untwiddle)
+	{
+		Twiddled &= 0x55555555;
+		Twiddled = (Twiddled | (Twiddled >> 1)) & 0x33333333;
+		Twiddled = (Twiddled | (Twiddled >> 2)) & 0x0F0F0F0F;
+		Twiddled = (Twiddled | (Twiddled >> 4)) & 0x00FF00FF;
+		Twiddled = (Twiddled | (Twiddled >> 8)) & 0x0000FFFF;
+
+		return Twiddled;
+	}
+
 	ulong TwiddleToLinear(ushort X, ushort Y)
 	{
 		return (Untwiddle(X) << 1) | Untwiddle(Y);